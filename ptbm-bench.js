@@ -0,0 +1,77 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+// Compares the scalar (ptbm.js) and the SIMD (ptbm-simd.js) build of the
+// emscripten module on a trace in node:
+//
+//   node ptbm-bench.js TRACE [VIRTUAL_PORTS] [PASSES]
+//
+// countTrace parses and processes the headers, processTrace formats the
+// outputs too. The time includes copying the trace into the module.
+
+var fs = require("fs");
+var path = require("path");
+
+var simdTest = new Uint8Array([0,97,115,109,1,0,0,0,1,5,1,96,0,1,123,3,
+  2,1,0,10,10,1,8,0,65,0,253,15,253,98,11]);
+
+if (process.argv.length < 3) {
+  console.error("Usage: node ptbm-bench.js TRACE [VIRTUAL_PORTS] [PASSES]");
+  process.exit(1);
+}
+
+var trace = fs.readFileSync(process.argv[2], "utf8");
+var virtualPorts = process.argv[3] || "";
+var passes = parseInt(process.argv[4] || "5", 10);
+var headers = trace.split("\n").filter(function(line) {
+  return line.trim().length;
+}).length;
+
+// Seconds f takes
+function time(f) {
+  var start = process.hrtime.bigint();
+  f();
+  return Number(process.hrtime.bigint() - start) / 1e9;
+}
+
+async function bench(file) {
+  var Module = await require(path.resolve(file))();
+  var outputs = Module.ptbm_em_countTrace(trace, virtualPorts);   // Warm up
+  var countSecs = 0, processSecs = 0;
+
+  for (var n = 0; n < passes; n++) {
+    countSecs += time(function() {
+      Module.ptbm_em_countTrace(trace, virtualPorts);
+    });
+    processSecs += time(function() {
+      Module.ptbm_em_processTrace(trace, virtualPorts);
+    });
+  }
+
+  console.log(file + ": simd: " + Module.ptbm_em_simd() + ", " +
+              "headers: " + headers + ", " +
+              "outputs: " + outputs + ", " +
+              "count headers/s: " + Math.round(headers * passes / countSecs) +
+              ", process headers/s: " +
+              Math.round(headers * passes / processSecs));
+}
+
+async function main() {
+  await bench("ptbm.js");
+
+  if (!WebAssembly.validate(simdTest))
+    console.log("ptbm-simd.js: WebAssembly SIMD128 is not supported");
+  else
+    await bench("ptbm-simd.js");
+}
+
+main().catch(function(e) {
+  console.error(e);
+  process.exit(1);
+});
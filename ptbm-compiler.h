@@ -0,0 +1,572 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_COMPILER_H
+#define PTBM_COMPILER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+
+#include "ptbm.h"
+#include "ptbm-topology.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+// Compiles the headers of a multicast group: the shortest path tree from the
+// source (link delays as distances) is cut to the paths of the destinations,
+// the ports of the routers are mapped to port numbers (virtual ports of the
+// routers included) and the tree is encoded by the Ptbm.
+//
+// The shortest path tree of each source is cached until invalidate(), a
+// removed or added link only repairs the parts of the cached trees it
+// changes.
+template<class P>
+class HeaderCompiler
+{
+
+public:
+
+typedef typename P::header_type header_type;
+
+/// The shortest path tree of a source (or any other routing tree from it)
+struct Spt
+{
+  vector<uint64_t> dist;
+  vector<int> parent;             // -1 for the source and unreachable routers
+  vector<unsigned int> port;      // Port of the parent towards the router
+};
+
+/// A router whose path changed in the shortest path tree of a source
+struct TreeChange
+{
+  int source;
+  int router;
+  int oldParent;                  // -1 if the router was unreachable
+  unsigned int oldPort;
+};
+
+/// The textual form of a header
+struct TextHeader
+{
+  string brackets;
+  vector<unsigned int> nums;
+};
+
+explicit HeaderCompiler(const Topology &topology, bool compact = false)
+  : ptopology(topology),
+    pcompact(compact),
+    pdest(topology.routerCount(), 0),
+    pvisited(topology.routerCount(), 0),
+    pinterior(topology.routerCount(), 0),
+    pchanged(topology.routerCount(), 0)
+{
+  ppt.setCompactLayout(compact);
+  buildIncoming();
+}
+
+/// Gets the shortest path tree of a source (router index)
+const Spt &
+shortestPathTree(int source)
+{
+  auto it = pcache.find(source);
+
+  if(it != pcache.end())
+    return it->second;
+
+  Spt &spt = pcache[source];
+  computeSpt(source, spt);
+  return spt;
+}
+
+/// Drops the cached shortest path trees (after a topology change)
+void
+invalidate()
+{
+  pcache.clear();
+  buildIncoming();
+}
+
+/// Repairs the cached shortest path trees after a link was removed from the
+/// topology: only the subtree below the link is computed again
+vector<TreeChange>
+linkRemoved(int router, unsigned int port, int neighbor)
+{
+  vector<TreeChange> changes;
+  vector<Incoming> &incoming = pincoming[neighbor];
+
+  incoming.erase(remove_if(incoming.begin(), incoming.end(),
+                           [router, port](const Incoming &in)
+                           { return in.router == router && in.port == port; }),
+                 incoming.end());
+
+  for(auto &it : pcache)
+  {
+    Spt &spt = it.second;
+
+    if(spt.parent[neighbor] == router && spt.port[neighbor] == port)
+      repairSubtree(it.first, neighbor, spt, changes);
+  }
+
+  return changes;
+}
+
+/// Updates the cached shortest path trees after a link was added to the
+/// topology: only the routers it brings closer are computed again
+vector<TreeChange>
+linkAdded(int router, unsigned int port)
+{
+  vector<TreeChange> changes;
+  unsigned int delay;
+  int neighbor = ptopology.neighbor(router, port, delay);
+
+  if(neighbor < 0)
+    throw runtime_error("Port " + to_string(port) + " of router " +
+                        to_string(ptopology.id(router)) + " is not connected");
+
+  pincoming[neighbor].push_back({router, port, delay});
+
+  if(!usablePort(router, port))
+    return changes;
+
+  for(auto &it : pcache)
+  {
+    int source = it.first;
+    Spt &spt = it.second;
+
+    if(spt.dist[router] == UINT64_MAX || neighbor == source)
+      continue;
+
+    ++pgeneration;
+    Queue queue;
+
+    if(relax(source, router, port, spt.dist[router] + delay, neighbor, spt,
+             changes))
+      queue.push(Item(spt.dist[neighbor], neighbor));
+
+    propagate(source, queue, spt, changes, nullptr);
+  }
+
+  return changes;
+}
+
+/// Gets the links (router, port) of the trees of the last compileText()
+const vector<pair<int, unsigned int>> &
+treeLinks() const
+{
+  return ptreeLinks;
+}
+
+/// Gets the trees (textual form) delivering from a source to the
+/// destinations (router indexes). Usually one tree, more if a destination is
+/// on the path to another one: a router receiving a non-empty header does
+/// not keep a copy, so these destinations need trees of their own.
+vector<TextHeader>
+compileText(int source, const vector<int> &destinations)
+{
+  return compileText(source, destinations, shortestPathTree(source));
+}
+
+/// Gets the trees (textual form) of a routing tree of the source
+vector<TextHeader>
+compileText(int source, const vector<int> &destinations, const Spt &spt)
+{
+  vector<TextHeader> trees;
+  vector<int> pending(destinations);
+
+  ptreeLinks.clear();
+
+  sort(pending.begin(), pending.end());
+  pending.erase(unique(pending.begin(), pending.end()), pending.end());
+
+  while(!pending.empty())
+  {
+    vector<int> next, leaves;
+
+    ++pgeneration;
+
+    for(int dest : pending)
+    {
+      if(dest != source && spt.parent[dest] < 0)
+        throw runtime_error("Router " + to_string(ptopology.id(dest)) +
+                            " is unreachable from router " +
+                            to_string(ptopology.id(source)));
+      pdest[dest] = pgeneration;
+    }
+
+    // Destinations on the path to another one are delivered by the next tree
+    for(int dest : pending)
+      for(int r = dest; r != source && pvisited[r] != pgeneration;)
+      {
+        pvisited[r] = pgeneration;
+        r = spt.parent[r];
+
+        if(pdest[r] == pgeneration && pinterior[r] != pgeneration)
+        {
+          pinterior[r] = pgeneration;
+          next.push_back(r);
+        }
+      }
+
+    for(int dest : pending)
+      if(pinterior[dest] != pgeneration)
+        leaves.push_back(dest);
+
+    TextHeader tree;
+    pruneTo(source, leaves, spt);
+
+    for(auto &it : pchildren)
+      for(int child : it.second)
+        ptreeLinks.push_back(make_pair(it.first, spt.port[child]));
+
+    emitForest(source, spt, tree);
+    trees.push_back(tree);
+
+    sort(next.begin(), next.end());
+    pending = next;
+  }
+
+  return trees;
+}
+
+/// Gets the headers delivering from a source to the destinations (fixed
+/// layout trees not fitting in a header are fragmented)
+vector<header_type>
+compile(int source, const vector<int> &destinations)
+{
+  return compile(source, destinations, shortestPathTree(source));
+}
+
+/// Gets the headers of a routing tree of the source, sets the number of
+/// open brackets of the trees if openBrackets is given
+vector<header_type>
+compile(
+    int source,
+    const vector<int> &destinations,
+    const Spt &spt,
+    int *openBrackets = nullptr)
+{
+  vector<header_type> headers;
+
+  if(openBrackets)
+    *openBrackets = 0;
+
+  for(const TextHeader &tree : compileText(source, destinations, spt))
+  {
+    if(openBrackets)
+      *openBrackets += tree.nums.size();
+
+    if(pcompact)
+    {
+      ppt.setHeader(tree.brackets, tree.nums);
+      headers.push_back(ppt.getHeaderBits());
+      continue;
+    }
+
+    vector<header_type> fragments = ppt.fragmentHeader(tree.brackets, tree.nums);
+    headers.insert(headers.end(), fragments.begin(), fragments.end());
+  }
+
+  return headers;
+}
+
+/// Can a router send on a port with a Ptbm header
+bool
+usablePort(int router, unsigned int port) const
+{
+  unsigned int ports = 1u << P::PORT_BITS;
+
+  if(port < ports)
+    return !ptopology.isVirtualPort(router, port);
+
+  // Port of a virtual port: virtualPortPair + (port+1) * ports
+  unsigned long long vport = port / ports - 1;
+
+  return vport < ports && ptopology.isVirtualPort(router, vport);
+}
+
+private:
+
+// A link towards a router
+struct Incoming
+{
+  int router;
+  unsigned int port;
+  unsigned int delay;
+};
+
+typedef tuple<uint64_t, int> Item;
+typedef priority_queue<Item, vector<Item>, greater<Item>> Queue;
+
+const Topology &ptopology;
+bool pcompact;
+P ppt;
+unordered_map<int, Spt> pcache;
+
+// Tree of the group being compiled (marks valid for the current generation)
+vector<unsigned int> pdest;
+vector<unsigned int> pvisited;
+vector<unsigned int> pinterior;
+unsigned int pgeneration = 0;
+unordered_map<int, vector<int>> pchildren;
+vector<pair<int, unsigned int>> ptreeLinks;
+
+// Links towards the routers and the marks of the routers changed by a repair
+vector<vector<Incoming>> pincoming;
+vector<unsigned int> pchanged;
+
+void
+buildIncoming()
+{
+  pincoming.assign(ptopology.routerCount(), {});
+
+  for(int r=0; r<ptopology.routerCount(); r++)
+    for(const Topology::Link &link : ptopology.links(r))
+      pincoming[link.neighbor].push_back({r, link.port, link.delay});
+}
+
+/// Sets a parent of a router if it is closer, or as close and lower (by
+/// router index, then port) as computeSpt() would choose it. Returns true if
+/// the router got closer.
+bool
+relax(
+    int source,
+    int parent,
+    unsigned int port,
+    uint64_t dist,
+    int router,
+    Spt &spt,
+    vector<TreeChange> &changes)
+{
+  if(dist > spt.dist[router] ||
+     (dist == spt.dist[router] &&
+      (parent > spt.parent[router] ||
+       (parent == spt.parent[router] && port >= spt.port[router]))))
+    return false;
+
+  if(pchanged[router] != pgeneration)
+  {
+    pchanged[router] = pgeneration;
+    changes.push_back({source, router, spt.parent[router], spt.port[router]});
+  }
+
+  bool closer = dist < spt.dist[router];
+
+  spt.dist[router] = dist;
+  spt.parent[router] = parent;
+  spt.port[router] = port;
+  return closer;
+}
+
+/// Continues Dijkstra's algorithm from the queued routers, only the routers
+/// marked by region (if given) may change
+void
+propagate(
+    int source,
+    Queue &queue,
+    Spt &spt,
+    vector<TreeChange> &changes,
+    const vector<unsigned int> *region)
+{
+  while(!queue.empty())
+  {
+    uint64_t dist;
+    int router;
+    tie(dist, router) = queue.top();
+    queue.pop();
+
+    if(dist > spt.dist[router])
+      continue;
+
+    for(const Topology::Link &link : ptopology.links(router))
+    {
+      if(link.neighbor == source ||
+         (region && (*region)[link.neighbor] != pgeneration) ||
+         !usablePort(router, link.port))
+        continue;
+
+      if(relax(source, router, link.port, dist + link.delay, link.neighbor,
+               spt, changes))
+        queue.push(Item(spt.dist[link.neighbor], link.neighbor));
+    }
+  }
+}
+
+/// Computes the subtree of a router again (its link to the parent is gone)
+void
+repairSubtree(int source, int root, Spt &spt, vector<TreeChange> &changes)
+{
+  ++pgeneration;
+
+  // The subtree: the routers whose parent link is from the subtree
+  vector<int> subtree(1, root);
+
+  for(size_t i=0; i<subtree.size(); i++)
+    for(const Topology::Link &link : ptopology.links(subtree[i]))
+      if(spt.parent[link.neighbor] == subtree[i] &&
+         spt.port[link.neighbor] == link.port &&
+         pvisited[link.neighbor] != pgeneration)
+      {
+        pvisited[link.neighbor] = pgeneration;
+        subtree.push_back(link.neighbor);
+      }
+
+  pvisited[root] = pgeneration;
+
+  for(int r : subtree)
+  {
+    pchanged[r] = pgeneration;
+    changes.push_back({source, r, spt.parent[r], spt.port[r]});
+    spt.dist[r] = UINT64_MAX;
+    spt.parent[r] = -1;
+  }
+
+  // Distances through the routers outside of the subtree first
+  Queue queue;
+
+  for(int r : subtree)
+  {
+    for(const Incoming &in : pincoming[r])
+      if(pvisited[in.router] != pgeneration &&
+         spt.dist[in.router] != UINT64_MAX &&
+         usablePort(in.router, in.port))
+        relax(source, in.router, in.port, spt.dist[in.router] + in.delay, r,
+              spt, changes);
+
+    if(spt.dist[r] != UINT64_MAX)
+      queue.push(Item(spt.dist[r], r));
+  }
+
+  propagate(source, queue, spt, changes, &pvisited);
+}
+
+void
+computeSpt(int source, Spt &spt)
+{
+  int n = ptopology.routerCount();
+  typedef tuple<uint64_t, int> Item;
+  priority_queue<Item, vector<Item>, greater<Item>> queue;
+
+  spt.dist.assign(n, UINT64_MAX);
+  spt.parent.assign(n, -1);
+  spt.port.assign(n, 0);
+
+  spt.dist[source] = 0;
+  queue.push(Item(0, source));
+
+  while(!queue.empty())
+  {
+    uint64_t dist;
+    int router;
+    tie(dist, router) = queue.top();
+    queue.pop();
+
+    if(dist > spt.dist[router])
+      continue;
+
+    for(const Topology::Link &link : ptopology.links(router))
+    {
+      if(!usablePort(router, link.port))
+        continue;
+
+      uint64_t d = dist + link.delay;
+
+      // Ties go to the lower router index, so the tree is deterministic
+      if(d < spt.dist[link.neighbor] ||
+         (d == spt.dist[link.neighbor] && link.neighbor != source &&
+          router < spt.parent[link.neighbor]))
+      {
+        if(d < spt.dist[link.neighbor])
+          queue.push(Item(d, link.neighbor));
+
+        spt.dist[link.neighbor] = d;
+        spt.parent[link.neighbor] = router;
+        spt.port[link.neighbor] = link.port;
+      }
+    }
+  }
+}
+
+/// Keeps only the paths to the leaves in the tree of the group
+void
+pruneTo(int source, const vector<int> &leaves, const Spt &spt)
+{
+  pchildren.clear();
+
+  for(int leaf : leaves)
+    for(int r = leaf; r != source; r = spt.parent[r])
+    {
+      vector<int> &children = pchildren[spt.parent[r]];
+
+      if(find(children.begin(), children.end(), r) != children.end())
+        break;
+      children.push_back(r);
+    }
+}
+
+/// Emits the subtrees of a router in the group tree (ordered by port)
+void
+emitForest(int router, const Spt &spt, TextHeader &tree)
+{
+  auto it = pchildren.find(router);
+
+  if(it == pchildren.end())
+    return;
+
+  vector<int> children = it->second;
+  unsigned int ports = 1u << P::PORT_BITS;
+
+  sort(children.begin(), children.end(), [&spt](int a, int b)
+       { return spt.port[a] < spt.port[b]; });
+
+  for(size_t i=0; i<children.size();)
+  {
+    unsigned int port = spt.port[children[i]];
+
+    if(port < ports)
+    {
+      tree.brackets.push_back('(');
+      tree.nums.push_back(port);
+      emitForest(children[i++], spt, tree);
+      tree.brackets.push_back(')');
+      continue;
+    }
+
+    // The ports of a virtual port under one node
+    unsigned int vport = port / ports - 1;
+
+    tree.brackets.push_back('(');
+    tree.nums.push_back(vport);
+
+    for(; i<children.size() && spt.port[children[i]] / ports - 1 == vport; i++)
+    {
+      tree.brackets.push_back('(');
+      tree.nums.push_back(spt.port[children[i]] % ports);
+      emitForest(children[i], spt, tree);
+      tree.brackets.push_back(')');
+    }
+
+    tree.brackets.push_back(')');
+  }
+}
+
+};
+
+}
+
+#endif // PTBM_COMPILER_H
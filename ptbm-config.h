@@ -0,0 +1,204 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_CONFIG_H
+#define PTBM_CONFIG_H
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "ptbm-rcu.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+// The configuration of a router, never changed after it was published
+struct RouterConfig
+{
+  vector<unsigned int> virtualPorts;
+  uint64_t version = 0;         // Set by publish
+
+  /// Parses the virtual ports separated by commas or white space, lines
+  /// starting with # are comments
+  static RouterConfig
+  parse(const string &text)
+  {
+    RouterConfig config;
+    stringstream lines(text);
+
+    for(string line; getline(lines, line);)
+    {
+      if(line.find_first_not_of(" \t\r") == string::npos ||
+         line[line.find_first_not_of(" \t\r")] == '#')
+        continue;
+
+      for(char &c : line)
+        if(c == ',')
+          c = ' ';
+
+      stringstream fields(line);
+
+      for(string field; fields >> field;)
+      {
+        size_t end;
+        unsigned long port;
+
+        try
+        {
+          port = stoul(field, &end);
+        }
+        catch(exception &)
+        {
+          end = 0;
+        }
+
+        if(!end || end != field.size() || port > UINT32_MAX)
+          throw runtime_error("Invalid virtual port: " + field);
+
+        config.virtualPorts.push_back((unsigned int)port);
+      }
+    }
+
+    return config;
+  }
+
+  /// Reads a configuration file (see parse)
+  static RouterConfig
+  load(const string &path)
+  {
+    ifstream file(path);
+
+    if(!file)
+      throw runtime_error("Cannot open configuration: " + path);
+
+    stringstream text;
+    text << file.rdbuf();
+    return parse(text.str());
+  }
+};
+
+// The current configuration of the routers, replaced while they process.
+//
+// A new configuration is published by an atomic pointer store, the old one
+// is freed by RCU when no reader holds it any more. A reader (one of the
+// reader slots of the RCU) checks the version once per batch and copies the
+// configuration into its processor only if it changed, so processing takes no
+// locks and never sees a half written configuration.
+class ConfigStore
+{
+
+public:
+
+/// A store of readers reader slots, reload() reads path (if not empty)
+ConfigStore(int readers, RouterConfig config, const string &path = "")
+  : prcu(readers),
+    ppath(path)
+{
+  config.version = 1;
+  pcurrent.store(new RouterConfig(move(config)));
+}
+
+ConfigStore(const ConfigStore &) = delete;
+ConfigStore &operator=(const ConfigStore &) = delete;
+
+/// The readers are to be done
+~ConfigStore()
+{
+  delete pcurrent.load();
+}
+
+/// Publishes a new configuration, returns its version
+uint64_t
+publish(RouterConfig config)
+{
+  lock_guard<mutex> lock(pmutex);
+
+  config.version = pversion.load(memory_order_relaxed) + 1;
+
+  RouterConfig *old = pcurrent.exchange(new RouterConfig(move(config)),
+                                        memory_order_seq_cst);
+  uint64_t version = old->version + 1;
+
+  // old may be freed by reclaim
+  pversion.store(version, memory_order_release);
+  prcu.retire([old]() { delete old; });
+  prcu.reclaim();
+  return version;
+}
+
+/// Publishes the configuration file again, returns its version
+uint64_t
+reload()
+{
+  if(ppath.empty())
+    throw runtime_error("There is no configuration file to reload");
+
+  return publish(RouterConfig::load(ppath));
+}
+
+uint64_t
+version() const
+{
+  return pversion.load(memory_order_acquire);
+}
+
+/// A copy of the current configuration
+RouterConfig
+current(int reader)
+{
+  Rcu::ReadGuard guard(prcu, reader);
+  return *pcurrent.load(memory_order_seq_cst);
+}
+
+/// Sets the current configuration on a processor of a reader slot if it is
+/// newer than version (0: never set), returns true if it was set
+template<class P>
+bool
+apply(P &ptbm, int reader, uint64_t &version)
+{
+  if(version == pversion.load(memory_order_acquire))
+    return false;
+
+  Rcu::ReadGuard guard(prcu, reader);
+  const RouterConfig *config = pcurrent.load(memory_order_seq_cst);
+
+  ptbm.setVirtualPorts(config->virtualPorts);
+  version = config->version;
+  return true;
+}
+
+/// Old configurations waiting for their readers
+size_t
+pending()
+{
+  prcu.reclaim();
+  return prcu.pending();
+}
+
+private:
+
+Rcu prcu;
+string ppath;
+mutex pmutex;
+atomic<RouterConfig *> pcurrent{nullptr};
+atomic<uint64_t> pversion{1};
+
+};
+
+}
+
+#endif // PTBM_CONFIG_H
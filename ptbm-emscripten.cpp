@@ -101,11 +101,171 @@ string ptbm_em_processText(string text, string virtualPorts)
   return ptbm_em_processedHeader(pt);
 }
 
+static const int ptbm_em_headerBits = ptbm::Ptbm<>::HEADER_BYTES * 8;
+
+/// Parses the bits of a header (the first character is the last bit, as in
+/// bitset) into binary form (see Ptbm::headerToBytes), false if a character
+/// is not 0 or 1
+bool ptbm_em_parseBits(const char *text, unsigned char *bytes)
+{
+#ifdef __wasm_simd128__
+  const v128_t zero = wasm_i8x16_splat('0');
+  const v128_t one = wasm_i8x16_splat('1');
+
+  // 16 characters at a time, reversed they are the bits of 2 bytes
+  for(int k=0; k<ptbm_em_headerBits/16; k++)
+  {
+    v128_t chars = wasm_v128_load(text + 16*k);
+    v128_t ones = wasm_i8x16_eq(chars, one);
+
+    if(!wasm_i8x16_all_true(wasm_v128_or(ones, wasm_i8x16_eq(chars, zero))))
+      return false;
+
+    ones = wasm_i8x16_shuffle(ones, ones,
+                              15, 14, 13, 12, 11, 10, 9, 8,
+                              7, 6, 5, 4, 3, 2, 1, 0);
+
+    int mask = wasm_i8x16_bitmask(ones);
+    int byte = ptbm_em_headerBits/8 - 2 - 2*k;
+
+    bytes[byte] = mask;
+    bytes[byte+1] = mask >> 8;
+  }
+#else
+  fill(bytes, bytes + ptbm_em_headerBits/8, 0);
+
+  for(int i=0; i<ptbm_em_headerBits; i++)
+  {
+    if(text[i] != '0' && text[i] != '1')
+      return false;
+
+    int bit = ptbm_em_headerBits - 1 - i;
+    bytes[bit/8] |= (text[i] == '1') << (bit%8);
+  }
+#endif
+
+  return true;
+}
+
+/// Processes the headers of a trace (TIME ROUTER BITS or BITS per line) and
+/// calls f(packet, outputs, error) on each (error: empty or the message of an
+/// invalid header)
+template<class F>
+void ptbm_em_walkTrace(const string &trace, string virtualPorts, F f)
+{
+  typedef ptbm::Ptbm<> P;
+
+  vector<unsigned int> nums;
+  ptbm_em_readIntoVector(virtualPorts, nums);
+
+  P::Context context(nums);
+  P::Scratch scratch;
+  unsigned char bytes[P::HEADER_BYTES];
+  long long packet = 0;
+
+  for(size_t pos=0; pos<trace.size();)
+  {
+    size_t next = trace.find('\n', pos);
+    if(next == string::npos)
+      next = trace.size();
+
+    size_t end = next == pos ? string::npos :
+                               trace.find_last_not_of(" \t\r", next - 1);
+
+    if(end == string::npos || end < pos)
+    {
+      pos = next + 1;
+      continue;
+    }
+
+    size_t begin = trace.find_last_of(" \t", end);
+    begin = begin == string::npos || begin < pos ? pos : begin + 1;
+
+    string error;
+
+    scratch.ports.clear();
+    scratch.subtrees.clear();
+
+    if(end + 1 - begin != (size_t)ptbm_em_headerBits ||
+       !ptbm_em_parseBits(trace.data() + begin, bytes))
+      error = "Invalid header bits";
+    else
+      try
+      {
+        P::process(context, P::headerFromBytes(bytes), scratch);
+      }
+      catch(exception &e)
+      {
+        scratch.ports.clear();
+        scratch.subtrees.clear();
+        error = e.what();
+      }
+
+    f(packet++, scratch, error);
+    pos = next + 1;
+  }
+}
+
+/// Processes a trace, returns the outputs (PACKET PORT SUBTREE)
+string ptbm_em_processTrace(string trace, string virtualPorts)
+{
+  ptbm::Ptbm<> printer;
+  string lines;
+
+  ptbm_em_walkTrace(trace, virtualPorts,
+      [&](long long packet, const ptbm::Ptbm<>::Scratch &outputs,
+          const string &error)
+  {
+    if(!error.empty())
+      lines += to_string(packet) + " invalid: " + error + "\n";
+
+    for(size_t n=0; n<outputs.ports.size(); n++)
+    {
+      printer.setHeaderBits(outputs.subtrees[n]);
+
+      string subtree = printer.getHeaderString();
+
+      lines += to_string(packet) + " " + to_string(outputs.ports[n]) + " " +
+               (subtree.size() ? subtree : "*") + "\n";
+    }
+  });
+
+  return lines;
+}
+
+/// Processes a trace, returns the number of outputs (for benchmarks, it
+/// formats nothing)
+double ptbm_em_countTrace(string trace, string virtualPorts)
+{
+  double outputs = 0;
+
+  ptbm_em_walkTrace(trace, virtualPorts,
+      [&](long long, const ptbm::Ptbm<>::Scratch &scratch, const string &)
+  {
+    outputs += scratch.ports.size();
+  });
+
+  return outputs;
+}
+
+/// True in the SIMD build (-msimd128)
+bool ptbm_em_simd()
+{
+#ifdef __wasm_simd128__
+  return true;
+#else
+  return false;
+#endif
+}
+
 EMSCRIPTEN_BINDINGS(ptbm_module) {
     emscripten::function("ptbm_em_textFromBitset", &ptbm_em_textFromBitset);
     emscripten::function("ptbm_em_bitsetFromText", &ptbm_em_bitsetFromText);
     emscripten::function("ptbm_em_processBitset", &ptbm_em_processBitset);
     emscripten::function("ptbm_em_processText", &ptbm_em_processText);
+    emscripten::function("ptbm_em_processTrace", &ptbm_em_processTrace);
+    emscripten::function("ptbm_em_countTrace", &ptbm_em_countTrace);
+    emscripten::function("ptbm_em_simd", &ptbm_em_simd);
 }
 
 #endif
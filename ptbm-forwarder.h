@@ -0,0 +1,1083 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_FORWARDER_H
+#define PTBM_FORWARDER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#define PTBM_FORWARDER
+#endif
+
+#include "ptbm-config.h"
+#include "ptbm-outqueue.h"
+#include "ptbm-packet.h"
+#include "ptbm-uring.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+#ifdef PTBM_FORWARDER
+
+/// Parses an IPv4 address and port (a.b.c.d:port)
+inline sockaddr_in
+parseUdpAddress(const string &text)
+{
+  sockaddr_in addr;
+  size_t colon = text.rfind(':');
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+
+  if(colon == string::npos ||
+     inet_pton(AF_INET, text.substr(0, colon).c_str(), &addr.sin_addr) != 1)
+    throw runtime_error("Invalid address (a.b.c.d:port): " + text);
+
+  char *end;
+  unsigned long port = strtoul(text.c_str() + colon + 1, &end, 10);
+
+  if(*end || end == text.c_str() + colon + 1 || port > 65535)
+    throw runtime_error("Invalid address (a.b.c.d:port): " + text);
+
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+// A software forwarder: receives UDP datagrams of a header followed by a
+// payload, processes the header and sends a datagram of the output subtree and
+// the same payload for each output port to the UDP destination of the port.
+//
+// The payloads are sent from the receive buffers (no copies), by one of the
+// engines:
+//
+//   - MMSG: epoll wakes the forwarder, datagrams are received by recvmmsg and
+//     sent by sendmmsg in batches
+//   - URING: a multishot receive fills the buffers of a provided buffer ring,
+//     the sends of the outputs are submitted in one system call with the
+//     wait for the next completions, the output packets share the payload
+//     of a buffer, which is given back to the ring when their sends
+//     completed
+//
+// The latency of a packet is measured from the kernel receive timestamp to
+// the submission of its outputs.
+template<class P>
+class Forwarder
+{
+
+public:
+
+typedef typename P::header_type header_type;
+typedef OutputQueues<Packet<P>> Queues;
+
+enum Engine
+{
+  AUTO,         // URING if the kernel has it, MMSG otherwise
+  MMSG,
+  URING
+};
+
+/// Largest datagram received
+static const size_t MAX_DATAGRAM = 65536;
+
+struct Stats
+{
+  long long packets = 0;        // Datagrams received
+  long long outputs = 0;        // Outputs of the headers
+  long long sent = 0;           // Datagrams sent
+  long long unmapped = 0;       // Outputs on a port without a destination
+  long long dropped = 0;        // Outputs dropped by a full port queue
+  long long invalid = 0;        // Shorter than a header or invalid headers
+  long long sendErrors = 0;
+  long long batches = 0;        // Receive calls returning datagrams
+
+  // Latency histogram, bucket i counts [2^i, 2^(i+1)) ns
+  long long latency[64] = {};
+  long long latencyCount = 0;
+  double latencySum = 0;        // ns
+  uint64_t latencyMax = 0;
+
+  void
+  addLatency(uint64_t ns)
+  {
+    int bucket = 0;
+
+    while(bucket < 63 && (ns >> (bucket + 1)))
+      ++bucket;
+
+    ++latency[bucket];
+    ++latencyCount;
+    latencySum += ns;
+
+    if(ns > latencyMax)
+      latencyMax = ns;
+  }
+
+  /// Upper bound of the q quantile of the latency in ns
+  uint64_t
+  percentile(double q) const
+  {
+    long long rank = (long long)(q * latencyCount), seen = 0;
+
+    for(int bucket=0; bucket<64; bucket++)
+      if((seen += latency[bucket]) > rank)
+        return min(latencyMax, ((uint64_t)2 << bucket) - 1);
+
+    return latencyMax;
+  }
+
+  void
+  print(ostream &out, double seconds) const
+  {
+    out << "packets: " << packets << ", "
+        << "outputs: " << outputs << ", "
+        << "sent: " << sent << ", "
+        << "unmapped: " << unmapped << ", "
+        << "dropped: " << dropped << ", "
+        << "invalid: " << invalid << ", "
+        << "send errors: " << sendErrors << endl
+        << "packets/s: " << (seconds > 0 ? packets / seconds : 0) << ", "
+        << "sent/s: " << (seconds > 0 ? sent / seconds : 0) << ", "
+        << "packets/batch: " << (batches ? (double)packets / batches : 0)
+        << endl
+        << "latency avg: "
+        << (latencyCount ? latencySum / latencyCount / 1000 : 0) << " us, "
+        << "p50: " << percentile(0.5) / 1000.0 << " us, "
+        << "p99: " << percentile(0.99) / 1000.0 << " us, "
+        << "max: " << latencyMax / 1000.0 << " us" << endl;
+  }
+};
+
+/// Listens on an address (port 0: any free port) and sends the outputs of the
+/// ports to the destinations, batch datagrams per system call (MMSG)
+Forwarder(
+    P &ptbm,
+    const string &address,
+    const map<unsigned int, sockaddr_in> &destinations,
+    int batch = 64,
+    Engine engine = AUTO)
+  : pptbm(ptbm),
+    pdestinations(destinations),
+    pbatch(batch),
+    pengine(engine),
+    pqueues(1024, Queues::DROP_TAIL, 1500, wireSize)
+{
+  if(batch < 1 || batch > 1024)
+    throw runtime_error("Batch size must be between 1 and 1024");
+
+  sockaddr_in addr = parseUdpAddress(address);
+
+  psocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if(psocket < 0)
+    throw runtime_error(string("Cannot create socket: ") + strerror(errno));
+
+  int on = 1, bufferSize = 8 << 20;
+
+  setsockopt(psocket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+  setsockopt(psocket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+  setsockopt(psocket, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+
+  if(bind(psocket, (sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    string error = strerror(errno);
+    close(psocket);
+    throw runtime_error("Cannot bind " + address + ": " + error);
+  }
+
+  pstop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if(pstop < 0)
+  {
+    close(psocket);
+    throw runtime_error(string("Cannot create eventfd: ") + strerror(errno));
+  }
+
+#ifdef PTBM_URING
+  if(engine != MMSG)
+  {
+    try
+    {
+      setupUring();
+      pengine = URING;
+    }
+    catch(runtime_error &)
+    {
+      puring.reset();
+
+      if(engine == URING)
+      {
+        close(psocket);
+        close(pstop);
+        throw;
+      }
+    }
+  }
+#endif
+
+  if(pengine == URING)
+    return;
+
+  if(engine == URING)
+  {
+    close(psocket);
+    close(pstop);
+    throw runtime_error("io_uring is not available");
+  }
+
+  pengine = MMSG;
+  pepoll = epoll_create1(EPOLL_CLOEXEC);
+
+  epoll_event event;
+  event.events = EPOLLIN;
+
+  event.data.fd = psocket;
+  epoll_ctl(pepoll, EPOLL_CTL_ADD, psocket, &event);
+  event.data.fd = pstop;
+  epoll_ctl(pepoll, EPOLL_CTL_ADD, pstop, &event);
+
+  // Receive slots
+  pbuffers.resize((size_t)batch * MAX_DATAGRAM);
+  pcontrols.resize((size_t)batch * CONTROL_SIZE);
+  pin.resize(batch);
+  pinVecs.resize(batch);
+  ptimes.resize(batch);
+
+  // Send slots: a header and the payload of an output
+  poutCapacity = 4 * batch;
+  pout.resize(poutCapacity);
+  poutVecs.resize(2 * poutCapacity);
+  poutHeaders.resize((size_t)poutCapacity * P::HEADER_BYTES);
+  poutPackets.resize(poutCapacity);
+}
+
+Forwarder(const Forwarder &) = delete;
+Forwarder &operator=(const Forwarder &) = delete;
+
+~Forwarder()
+{
+#ifdef PTBM_URING
+  // The packets being sent give their buffers back to the ring
+  psends.clear();
+  puring.reset();
+
+  if(puringBuffers)
+    munmap(puringBuffers, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+#endif
+
+  if(pepoll >= 0)
+    close(pepoll);
+
+  close(psocket);
+  close(pstop);
+}
+
+/// The engine in use (MMSG or URING)
+Engine
+engine() const
+{
+  return pengine;
+}
+
+static string
+engineName(Engine engine)
+{
+  return engine == URING ? "io_uring" : engine == MMSG ? "recvmmsg" : "auto";
+}
+
+/// Takes the virtual ports from a configuration store as a reader slot, a
+/// new configuration is used from the next received batch
+void
+setConfig(ConfigStore *config, int reader = 0)
+{
+  pconfig = config;
+  preader = reader;
+  pversion = 0;
+}
+
+/// The port queues of the outputs (MMSG): depth outputs per port, policy of
+/// a full queue and the bytes a port can send per round (before run)
+void
+setQueues(size_t depth, typename Queues::DropPolicy policy, size_t quantum)
+{
+  pqueues = Queues(depth, policy, quantum, wireSize);
+}
+
+/// The port queues and their counters
+const Queues &
+queues() const
+{
+  return pqueues;
+}
+
+/// The bound UDP port
+int
+port() const
+{
+  sockaddr_in addr;
+  socklen_t size = sizeof(addr);
+
+  getsockname(psocket, (sockaddr *)&addr, &size);
+  return ntohs(addr.sin_port);
+}
+
+/// Forwards until stop(), prints the stats of every report interval (seconds,
+/// 0: never)
+void
+run(double interval = 0, ostream *report = nullptr)
+{
+  plast = chrono::steady_clock::now();
+  plastStats = pstats;
+
+#ifdef PTBM_URING
+  if(pengine == URING)
+  {
+    runUring(report ? interval : 0, report);
+    return;
+  }
+#endif
+
+  runEpoll(report ? interval : 0, report);
+}
+
+/// Makes run() return, can be called from a signal handler or another thread
+void
+stop()
+{
+  uint64_t one = 1;
+  ssize_t written = write(pstop, &one, sizeof(one));
+  (void)written;
+}
+
+/// The descriptor stop() writes (for signal handlers)
+int
+stopDescriptor() const
+{
+  return pstop;
+}
+
+const Stats &
+stats() const
+{
+  return pstats;
+}
+
+private:
+
+static const size_t CONTROL_SIZE = 64;
+
+P &pptbm;
+ConfigStore *pconfig = nullptr;
+int preader = 0;
+uint64_t pversion = 0;
+map<unsigned int, sockaddr_in> pdestinations;
+int pbatch;
+Engine pengine;
+int psocket = -1;
+int pstop = -1;
+int pepoll = -1;
+Stats pstats;
+chrono::steady_clock::time_point plast;
+Stats plastStats;
+
+vector<unsigned char> pbuffers;
+vector<char> pcontrols;
+vector<mmsghdr> pin;
+vector<iovec> pinVecs;
+vector<uint64_t> ptimes;        // Receive timestamps (ns, realtime)
+
+// Outputs wait in the queues of their ports, the send slots from psent to
+// pouts are taken from the queues and not yet sent
+Queues pqueues;
+int poutCapacity;
+int pouts = 0;
+int psent = 0;
+bool pwaitOut = false;          // Waiting for room in the send buffer
+vector<mmsghdr> pout;
+vector<iovec> poutVecs;
+vector<unsigned char> poutHeaders;
+vector<Packet<P>> poutPackets;
+
+typename P::Scratch pscratch;
+vector<unsigned int> pports;
+vector<Packet<P>> poutputs;     // Of pports, share the payload of the datagram
+
+/// Cost of an output in the port queues
+static size_t
+wireSize(const Packet<P> &packet)
+{
+  return P::HEADER_BYTES + packet.payloadSize();
+}
+
+static uint64_t
+realtime()
+{
+  timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+subtract(Stats &stats, const Stats &old)
+{
+  stats.packets -= old.packets;
+  stats.outputs -= old.outputs;
+  stats.sent -= old.sent;
+  stats.unmapped -= old.unmapped;
+  stats.dropped -= old.dropped;
+  stats.invalid -= old.invalid;
+  stats.sendErrors -= old.sendErrors;
+  stats.batches -= old.batches;
+  stats.latencyCount -= old.latencyCount;
+  stats.latencySum -= old.latencySum;
+
+  for(int i=0; i<64; i++)
+    stats.latency[i] -= old.latency[i];
+}
+
+/// Prints the stats since the last report
+void
+printReport(ostream &report)
+{
+  auto now = chrono::steady_clock::now();
+  Stats delta = pstats;
+
+  subtract(delta, plastStats);
+  delta.print(report, chrono::duration<double>(now - plast).count());
+  plastStats = pstats;
+  plast = now;
+}
+
+/// Receives timestamp of a message (ns, realtime), now if there is none
+static uint64_t
+timestamp(msghdr &msg)
+{
+  for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      timespec ts;
+
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+  return realtime();
+}
+
+/// Processes the header of a datagram in wire form (into pports and
+/// poutputs), returns false if it is invalid
+bool
+process(const shared_ptr<const Payload> &wire)
+{
+  ++pstats.packets;
+  pports.clear();
+  poutputs.clear();
+
+  try
+  {
+    Packet<P>::fromWire(wire).fanOut(pptbm, pscratch, pports, poutputs);
+  }
+  catch(exception &)
+  {
+    ++pstats.invalid;
+    return false;
+  }
+
+  pstats.outputs += pports.size();
+  return true;
+}
+
+/// The destination of an output port, null if it has none
+const sockaddr_in *
+destination(unsigned int port)
+{
+  auto dest = pdestinations.find(port);
+
+  if(dest == pdestinations.end())
+  {
+    ++pstats.unmapped;
+    return nullptr;
+  }
+
+  return &dest->second;
+}
+
+/// Forwards until stop() by epoll, recvmmsg and sendmmsg
+void
+runEpoll(double interval, ostream *report)
+{
+  epoll_event events[2];
+
+  for(;;)
+  {
+    int timeout = -1;
+
+    if(interval > 0)
+    {
+      auto next = plast + chrono::duration_cast<chrono::steady_clock::duration>(
+            chrono::duration<double>(interval));
+      timeout = max(0L, (long)chrono::duration_cast<chrono::milliseconds>(
+                      next - chrono::steady_clock::now()).count());
+    }
+
+    int n = epoll_wait(pepoll, events, 2, timeout);
+
+    if(n < 0 && errno != EINTR)
+      throw runtime_error(string("epoll_wait failed: ") + strerror(errno));
+
+    for(int i=0; i<n; i++)
+    {
+      if(events[i].data.fd == pstop)
+        return;
+
+      if(events[i].events & EPOLLOUT)
+        flush();
+
+      // Drains the socket, a few batches between the checks of stop()
+      if(events[i].events & EPOLLIN)
+        for(int b=0; b<16 && receive(); b++)
+          ;
+    }
+
+    if(interval > 0 && chrono::steady_clock::now() - plast >=
+       chrono::duration<double>(interval))
+      printReport(*report);
+  }
+}
+
+/// Receives and forwards a batch, returns false if there was nothing to
+/// receive
+bool
+receive()
+{
+  // The receive buffers are reused, the outputs left keep copies
+  if(pwaitOut)
+    detach();
+
+  for(int i=0; i<pbatch; i++)
+  {
+    pinVecs[i].iov_base = &pbuffers[(size_t)i * MAX_DATAGRAM];
+    pinVecs[i].iov_len = MAX_DATAGRAM;
+
+    memset(&pin[i].msg_hdr, 0, sizeof(pin[i].msg_hdr));
+    pin[i].msg_hdr.msg_iov = &pinVecs[i];
+    pin[i].msg_hdr.msg_iovlen = 1;
+    pin[i].msg_hdr.msg_control = &pcontrols[(size_t)i * CONTROL_SIZE];
+    pin[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+  }
+
+  int n = recvmmsg(psocket, pin.data(), pbatch, MSG_DONTWAIT, nullptr);
+
+  if(n <= 0)
+  {
+    if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      throw runtime_error(string("recvmmsg failed: ") + strerror(errno));
+
+    return false;
+  }
+
+  ++pstats.batches;
+
+  if(pconfig)
+    pconfig->apply(pptbm, preader, pversion);
+
+  for(int i=0; i<n; i++)
+  {
+    ptimes[i] = timestamp(pin[i].msg_hdr);
+    forward((const unsigned char *)pinVecs[i].iov_base, pin[i].msg_len);
+  }
+
+  flush();
+
+  uint64_t now = realtime();
+
+  for(int i=0; i<n; i++)
+    pstats.addLatency(now > ptimes[i] ? now - ptimes[i] : 0);
+
+  return true;
+}
+
+/// Queues the outputs of a datagram on their ports
+void
+forward(const unsigned char *data, size_t size)
+{
+  // The payload stays in the receive buffer until the next receive
+  if(!process(Payload::wrap(data, size)))
+    return;
+
+  for(size_t n=0; n<pports.size(); n++)
+  {
+    if(!destination(pports[n]))
+      continue;
+
+    if(!pqueues.push(pports[n], move(poutputs[n])))
+      ++pstats.dropped;
+  }
+
+  poutputs.clear();
+}
+
+/// Sends the queued outputs until the send buffer is full, then waits for
+/// room by EPOLLOUT
+void
+flush()
+{
+  bool done;
+
+  for(;;)
+  {
+    if(!(done = send()) || pqueues.empty())
+      break;
+
+    pqueues.flush([this](unsigned int port, Packet<P> &packet)
+    {
+      if(pouts == poutCapacity)
+        return false;
+
+      stage(port, packet);
+      return true;
+    });
+  }
+
+  if(done == !pwaitOut)
+    return;
+
+  pwaitOut = !done;
+
+  epoll_event event;
+  event.events = EPOLLIN | (pwaitOut ? (uint32_t)EPOLLOUT : 0u);
+  event.data.fd = psocket;
+  epoll_ctl(pepoll, EPOLL_CTL_MOD, psocket, &event);
+}
+
+/// Fills the next send slot by an output of a port
+void
+stage(unsigned int port, Packet<P> &packet)
+{
+  unsigned char *header = &poutHeaders[(size_t)pouts * P::HEADER_BYTES];
+  msghdr &msg = pout[pouts].msg_hdr;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)&pdestinations.find(port)->second;
+  msg.msg_namelen = sizeof(sockaddr_in);
+  msg.msg_iov = &poutVecs[2 * pouts];
+  msg.msg_iovlen = packet.toIovec(header, msg.msg_iov);
+  poutPackets[pouts++] = move(packet);
+}
+
+/// Sends the filled send slots, returns false if the send buffer is full
+bool
+send()
+{
+  while(psent < pouts)
+  {
+    int n = sendmmsg(psocket, &pout[psent], pouts - psent, MSG_DONTWAIT);
+
+    if(n > 0)
+    {
+      psent += n;
+      pstats.sent += n;
+    }
+    else if(n < 0 && errno == EINTR)
+      continue;
+    else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+      return false;
+    else
+    {
+      // The first message failed, skips it
+      ++psent;
+      ++pstats.sendErrors;
+    }
+  }
+
+  // The payloads of the sent outputs are not needed any more
+  for(int i=0; i<pouts; i++)
+    poutPackets[i] = Packet<P>();
+
+  pouts = psent = 0;
+  return true;
+}
+
+/// Replaces the payloads in the receive buffers by copies (one per
+/// datagram) in the queues and the send slots
+void
+detach()
+{
+  unordered_map<const Payload *, shared_ptr<const Payload>> copies;
+  const unsigned char *begin = pbuffers.data();
+  const unsigned char *end = begin + pbuffers.size();
+
+  auto own = [&](Packet<P> &packet)
+  {
+    const Payload *buffer = packet.buffer().get();
+
+    if(!buffer || buffer->data() < begin || buffer->data() >= end)
+      return false;
+
+    shared_ptr<const Payload> &copy = copies[buffer];
+
+    if(!copy)
+      copy = Payload::copy(buffer->data(), buffer->size());
+
+    packet = Packet<P>(packet.header(), copy, P::HEADER_BYTES);
+    return true;
+  };
+
+  pqueues.forEach([&](unsigned int, Packet<P> &packet) { own(packet); });
+
+  for(int i=psent; i<pouts; i++)
+    if(own(poutPackets[i]) && pout[i].msg_hdr.msg_iovlen == 2)
+      poutVecs[2 * i + 1].iov_base = (void *)poutPackets[i].payload();
+}
+
+#ifdef PTBM_URING
+
+// Buffers of the multishot receive, a buffer holds the receive header, the
+// address, the control messages and the datagram (up to MAX_DATAGRAM like the
+// mmsg engine, the pages of a buffer are committed as datagrams fill them)
+static const unsigned int URING_BUFFERS = 1024;
+static const unsigned int URING_BUFFER_SIZE =
+    sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + CONTROL_SIZE +
+    MAX_DATAGRAM;
+static const unsigned int URING_SENDS = 4096;
+
+// User data of the submissions, the sends are SEND + slot
+enum : uint64_t
+{
+  RECEIVE = 1,
+  STOP = 2,
+  TIMER = 3,
+  SEND = 16
+};
+
+// An output being sent
+struct SendSlot
+{
+  msghdr msg;
+  iovec vecs[2];
+  Packet<P> packet;             // Holds the receive buffer of the payload
+};
+
+unique_ptr<Uring> puring;
+unsigned char *puringBuffers = nullptr;
+unsigned int pheld = 0;         // Buffers not in the ring
+bool parmed = false;            // The multishot receive is active
+msghdr precvMsg;
+vector<SendSlot> psends;
+vector<unsigned char> psendHeaders;
+vector<int> pfreeSends;
+vector<io_uring_cqe> pdeferred; // Completions put aside waiting for a send
+size_t pdeferredPos = 0;
+vector<uint64_t> pwaiting;      // Receive timestamps of unsubmitted packets
+__kernel_timespec pinterval;
+
+void
+setupUring()
+{
+  puring.reset(new Uring(URING_SENDS, 2 * (URING_BUFFERS + URING_SENDS)));
+
+  void *buffers = mmap(nullptr, (size_t)URING_BUFFERS * URING_BUFFER_SIZE,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if(buffers == MAP_FAILED)
+    throw runtime_error("Cannot map the receive buffers");
+
+  puringBuffers = (unsigned char *)buffers;
+  puring->provideBuffers(0, puringBuffers, URING_BUFFERS,
+                         URING_BUFFER_SIZE);
+
+  psends.resize(URING_SENDS);
+  psendHeaders.resize((size_t)URING_SENDS * P::HEADER_BYTES);
+
+  for(int i=URING_SENDS-1; i>=0; i--)
+    pfreeSends.push_back(i);
+
+  // The ring waits for the socket, not the socket for data
+  fcntl(psocket, F_SETFL, fcntl(psocket, F_GETFL) & ~O_NONBLOCK);
+
+  memset(&precvMsg, 0, sizeof(precvMsg));
+  precvMsg.msg_namelen = sizeof(sockaddr_in);
+  precvMsg.msg_controllen = CONTROL_SIZE;
+}
+
+/// A submission entry, submits the queued ones if the ring is full
+io_uring_sqe *
+sqe()
+{
+  io_uring_sqe *entry;
+
+  while(!(entry = puring->sqe()))
+    puring->submit();
+
+  return entry;
+}
+
+void
+armReceive()
+{
+  io_uring_sqe *entry = sqe();
+
+  entry->opcode = IORING_OP_RECVMSG;
+  entry->fd = psocket;
+  entry->addr = (uint64_t)&precvMsg;
+  entry->len = 1;
+  entry->ioprio = IORING_RECV_MULTISHOT;
+  entry->flags = IOSQE_BUFFER_SELECT;
+  entry->buf_group = 0;
+  entry->user_data = RECEIVE;
+  parmed = true;
+}
+
+void
+armTimer(double interval)
+{
+  io_uring_sqe *entry = sqe();
+
+  pinterval.tv_sec = (long long)interval;
+  pinterval.tv_nsec = (long long)((interval - pinterval.tv_sec) * 1e9);
+
+  entry->opcode = IORING_OP_TIMEOUT;
+  entry->addr = (uint64_t)&pinterval;
+  entry->len = 1;
+  entry->user_data = TIMER;
+}
+
+/// Submits the queued entries, waits for wait completions
+void
+submit(unsigned int wait)
+{
+  if(!pwaiting.empty())
+  {
+    puring->submit();
+
+    uint64_t now = realtime();
+
+    for(uint64_t time : pwaiting)
+      pstats.addLatency(now > time ? now - time : 0);
+
+    pwaiting.clear();
+  }
+
+  puring->submit(wait);
+}
+
+/// The next completion (the ones put aside first)
+bool
+next(io_uring_cqe &cqe)
+{
+  if(pdeferredPos < pdeferred.size())
+  {
+    cqe = pdeferred[pdeferredPos++];
+    return true;
+  }
+
+  pdeferred.clear();
+  pdeferredPos = 0;
+  return puring->pop(cqe);
+}
+
+/// Forwards until stop() by io_uring
+void
+runUring(double interval, ostream *report)
+{
+  io_uring_sqe *entry = sqe();
+
+  entry->opcode = IORING_OP_POLL_ADD;
+  entry->fd = pstop;
+  entry->poll32_events = POLLIN;
+  entry->user_data = STOP;
+
+  armReceive();
+
+  if(interval > 0)
+    armTimer(interval);
+
+  for(;;)
+  {
+    submit(1);
+
+    if(pconfig)
+      pconfig->apply(pptbm, preader, pversion);
+
+    io_uring_cqe cqe;
+    bool received = false;
+
+    while(next(cqe))
+    {
+      if(cqe.user_data >= SEND)
+        sent(cqe);
+      else if(cqe.user_data == RECEIVE)
+      {
+        if(!(cqe.flags & IORING_CQE_F_MORE))
+          parmed = false;
+
+        if(cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+        {
+          forwardBuffer(cqe);
+          received = true;
+        }
+        else if(cqe.res < 0 && cqe.res != -ENOBUFS)
+          throw runtime_error(string("Receive failed: ") + strerror(-cqe.res));
+      }
+      else if(cqe.user_data == TIMER)
+      {
+        printReport(*report);
+        armTimer(interval);
+      }
+      else if(cqe.user_data == STOP)
+        return;
+    }
+
+    if(received)
+      ++pstats.batches;
+
+    // Rearmed when the ring ran out of buffers and some are back
+    if(!parmed && pheld < URING_BUFFERS)
+      armReceive();
+  }
+}
+
+/// Queues the sends of the outputs of a received buffer
+void
+forwardBuffer(const io_uring_cqe &cqe)
+{
+  unsigned short id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+  unsigned char *buffer = puringBuffers + (size_t)id * URING_BUFFER_SIZE;
+  io_uring_recvmsg_out *out = (io_uring_recvmsg_out *)buffer;
+  unsigned char *control = buffer + sizeof(*out) + precvMsg.msg_namelen;
+  const unsigned char *data = control + precvMsg.msg_controllen;
+
+  ++pheld;
+
+  // The buffer goes back to the ring with the last packet of its payload
+  shared_ptr<const Payload> wire =
+      Payload::wrap(data, out->payloadlen, [this, id]() { recycle(id); });
+  msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_control = control;
+  msg.msg_controllen = out->controllen;
+  pwaiting.push_back(timestamp(msg));
+
+  if(out->flags & MSG_TRUNC)
+  {
+    ++pstats.packets;
+    ++pstats.invalid;
+  }
+  else if(process(wire))
+  {
+    for(size_t n=0; n<pports.size(); n++)
+    {
+      const sockaddr_in *dest = destination(pports[n]);
+
+      if(!dest)
+        continue;
+
+      // Every slot is being sent, waits for a send to complete
+      while(pfreeSends.empty())
+        reap();
+
+      int slot = pfreeSends.back();
+      SendSlot &send = psends[slot];
+      unsigned char *header = &psendHeaders[(size_t)slot * P::HEADER_BYTES];
+
+      pfreeSends.pop_back();
+      send.packet = move(poutputs[n]);
+
+      memset(&send.msg, 0, sizeof(send.msg));
+      send.msg.msg_name = (void *)dest;
+      send.msg.msg_namelen = sizeof(*dest);
+      send.msg.msg_iov = send.vecs;
+      send.msg.msg_iovlen = send.packet.toIovec(header, send.vecs);
+
+      io_uring_sqe *entry = sqe();
+
+      entry->opcode = IORING_OP_SENDMSG;
+      entry->fd = psocket;
+      entry->addr = (uint64_t)&send.msg;
+      entry->len = 1;
+      entry->user_data = SEND + slot;
+    }
+
+    poutputs.clear();
+  }
+}
+
+/// Waits for completions and handles the sends, puts the others aside
+void
+reap()
+{
+  submit(1);
+
+  io_uring_cqe cqe;
+
+  while(puring->pop(cqe))
+    if(cqe.user_data >= SEND)
+      sent(cqe);
+    else
+      pdeferred.push_back(cqe);
+}
+
+/// A send completed
+void
+sent(const io_uring_cqe &cqe)
+{
+  int slot = cqe.user_data - SEND;
+
+  if(cqe.res < 0)
+    ++pstats.sendErrors;
+  else
+    ++pstats.sent;
+
+  psends[slot].packet = Packet<P>();
+  pfreeSends.push_back(slot);
+}
+
+/// Gives a buffer back to the ring
+void
+recycle(unsigned short id)
+{
+  puring->provide(id);
+  --pheld;
+}
+
+#endif // PTBM_URING
+
+};
+
+#endif // PTBM_FORWARDER
+
+}
+
+#endif // PTBM_FORWARDER_H
@@ -0,0 +1,578 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_GROUPTABLE_H
+#define PTBM_GROUPTABLE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <stdexcept>
+
+#include "ptbm-compiler.h"
+#include "ptbm-rcu.h"
+#include "ptbm-topology.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+// The multicast groups of the sources with their compiled headers.
+//
+// The control plane changes the members of a group (join, leave) or the
+// topology, the changed groups are only marked. A background thread rebuilds
+// the headers of the marked groups in batches (a group changed many times
+// before its rebuild is compiled once) and publishes every rebuilt entry by
+// an atomic pointer store.
+//
+// The links of the published trees are indexed, so a removed or added link
+// only marks the groups it changes (the cached shortest path trees are
+// repaired by the compiler), other topology changes mark every group.
+//
+// The data path looks up the entries without locks in a read section of its
+// reader slot, it gets the last published headers even while they are being
+// rebuilt. The entries are freed (RCU) after no read section can hold them.
+template<class P>
+class GroupTable
+{
+
+public:
+
+typedef typename P::header_type header_type;
+
+/// The published state of a group (immutable)
+struct Entry
+{
+  int source;
+  unsigned int group;
+  vector<int> members;            // Router indexes, sorted
+  vector<header_type> headers;
+  string error;                   // Why the headers could not be compiled
+  uint64_t version;               // Changes of the group it was built from
+};
+
+/// Counters of the background thread
+struct Stats
+{
+  long long changes = 0;          // Joins, leaves and topology changes
+  long long linkMarks = 0;        // Groups marked by link changes
+  long long rebuilds = 0;         // Entries compiled
+  long long batches = 0;
+  long long errors = 0;           // Entries without headers
+};
+
+/// A read section of a reader slot, lookup() results are valid until its end
+class ReadGuard
+{
+public:
+  ReadGuard(GroupTable &table, int reader)
+    : pguard(table.prcu, reader)
+  {
+  }
+
+private:
+  Rcu::ReadGuard pguard;
+};
+
+GroupTable(
+    Topology &topology,
+    bool compact = false,
+    int readers = 1,
+    size_t batchSize = 256)
+  : ptopology(topology),
+    pcompiler(topology, compact),
+    prcu(readers),
+    pbatchSize(batchSize ? batchSize : 1),
+    pindex(new Index(INITIAL_CAPACITY))
+{
+  pthread = thread(&GroupTable::rebuildLoop, this);
+}
+
+GroupTable(const GroupTable &) = delete;
+GroupTable &operator=(const GroupTable &) = delete;
+
+~GroupTable()
+{
+  {
+    lock_guard<mutex> lock(pmutex);
+    pstop = true;
+  }
+
+  pwake.notify_all();
+  pthread.join();
+
+  Index *index = pindex.load();
+
+  for(size_t i=0; i<=index->mask; i++)
+    delete index->slots[i].load();
+  delete index;
+}
+
+/// Adds a member (router index) to a group of a source
+void
+join(int source, unsigned int group, int member)
+{
+  change(source, group, [member](vector<int> &members)
+  {
+    auto it = lower_bound(members.begin(), members.end(), member);
+
+    if(it == members.end() || *it != member)
+      members.insert(it, member);
+  });
+}
+
+/// Removes a member (router index) from a group of a source, the group is
+/// removed with its last member
+void
+leave(int source, unsigned int group, int member)
+{
+  change(source, group, [member](vector<int> &members)
+  {
+    auto it = lower_bound(members.begin(), members.end(), member);
+
+    if(it != members.end() && *it == member)
+      members.erase(it);
+  });
+}
+
+/// Changes the topology (the data path keeps the old headers until the
+/// groups are rebuilt)
+void
+updateTopology(function<void(Topology &)> update)
+{
+  lock_guard<mutex> topologyLock(ptopologyMutex);
+  lock_guard<mutex> lock(pmutex);
+
+  update(ptopology);
+  pcompiler.invalidate();
+
+  for(auto &it : pgroups)
+    mark(it.first, it.second);
+
+  ++pstats.changes;
+  pwake.notify_one();
+}
+
+/// Removes the link of a port of a router, the groups routed over it are
+/// rebuilt
+void
+removeLink(int router, unsigned int port)
+{
+  lock_guard<mutex> topologyLock(ptopologyMutex);
+  lock_guard<mutex> lock(pmutex);
+
+  Topology::Link link = ptopology.removeLink(router, port);
+  pcompiler.linkRemoved(router, port, link.neighbor);
+
+  auto it = plinkGroups.find(linkKey(router, port));
+
+  if(it != plinkGroups.end())
+    for(const Key &key : it->second)
+      markLink(key);
+
+  ++pstats.changes;
+  pwake.notify_one();
+}
+
+/// Connects a port of a router to a neighbor, the groups with a router
+/// closer through the link (or unreachable before) are rebuilt
+void
+addLink(int router, unsigned int port, int neighbor, unsigned int delay)
+{
+  lock_guard<mutex> topologyLock(ptopologyMutex);
+  lock_guard<mutex> lock(pmutex);
+
+  ptopology.addLink(router, port, neighbor, delay);
+
+  for(auto &change : pcompiler.linkAdded(router, port))
+  {
+    if(change.oldParent < 0)
+      continue;
+
+    auto it = plinkGroups.find(linkKey(change.oldParent, change.oldPort));
+
+    if(it != plinkGroups.end())
+      for(const Key &key : it->second)
+        if(key.first == change.source)
+          markLink(key);
+  }
+
+  for(const Key &key : punreachable)
+    markLink(key);
+
+  ++pstats.changes;
+  pwake.notify_one();
+}
+
+/// Waits until every change is rebuilt and published (control plane)
+void
+flush()
+{
+  unique_lock<mutex> lock(pmutex);
+  pidle.wait(lock, [this]() { return pdirty.empty() && !pbusy; });
+}
+
+/// Gets the published entry of a group of a source, nullptr if it has no
+/// members (call it in a read section)
+const Entry *
+lookup(int source, unsigned int group) const
+{
+  const Index *index = pindex.load(memory_order_acquire);
+
+  for(size_t i = keyHash(source, group) & index->mask;; i = (i + 1) & index->mask)
+  {
+    const Entry *entry = index->slots[i].load(memory_order_acquire);
+
+    if(!entry)
+      return nullptr;
+
+    if(entry->source == source && entry->group == group)
+      return entry->members.empty() ? nullptr : entry;
+  }
+}
+
+Stats
+stats()
+{
+  lock_guard<mutex> lock(pmutex);
+  return pstats;
+}
+
+private:
+
+static const size_t INITIAL_CAPACITY = 64;
+
+typedef pair<int, unsigned int> Key;
+
+struct KeyHash
+{
+  size_t operator()(const Key &key) const
+  {
+    return keyHash(key.first, key.second);
+  }
+};
+
+// The members of a group (control plane)
+struct Group
+{
+  vector<int> members;
+  uint64_t version = 0;
+  bool dirty = false;
+};
+
+// Open addressing table of the published entries (linear probing). Entries
+// are only replaced, a group without members stays as an empty entry until
+// the table is grown.
+struct Index
+{
+  size_t mask;
+  unique_ptr<atomic<const Entry *>[]> slots;
+  size_t used = 0;
+
+  explicit Index(size_t capacity)
+    : mask(capacity - 1),
+      slots(new atomic<const Entry *>[capacity])
+  {
+    for(size_t i=0; i<capacity; i++)
+      slots[i].store(nullptr, memory_order_relaxed);
+  }
+};
+
+Topology &ptopology;
+HeaderCompiler<P> pcompiler;
+Rcu prcu;
+size_t pbatchSize;
+atomic<Index *> pindex;
+
+// Control plane, guarded by pmutex
+mutex pmutex;
+condition_variable pwake;
+condition_variable pidle;
+unordered_map<Key, Group, KeyHash> pgroups;
+vector<Key> pdirty;
+bool pbusy = false;
+bool pstop = false;
+Stats pstats;
+
+// Held by the background thread while compiling, guards the link index
+mutex ptopologyMutex;
+unordered_map<uint64_t, unordered_set<Key, KeyHash>> plinkGroups;
+unordered_map<Key, vector<uint64_t>, KeyHash> pgroupLinks;
+unordered_set<Key, KeyHash> punreachable;
+thread pthread;
+
+static uint64_t
+linkKey(int router, unsigned int port)
+{
+  return uint64_t(unsigned(router)) << 32 | port;
+}
+
+static size_t
+keyHash(int source, unsigned int group)
+{
+  uint64_t h = (uint64_t(unsigned(source)) << 32 | group) * 0x9E3779B97F4A7C15ull;
+  return h ^ (h >> 29);
+}
+
+void
+change(int source, unsigned int group, function<void(vector<int> &)> apply)
+{
+  lock_guard<mutex> lock(pmutex);
+  Key key(source, group);
+  Group &g = pgroups[key];
+
+  apply(g.members);
+  ++g.version;
+  ++pstats.changes;
+
+  mark(key, g);
+  pwake.notify_one();
+}
+
+/// Queues a group changed by a link for the rebuild
+void
+markLink(const Key &key)
+{
+  auto it = pgroups.find(key);
+
+  if(it != pgroups.end() && !it->second.dirty)
+  {
+    mark(key, it->second);
+    ++pstats.linkMarks;
+  }
+}
+
+/// Replaces the indexed links of a group
+void
+indexLinks(const Key &key, const vector<pair<int, unsigned int>> &links)
+{
+  vector<uint64_t> &indexed = pgroupLinks[key];
+
+  for(uint64_t link : indexed)
+  {
+    auto it = plinkGroups.find(link);
+
+    it->second.erase(key);
+    if(it->second.empty())
+      plinkGroups.erase(it);
+  }
+
+  indexed.clear();
+
+  // The trees of a group may share links
+  for(auto &link : links)
+    indexed.push_back(linkKey(link.first, link.second));
+
+  sort(indexed.begin(), indexed.end());
+  indexed.erase(unique(indexed.begin(), indexed.end()), indexed.end());
+
+  for(uint64_t link : indexed)
+    plinkGroups[link].insert(key);
+
+  if(indexed.empty())
+    pgroupLinks.erase(key);
+}
+
+/// Queues a group for the rebuild (once until it is rebuilt)
+void
+mark(const Key &key, Group &group)
+{
+  if(group.dirty)
+    return;
+
+  group.dirty = true;
+  pdirty.push_back(key);
+}
+
+void
+rebuildLoop()
+{
+  vector<Entry *> batch;
+
+  for(;;)
+  {
+    {
+      unique_lock<mutex> lock(pmutex);
+
+      pbusy = false;
+      if(pdirty.empty())
+        pidle.notify_all();
+
+      // Retired entries are freed when the readers allow it
+      while(!pstop && pdirty.empty())
+      {
+        if(prcu.reclaim(), prcu.pending())
+          pwake.wait_for(lock, chrono::milliseconds(1));
+        else
+          pwake.wait(lock);
+      }
+
+      if(pstop)
+        return;
+
+      // The oldest changes first, the members are copied
+      size_t count = min(pbatchSize, pdirty.size());
+
+      batch.clear();
+      for(size_t i=0; i<count; i++)
+      {
+        Group &group = pgroups[pdirty[i]];
+        Entry *entry = new Entry();
+
+        entry->source = pdirty[i].first;
+        entry->group = pdirty[i].second;
+        entry->members = group.members;
+        entry->version = group.version;
+        group.dirty = false;
+
+        if(group.members.empty())
+          pgroups.erase(pdirty[i]);
+
+        batch.push_back(entry);
+      }
+
+      pdirty.erase(pdirty.begin(), pdirty.begin() + count);
+      pbusy = true;
+    }
+
+    long long errors = 0;
+
+    {
+      lock_guard<mutex> topologyLock(ptopologyMutex);
+
+      for(Entry *entry : batch)
+      {
+        Key key(entry->source, entry->group);
+
+        punreachable.erase(key);
+
+        if(entry->members.empty())
+        {
+          indexLinks(key, {});
+          continue;
+        }
+
+        try
+        {
+          entry->headers = pcompiler.compile(entry->source, entry->members);
+          indexLinks(key, pcompiler.treeLinks());
+        }
+        catch(runtime_error &e)
+        {
+          entry->error = e.what();
+          indexLinks(key, {});
+          punreachable.insert(key);
+          ++errors;
+        }
+      }
+    }
+
+    for(Entry *entry : batch)
+      publish(entry);
+
+    prcu.reclaim();
+
+    lock_guard<mutex> lock(pmutex);
+    pstats.rebuilds += batch.size();
+    pstats.errors += errors;
+    ++pstats.batches;
+  }
+}
+
+/// Replaces the entry of a group (background thread only)
+void
+publish(const Entry *entry)
+{
+  Index *index = pindex.load(memory_order_relaxed);
+
+  for(size_t i = keyHash(entry->source, entry->group) & index->mask;;
+      i = (i + 1) & index->mask)
+  {
+    const Entry *old = index->slots[i].load(memory_order_relaxed);
+
+    if(old && (old->source != entry->source || old->group != entry->group))
+      continue;
+
+    index->slots[i].store(entry, memory_order_release);
+
+    if(old)
+      prcu.retire([old]() { delete old; });
+    else if(++index->used * 2 > index->mask + 1)
+      grow();
+
+    return;
+  }
+}
+
+/// Publishes a table twice as big without the empty entries
+void
+grow()
+{
+  Index *old = pindex.load(memory_order_relaxed);
+  size_t live = 0;
+
+  for(size_t i=0; i<=old->mask; i++)
+  {
+    const Entry *entry = old->slots[i].load(memory_order_relaxed);
+    if(entry && !entry->members.empty())
+      ++live;
+  }
+
+  size_t capacity = INITIAL_CAPACITY;
+  while(capacity < live * 4)
+    capacity *= 2;
+
+  Index *index = new Index(capacity);
+  vector<const Entry *> removed;
+
+  for(size_t i=0; i<=old->mask; i++)
+  {
+    const Entry *entry = old->slots[i].load(memory_order_relaxed);
+
+    if(!entry)
+      continue;
+
+    if(entry->members.empty())
+    {
+      removed.push_back(entry);
+      continue;
+    }
+
+    size_t j = keyHash(entry->source, entry->group) & index->mask;
+    while(index->slots[j].load(memory_order_relaxed))
+      j = (j + 1) & index->mask;
+
+    index->slots[j].store(entry, memory_order_relaxed);
+    ++index->used;
+  }
+
+  // Retired after they are unreachable from the published table
+  pindex.store(index, memory_order_release);
+  prcu.retire([old]() { delete old; });
+
+  for(const Entry *entry : removed)
+    prcu.retire([entry]() { delete entry; });
+}
+
+};
+
+}
+
+#endif // PTBM_GROUPTABLE_H
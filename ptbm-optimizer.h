@@ -0,0 +1,412 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_OPTIMIZER_H
+#define PTBM_OPTIMIZER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+
+#include "ptbm-compiler.h"
+#include "ptbm-topology.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+// Searches routing trees of a multicast group with smaller headers than the
+// shortest path tree of the header compiler. Candidates are built by two
+// randomized heuristics and encoded by the compiler to get their cost:
+//
+//   - multi-path: every destination is connected by a shortest path, among
+//     equal cost parents the ones already in the tree are preferred (the
+//     delays stay the same as in the shortest path tree)
+//   - Steiner: the nearest destination (in hops) is connected to the tree
+//     until all of them are in it (Takahashi-Matsuyama), the paths may be
+//     longer than the shortest ones
+//
+// Both can keep destinations off the paths to other ones, as such
+// destinations need trees of their own. The threads search until the time
+// budget is spent, the best tree is never worse than the shortest path tree.
+template<class P>
+class TreeOptimizer
+{
+
+public:
+
+typedef typename P::header_type header_type;
+typedef typename HeaderCompiler<P>::Spt Spt;
+
+/// What a smaller tree means
+enum Objective
+{
+  FRAGMENTS,    // Fewer headers first, then fewer open brackets
+  BRACKETS      // Fewer open brackets first, then fewer headers
+};
+
+/// The best tree found for a group
+struct Result
+{
+  vector<header_type> headers;
+  int openBrackets;
+  int baseOpenBrackets;           // Of the shortest path tree
+  int baseHeaders;
+  long long candidates;           // Trees evaluated by the threads
+};
+
+TreeOptimizer(
+    const Topology &topology,
+    bool compact = false,
+    int threads = 1,
+    Objective objective = FRAGMENTS)
+  : ptopology(topology),
+    pobjective(objective),
+    pincoming(topology.routerCount())
+{
+  if(threads < 1)
+    throw runtime_error("Number of threads must be at least 1");
+
+  for(int i=0; i<threads; i++)
+    pworkers.emplace_back(new Worker(topology, compact));
+
+  for(int r=0; r<topology.routerCount(); r++)
+    for(const Topology::Link &link : topology.links(r))
+      pincoming[link.neighbor].push_back({r, link.port, link.delay});
+}
+
+/// Searches a tree from a source to the destinations (router indexes) for
+/// budget seconds
+Result
+optimize(int source, const vector<int> &destinations, double budget,
+         unsigned int seed = 1)
+{
+  vector<int> dests(destinations);
+
+  sort(dests.begin(), dests.end());
+  dests.erase(unique(dests.begin(), dests.end()), dests.end());
+  dests.erase(remove(dests.begin(), dests.end(), source), dests.end());
+
+  Result result;
+  HeaderCompiler<P> &compiler = pworkers[0]->compiler;
+  const Spt &spt = compiler.shortestPathTree(source);
+
+  result.headers = compiler.compile(source, destinations, spt,
+                                    &result.openBrackets);
+  result.baseOpenBrackets = result.openBrackets;
+  result.baseHeaders = result.headers.size();
+  result.candidates = 0;
+
+  if(dests.empty())
+    return result;
+
+  auto deadline = chrono::steady_clock::now() +
+      chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::duration<double>(budget));
+  vector<thread> threads;
+
+  for(size_t i=0; i<pworkers.size(); i++)
+  {
+    Worker &worker = *pworkers[i];
+
+    worker.rng.seed(seed + i);
+    worker.found = false;
+    worker.candidates = 0;
+
+    threads.emplace_back([this, &worker, source, &destinations, &dests,
+                          &spt, deadline]()
+    {
+      do
+        search(worker, source, destinations, dests, spt);
+      while(chrono::steady_clock::now() < deadline);
+    });
+  }
+
+  for(thread &t : threads)
+    t.join();
+
+  // Ties go to the lower thread
+  for(unique_ptr<Worker> &worker : pworkers)
+  {
+    result.candidates += worker->candidates;
+
+    if(worker->found && better(worker->best.size(), worker->bestBrackets,
+                               result.headers.size(), result.openBrackets))
+    {
+      result.headers = worker->best;
+      result.openBrackets = worker->bestBrackets;
+    }
+  }
+
+  return result;
+}
+
+private:
+
+struct Incoming
+{
+  int router;
+  unsigned int port;
+  unsigned int delay;
+};
+
+// The state of a searching thread
+struct Worker
+{
+  HeaderCompiler<P> compiler;
+  mt19937 rng;
+  Spt tree;                       // The candidate
+  vector<int> members;            // Routers of the candidate (source first)
+  vector<unsigned int> inTree;    // Marks of the candidate
+  vector<unsigned int> isDest;    // Marks of the destinations
+  vector<unsigned int> seen;      // Marks of the search
+  vector<int> pred;
+  vector<unsigned int> predPort;
+  unsigned int generation = 0;
+  unsigned int searchMark = 0;
+  long long iteration = 0;
+  long long candidates = 0;
+
+  bool found = false;
+  vector<header_type> best;
+  int bestBrackets = 0;
+
+  Worker(const Topology &topology, bool compact)
+    : compiler(topology, compact),
+      inTree(topology.routerCount(), 0),
+      isDest(topology.routerCount(), 0),
+      seen(topology.routerCount(), 0),
+      pred(topology.routerCount(), -1),
+      predPort(topology.routerCount(), 0)
+  {
+    tree.parent.assign(topology.routerCount(), -1);
+    tree.port.assign(topology.routerCount(), 0);
+  }
+};
+
+const Topology &ptopology;
+Objective pobjective;
+vector<vector<Incoming>> pincoming;
+vector<unique_ptr<Worker>> pworkers;
+
+bool
+better(size_t headers, int brackets, size_t bestHeaders, int bestBrackets) const
+{
+  if(pobjective == FRAGMENTS)
+    return headers < bestHeaders ||
+           (headers == bestHeaders && brackets < bestBrackets);
+
+  return brackets < bestBrackets ||
+         (brackets == bestBrackets && headers < bestHeaders);
+}
+
+/// Builds and evaluates one candidate
+void
+search(
+    Worker &worker,
+    int source,
+    const vector<int> &destinations,
+    const vector<int> &dests,
+    const Spt &spt)
+{
+  bool avoidInterior = (worker.rng() & 1) != 0;
+
+  ++worker.generation;
+  worker.members.assign(1, source);
+  worker.inTree[source] = worker.generation;
+
+  for(int dest : dests)
+    worker.isDest[dest] = worker.generation;
+
+  bool built = (worker.iteration++ % 2 == 0) ?
+        buildMultiPath(worker, source, dests, spt, avoidInterior) :
+        buildSteiner(worker, dests, avoidInterior);
+
+  if(built)
+  {
+    try
+    {
+      int brackets;
+      vector<header_type> headers =
+          worker.compiler.compile(source, destinations, worker.tree, &brackets);
+
+      ++worker.candidates;
+
+      if(!worker.found ||
+         better(headers.size(), brackets, worker.best.size(), worker.bestBrackets))
+      {
+        worker.found = true;
+        worker.best.swap(headers);
+        worker.bestBrackets = brackets;
+      }
+    }
+    catch(runtime_error &)
+    {
+      // The tree does not fit in a header (compact layout)
+    }
+  }
+
+  for(int r : worker.members)
+    worker.tree.parent[r] = -1;
+}
+
+/// Adds a router to the candidate below a parent
+void
+attach(Worker &worker, int router, int parent, unsigned int port)
+{
+  worker.tree.parent[router] = parent;
+  worker.tree.port[router] = port;
+  worker.inTree[router] = worker.generation;
+  worker.members.push_back(router);
+}
+
+/// Connects the destinations along shortest paths, preferring the parents
+/// already in the tree
+bool
+buildMultiPath(
+    Worker &worker,
+    int source,
+    const vector<int> &dests,
+    const Spt &spt,
+    bool avoidInterior)
+{
+  vector<int> order(dests);
+  vector<const Incoming *> choices;
+
+  shuffle(order.begin(), order.end(), worker.rng);
+
+  for(int dest : order)
+    for(int r = dest; r != source && worker.inTree[r] != worker.generation;)
+    {
+      const Incoming *chosen = nullptr;
+      size_t others = 0;
+
+      choices.clear();
+
+      for(const Incoming &in : pincoming[r])
+      {
+        if(spt.dist[in.router] == UINT64_MAX ||
+           spt.dist[in.router] + in.delay != spt.dist[r] ||
+           !worker.compiler.usablePort(in.router, in.port))
+          continue;
+
+        bool dest = avoidInterior && worker.isDest[in.router] == worker.generation;
+
+        if(!dest && worker.inTree[in.router] == worker.generation)
+        {
+          chosen = &in;
+          break;
+        }
+
+        // Destinations at the end, they are the last choice for a parent
+        if(dest)
+          choices.push_back(&in);
+        else
+          choices.insert(choices.begin() + others++, &in);
+      }
+
+      if(!chosen)
+      {
+        if(choices.empty())
+          return false;
+
+        chosen = choices[worker.rng() % (others ? others : choices.size())];
+      }
+
+      attach(worker, r, chosen->router, chosen->port);
+      r = chosen->router;
+    }
+
+  return true;
+}
+
+/// Connects the nearest destination (in hops) to the tree until all of them
+/// are in it
+bool
+buildSteiner(Worker &worker, const vector<int> &dests, bool avoidInterior)
+{
+  vector<int> remaining(dests), level, next, found;
+  unsigned int generation = worker.generation;
+
+  for(;;)
+  {
+    remaining.erase(remove_if(remaining.begin(), remaining.end(),
+                              [&worker, generation](int r)
+                              { return worker.inTree[r] == generation; }),
+                    remaining.end());
+
+    if(remaining.empty())
+      return true;
+
+    // Breadth first search from the whole tree
+    unsigned int mark = ++worker.searchMark;
+    level = worker.members;
+    found.clear();
+
+    for(int r : level)
+      worker.seen[r] = mark;
+
+    while(!level.empty() && found.empty())
+    {
+      next.clear();
+
+      for(int r : level)
+      {
+        if(avoidInterior && worker.isDest[r] == generation)
+          continue;
+
+        Topology::Links links = ptopology.links(r);
+        size_t offset = links.empty() ? 0 : worker.rng() % links.size();
+
+        for(size_t i=0; i<links.size(); i++)
+        {
+          const Topology::Link &link = links[(i + offset) % links.size()];
+
+          if(worker.seen[link.neighbor] == mark ||
+             !worker.compiler.usablePort(r, link.port))
+            continue;
+
+          worker.seen[link.neighbor] = mark;
+          worker.pred[link.neighbor] = r;
+          worker.predPort[link.neighbor] = link.port;
+          next.push_back(link.neighbor);
+
+          if(worker.isDest[link.neighbor] == generation)
+            found.push_back(link.neighbor);
+        }
+      }
+
+      level.swap(next);
+    }
+
+    if(found.empty())
+      return false;
+
+    int r = found[worker.rng() % found.size()];
+    vector<int> path;
+
+    for(; worker.inTree[r] != generation; r = worker.pred[r])
+      path.push_back(r);
+
+    for(auto it = path.rbegin(); it != path.rend(); ++it)
+      attach(worker, *it, worker.pred[*it], worker.predPort[*it]);
+  }
+}
+
+};
+
+}
+
+#endif // PTBM_OPTIMIZER_H
@@ -0,0 +1,279 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_OUTQUEUE_H
+#define PTBM_OUTQUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+using namespace std;
+
+namespace ptbm
+{
+
+// Bounded queues of the outputs of the ports, flushed by deficit round robin.
+//
+// The outputs of a header arrive in tree order, spread over the ports. Pushed
+// to the queue of their port, they leave in runs of the same port: every
+// active port (one with queued outputs) gets a quantum of credit per round
+// and sends outputs while their cost (1 or the cost function, e.g. bytes) is
+// covered by its credit. A port that could not send its whole quantum keeps
+// the rest for the next round, an idle port loses it.
+//
+// A flush stops when the sink refuses an output (backpressure) and the next
+// flush continues with the same port. A full queue drops by its policy.
+template<class T>
+class OutputQueues
+{
+
+public:
+
+enum DropPolicy
+{
+  DROP_TAIL,    // A full queue refuses the new output
+  DROP_HEAD     // A full queue drops its oldest output
+};
+
+struct Counters
+{
+  long long enqueued = 0;
+  long long dropped = 0;
+  long long flushed = 0;
+};
+
+/// Queues of depth outputs (setDepth: per port), quantum is the credit of a
+/// port per round in the units of cost (null: every output costs 1)
+explicit OutputQueues(
+    size_t depth = 1024,
+    DropPolicy policy = DROP_TAIL,
+    size_t quantum = 64,
+    function<size_t(const T &)> cost = nullptr)
+  : pdepth(depth),
+    ppolicy(policy),
+    pquantum(quantum),
+    pcost(move(cost))
+{
+  if(depth < 1)
+    throw runtime_error("Queue depth must be at least 1");
+
+  if(quantum < 1)
+    throw runtime_error("Quantum must be at least 1");
+}
+
+/// The depth of the queue of a port
+void
+setDepth(unsigned int port, size_t depth)
+{
+  if(depth < 1)
+    throw runtime_error("Queue depth must be at least 1");
+
+  Queue &queue = find(port);
+
+  queue.depth = depth;
+
+  while(queue.items.size() > depth)
+  {
+    queue.items.pop_front();
+    ++queue.counters.dropped;
+    ++ptotal.dropped;
+    --psize;
+  }
+}
+
+/// Queues an output of a port, returns false if an output was dropped
+bool
+push(unsigned int port, T item)
+{
+  Queue &queue = find(port);
+  bool dropped = false;
+
+  if(queue.items.size() >= queue.depth)
+  {
+    ++queue.counters.dropped;
+    ++ptotal.dropped;
+
+    if(ppolicy == DROP_TAIL)
+      return false;
+
+    queue.items.pop_front();
+    --psize;
+    dropped = true;
+  }
+
+  queue.items.push_back(move(item));
+  ++queue.counters.enqueued;
+  ++ptotal.enqueued;
+  ++psize;
+
+  if(!queue.active)
+  {
+    queue.active = true;
+    pactive.push_back(&queue - pqueues.data());
+  }
+
+  return !dropped;
+}
+
+/// Hands at most limit outputs to sink(port, item) in deficit round robin
+/// order, stops when sink returns false (it may only move from the items it
+/// takes), returns the number of outputs taken
+template<class Sink>
+size_t
+flush(Sink &&sink, size_t limit = SIZE_MAX)
+{
+  size_t flushed = 0;
+
+  while(!pactive.empty() && flushed < limit)
+  {
+    Queue &queue = pqueues[pactive.front()];
+
+    if(!queue.served)
+    {
+      queue.deficit += pquantum;
+      queue.served = true;
+    }
+
+    while(!queue.items.empty())
+    {
+      size_t cost = pcost ? pcost(queue.items.front()) : 1;
+
+      if(cost > queue.deficit)
+        break;
+
+      // Backpressure or the limit: the port keeps its turn
+      if(flushed == limit || !sink(queue.port, queue.items.front()))
+        return flushed;
+
+      queue.deficit -= cost;
+      queue.items.pop_front();
+      ++queue.counters.flushed;
+      ++ptotal.flushed;
+      --psize;
+      ++flushed;
+    }
+
+    // The end of the turn of the port
+    pactive.pop_front();
+    queue.served = false;
+
+    if(queue.items.empty())
+    {
+      queue.deficit = 0;
+      queue.active = false;
+    }
+    else
+      pactive.push_back(&queue - pqueues.data());
+  }
+
+  return flushed;
+}
+
+/// Calls f(port, item) on every queued output
+template<class F>
+void
+forEach(F &&f)
+{
+  for(Queue &queue : pqueues)
+    for(T &item : queue.items)
+      f(queue.port, item);
+}
+
+/// Queued outputs
+size_t
+size() const
+{
+  return psize;
+}
+
+bool
+empty() const
+{
+  return !psize;
+}
+
+/// Counters of all the ports
+const Counters &
+counters() const
+{
+  return ptotal;
+}
+
+/// Counters of a port
+Counters
+counters(unsigned int port) const
+{
+  auto index = pindex.find(port);
+
+  return index == pindex.end() ? Counters() : pqueues[index->second].counters;
+}
+
+/// The ports that had outputs
+vector<unsigned int>
+ports() const
+{
+  vector<unsigned int> ports;
+
+  for(const Queue &queue : pqueues)
+    ports.push_back(queue.port);
+
+  return ports;
+}
+
+private:
+
+struct Queue
+{
+  unsigned int port;
+  size_t depth;
+  deque<T> items;
+  size_t deficit = 0;
+  bool active = false;          // In the active list
+  bool served = false;          // Got its quantum in the current turn
+  Counters counters;
+};
+
+size_t pdepth;
+DropPolicy ppolicy;
+size_t pquantum;
+function<size_t(const T &)> pcost;
+
+// Queues are never removed, the active list holds their indexes
+vector<Queue> pqueues;
+unordered_map<unsigned int, size_t> pindex;
+deque<size_t> pactive;
+size_t psize = 0;
+Counters ptotal;
+
+Queue &
+find(unsigned int port)
+{
+  auto index = pindex.find(port);
+
+  if(index != pindex.end())
+    return pqueues[index->second];
+
+  pindex[port] = pqueues.size();
+  pqueues.push_back(Queue());
+  pqueues.back().port = port;
+  pqueues.back().depth = pdepth;
+  return pqueues.back();
+}
+
+};
+
+}
+
+#endif // PTBM_OUTQUEUE_H
@@ -0,0 +1,222 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_PACKET_H
+#define PTBM_PACKET_H
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/uio.h>
+#define PTBM_IOVEC
+#endif
+
+using namespace std;
+
+namespace ptbm
+{
+
+// The bytes of a packet shared by its copies: either a copy owned by the
+// payload or bytes of someone else (a receive buffer) given back by a release
+// function when the last packet referring to them is gone.
+class Payload
+{
+
+public:
+
+/// A payload of a copy of the bytes
+static shared_ptr<const Payload>
+copy(const void *data, size_t size)
+{
+  shared_ptr<Payload> payload(new Payload);
+
+  payload->pstorage.assign((const unsigned char *)data,
+                           (const unsigned char *)data + size);
+  payload->pdata = payload->pstorage.data();
+  payload->psize = size;
+  return payload;
+}
+
+/// A payload of the bytes themselves, release is called when no packet
+/// refers to them
+static shared_ptr<const Payload>
+wrap(const void *data, size_t size, function<void()> release = nullptr)
+{
+  shared_ptr<Payload> payload(new Payload);
+
+  payload->pdata = (const unsigned char *)data;
+  payload->psize = size;
+  payload->prelease = move(release);
+  return payload;
+}
+
+Payload(const Payload &) = delete;
+Payload &operator=(const Payload &) = delete;
+
+~Payload()
+{
+  if(prelease)
+    prelease();
+}
+
+const unsigned char *
+data() const
+{
+  return pdata;
+}
+
+size_t
+size() const
+{
+  return psize;
+}
+
+private:
+
+Payload() = default;
+
+vector<unsigned char> pstorage;
+const unsigned char *pdata = nullptr;
+size_t psize = 0;
+function<void()> prelease;
+
+};
+
+// A header and a payload. Copies of a packet (the outputs of its header) have
+// headers of their own and share the payload, the fan-out to N ports costs N
+// headers and no copies of the payload.
+//
+// The wire form is the header in binary form (see Ptbm::headerToBytes)
+// followed by the payload.
+template<class P>
+class Packet
+{
+
+public:
+
+typedef typename P::header_type header_type;
+
+Packet() = default;
+
+/// A packet of a header and the bytes of a buffer from offset
+Packet(const header_type &header, shared_ptr<const Payload> buffer,
+       size_t offset = 0)
+  : pheader(header), pbuffer(move(buffer)), poffset(offset)
+{
+  if(pbuffer && poffset > pbuffer->size())
+    throw runtime_error("Payload offset out of the buffer");
+}
+
+/// A packet of a buffer in wire form, the payload is the rest of the buffer
+static Packet
+fromWire(shared_ptr<const Payload> wire)
+{
+  if(!wire || wire->size() < (size_t)P::HEADER_BYTES)
+    throw runtime_error("Packet shorter than a header");
+
+  header_type header = P::headerFromBytes(wire->data());
+
+  return Packet(header, move(wire), P::HEADER_BYTES);
+}
+
+const header_type &
+header() const
+{
+  return pheader;
+}
+
+void
+setHeader(const header_type &header)
+{
+  pheader = header;
+}
+
+/// The buffer of the payload (shared by the copies)
+const shared_ptr<const Payload> &
+buffer() const
+{
+  return pbuffer;
+}
+
+const unsigned char *
+payload() const
+{
+  return pbuffer ? pbuffer->data() + poffset : nullptr;
+}
+
+size_t
+payloadSize() const
+{
+  return pbuffer ? pbuffer->size() - poffset : 0;
+}
+
+/// Processes the header with the context of a processor into a scratch and
+/// appends a packet of each output (the subtree as header, the same payload)
+/// and its port, nothing if the header is invalid. Threads can fan out with
+/// the same processor, each with a scratch of its own.
+void
+fanOut(const P &ptbm, typename P::Scratch &scratch,
+       vector<unsigned int> &ports, vector<Packet> &outputs) const
+{
+  P::process(ptbm.context(), pheader, scratch);
+
+  for(size_t n=0; n<scratch.ports.size(); n++)
+  {
+    ports.push_back(scratch.ports[n]);
+    outputs.push_back(Packet(scratch.subtrees[n], pbuffer, poffset));
+  }
+}
+
+/// Writes the wire form of the packet
+void
+toWire(vector<unsigned char> &wire) const
+{
+  wire.resize(P::HEADER_BYTES + payloadSize());
+  P::headerToBytes(pheader, wire.data());
+
+  if(payloadSize())
+    memcpy(wire.data() + P::HEADER_BYTES, payload(), payloadSize());
+}
+
+#ifdef PTBM_IOVEC
+/// Scatter-gather form of the wire form for sendmsg: the header written to
+/// headerBytes (HEADER_BYTES) and the payload in place, returns the number of
+/// vectors used
+int
+toIovec(unsigned char *headerBytes, iovec vecs[2]) const
+{
+  P::headerToBytes(pheader, headerBytes);
+  vecs[0].iov_base = headerBytes;
+  vecs[0].iov_len = P::HEADER_BYTES;
+
+  if(!payloadSize())
+    return 1;
+
+  vecs[1].iov_base = (void *)payload();
+  vecs[1].iov_len = payloadSize();
+  return 2;
+}
+#endif
+
+private:
+
+header_type pheader;
+shared_ptr<const Payload> pbuffer;
+size_t poffset = 0;
+
+};
+
+}
+
+#endif // PTBM_PACKET_H
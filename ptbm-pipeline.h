@@ -0,0 +1,405 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_PIPELINE_H
+#define PTBM_PIPELINE_H
+
+#include <chrono>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+
+#include "ptbm-config.h"
+#include "ptbm-spsc.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+// Processing of a trace in four stages, each on a thread of its own:
+//
+// * reader: reads batches of lines
+// * parser: parses the header bits of the lines (the last field of a line,
+//   TIME ROUTER BITS or BITS)
+// * processor: processes the headers as a router
+// * writer: formats the outputs (PACKET PORT SUBTREE) and writes them
+//
+// The stages pass batches through bounded SPSC rings and the writer gives
+// them back to the reader, so at most depth batches are in flight: a stage
+// waits for its output ring to have room (backpressure) and for its input ring
+// to have a batch. The time a stage works and waits tells which one limits
+// the throughput.
+template<class P>
+class Pipeline
+{
+
+public:
+
+typedef typename P::header_type header_type;
+
+struct StageStats
+{
+  const char *name;
+  long long batches = 0;
+  double busy = 0;              // Seconds working
+  double starved = 0;           // Seconds waiting for a batch
+  double blocked = 0;           // Seconds waiting for room in the next ring
+};
+
+struct Stats
+{
+  long long headers = 0;
+  long long outputs = 0;
+  long long invalid = 0;
+  double seconds = 0;
+  StageStats stages[4];
+
+  void
+  print(ostream &out) const
+  {
+    out << "headers: " << headers << ", "
+        << "outputs: " << outputs << ", "
+        << "invalid: " << invalid << ", "
+        << "seconds: " << seconds << endl
+        << "headers/s: " << (seconds > 0 ? headers / seconds : 0) << endl;
+
+    for(const StageStats &stage : stages)
+      out << stage.name << ": "
+          << "batches: " << stage.batches << ", "
+          << "busy: " << percent(stage.busy) << "%, "
+          << "starved: " << percent(stage.starved) << "%, "
+          << "blocked: " << percent(stage.blocked) << "%" << endl;
+  }
+
+  double
+  percent(double part) const
+  {
+    return seconds > 0 ? (int)(1000 * part / seconds) / 10.0 : 0;
+  }
+};
+
+/// A pipeline of a configured processor, batch lines per batch and depth
+/// batches in flight
+Pipeline(const P &ptbm, size_t batch = 64, size_t depth = 16)
+  : pptbm(ptbm),
+    pbatch(batch),
+    pfree(depth),
+    pparse(depth),
+    pprocess(depth),
+    pwrite(depth)
+{
+  if(batch < 1)
+    throw runtime_error("Batch size must be at least 1");
+
+  if(depth < 2)
+    throw runtime_error("Pipeline depth must be at least 2");
+
+  pstats.stages[READER].name = "reader";
+  pstats.stages[PARSER].name = "parser";
+  pstats.stages[PROCESSOR].name = "processor";
+  pstats.stages[WRITER].name = "writer";
+
+  for(size_t i=0; i<depth; i++)
+  {
+    pbatches.emplace_back(new Batch);
+    pfree.tryPush(pbatches.back().get());
+  }
+}
+
+Pipeline(const Pipeline &) = delete;
+Pipeline &operator=(const Pipeline &) = delete;
+
+/// Takes the virtual ports from a configuration store as a reader slot, a
+/// new configuration is used from the next batch of the processor
+void
+setConfig(ConfigStore *config, int reader = 0)
+{
+  pconfig = config;
+  preader = reader;
+  pversion = 0;
+}
+
+/// Processes the trace of in and writes the outputs to out
+void
+run(istream &in, ostream &out)
+{
+  auto start = chrono::steady_clock::now();
+
+  // A processor of the layout only to print the subtrees, the processor
+  // thread changes the virtual ports of pptbm
+  P printer;
+
+  printer.setCompactLayout(pptbm.context().compact());
+
+  thread parser([this]() { parse(); });
+  thread processor([this]() { process(); });
+  thread writer([this, &out, &printer]() { write(out, printer); });
+
+  read(in);
+
+  parser.join();
+  processor.join();
+  writer.join();
+
+  pstats.seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+}
+
+const Stats &
+stats() const
+{
+  return pstats;
+}
+
+private:
+
+enum Stage
+{
+  READER,
+  PARSER,
+  PROCESSOR,
+  WRITER
+};
+
+// The lines of a batch and what the stages made of them, reused by the
+// reader (a null batch ends the trace)
+struct Batch
+{
+  long long first;              // Index of the first header
+  size_t count;                 // Lines
+  vector<string> lines;
+  vector<header_type> headers;
+  vector<string> errors;        // Not empty: the header is invalid
+  vector<size_t> ends;          // End of the outputs of the headers
+  vector<unsigned int> ports;
+  vector<header_type> subtrees;
+  string text;                  // The formatted outputs
+};
+
+typedef chrono::steady_clock::time_point time_point;
+
+P pptbm;
+ConfigStore *pconfig = nullptr;
+int preader = 0;
+uint64_t pversion = 0;
+size_t pbatch;
+vector<unique_ptr<Batch>> pbatches;
+SpscRing<Batch *> pfree;
+SpscRing<Batch *> pparse;
+SpscRing<Batch *> pprocess;
+SpscRing<Batch *> pwrite;
+Stats pstats;
+
+/// Takes a batch from a ring, the wait counts as starved (as blocked for
+/// the free batches of the reader)
+Batch *
+take(SpscRing<Batch *> &ring, Stage stage)
+{
+  Batch *batch;
+  auto start = chrono::steady_clock::now();
+
+  while(!ring.tryPop(batch))
+    this_thread::yield();
+
+  (&ring == &pfree ? pstats.stages[stage].blocked :
+                     pstats.stages[stage].starved) += since(start);
+  return batch;
+}
+
+/// Passes a batch to a ring, the wait counts as blocked
+void
+pass(SpscRing<Batch *> &ring, Batch *batch, Stage stage)
+{
+  auto start = chrono::steady_clock::now();
+
+  while(!ring.tryPush(batch))
+    this_thread::yield();
+
+  pstats.stages[stage].blocked += since(start);
+}
+
+static double
+since(time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void
+read(istream &in)
+{
+  long long headers = 0;
+
+  for(;;)
+  {
+    Batch *batch = take(pfree, READER);
+    auto start = chrono::steady_clock::now();
+
+    if(batch->lines.size() < pbatch)
+      batch->lines.resize(pbatch);
+
+    batch->first = headers;
+    batch->count = 0;
+
+    while(batch->count < pbatch && getline(in, batch->lines[batch->count]))
+      if(!batch->lines[batch->count].empty())
+        ++batch->count;
+
+    headers += batch->count;
+    ++pstats.stages[READER].batches;
+    pstats.stages[READER].busy += since(start);
+
+    if(!batch->count)
+    {
+      pfree.tryPush(batch);
+      pass(pparse, nullptr, READER);
+      break;
+    }
+
+    pass(pparse, batch, READER);
+  }
+
+  pstats.headers = headers;
+}
+
+void
+parse()
+{
+  while(Batch *batch = take(pparse, PARSER))
+  {
+    auto start = chrono::steady_clock::now();
+
+    batch->headers.resize(batch->count);
+    batch->errors.resize(batch->count);
+
+    for(size_t i=0; i<batch->count; i++)
+    {
+      const string &line = batch->lines[i];
+      size_t end = line.find_last_not_of(" \t\r");
+      size_t begin = line.find_last_of(" \t", end) + 1;
+
+      batch->errors[i].clear();
+
+      try
+      {
+        if(end == string::npos || end + 1 - begin != batch->headers[i].size())
+          throw invalid_argument("length");
+
+        batch->headers[i] = header_type(line, begin, end + 1 - begin);
+      }
+      catch(exception &)
+      {
+        batch->errors[i] = "Invalid header bits";
+      }
+    }
+
+    ++pstats.stages[PARSER].batches;
+    pstats.stages[PARSER].busy += since(start);
+    pass(pprocess, batch, PARSER);
+  }
+
+  pass(pprocess, nullptr, PARSER);
+}
+
+void
+process()
+{
+  long long outputs = 0, invalid = 0;
+
+  while(Batch *batch = take(pprocess, PROCESSOR))
+  {
+    auto start = chrono::steady_clock::now();
+
+    if(pconfig)
+      pconfig->apply(pptbm, preader, pversion);
+
+    batch->ends.resize(batch->count);
+    batch->ports.clear();
+    batch->subtrees.clear();
+
+    for(size_t i=0; i<batch->count; i++)
+    {
+      size_t first = batch->ports.size();
+
+      if(batch->errors[i].empty())
+        try
+        {
+          P::process(pptbm.context(), batch->headers[i], batch->ports,
+                     batch->subtrees);
+        }
+        catch(exception &e)
+        {
+          batch->ports.resize(first);
+          batch->subtrees.resize(first);
+          batch->errors[i] = e.what();
+        }
+
+      if(!batch->errors[i].empty())
+        ++invalid;
+
+      batch->ends[i] = batch->ports.size();
+    }
+
+    outputs += batch->ports.size();
+    ++pstats.stages[PROCESSOR].batches;
+    pstats.stages[PROCESSOR].busy += since(start);
+    pass(pwrite, batch, PROCESSOR);
+  }
+
+  pass(pwrite, nullptr, PROCESSOR);
+  pstats.outputs = outputs;
+  pstats.invalid = invalid;
+}
+
+void
+write(ostream &out, P &printer)
+{
+  while(Batch *batch = take(pwrite, WRITER))
+  {
+    auto start = chrono::steady_clock::now();
+    size_t output = 0;
+
+    batch->text.clear();
+
+    for(size_t i=0; i<batch->count; i++)
+    {
+      string packet = to_string(batch->first + i);
+
+      if(!batch->errors[i].empty())
+        batch->text += packet + " invalid: " + batch->errors[i] + "\n";
+
+      for(; output<batch->ends[i]; output++)
+      {
+        printer.setHeaderBits(batch->subtrees[output]);
+
+        string subtree = printer.getHeaderString();
+
+        batch->text += packet + " " + to_string(batch->ports[output]) + " " +
+                       (subtree.size() ? subtree : "*") + "\n";
+      }
+    }
+
+    out.write(batch->text.data(), batch->text.size());
+    ++pstats.stages[WRITER].batches;
+    pstats.stages[WRITER].busy += since(start);
+    pass(pfree, batch, WRITER);
+  }
+
+  out.flush();
+}
+
+};
+
+}
+
+#endif // PTBM_PIPELINE_H
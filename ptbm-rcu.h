@@ -0,0 +1,179 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_RCU_H
+#define PTBM_RCU_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+using namespace std;
+
+namespace ptbm
+{
+
+// Epoch based read-copy-update: readers never block or wait, writers publish
+// new objects by an atomic pointer store and retire the old ones, which are
+// freed when no reader can hold them any more.
+//
+// Every reader thread has a slot (0..readers-1), a read section stores the
+// global epoch in it. An object retired at epoch E can be freed when every
+// reader is outside of a read section or entered it after E.
+class Rcu
+{
+
+public:
+
+explicit Rcu(int readers)
+  : preaders(readers),
+    pslots(new Slot[readers > 0 ? readers : 1])
+{
+  if(readers < 1)
+    throw runtime_error("Number of readers must be at least 1");
+}
+
+Rcu(const Rcu &) = delete;
+Rcu &operator=(const Rcu &) = delete;
+
+/// Frees the retired objects (no reader may be in a read section)
+~Rcu()
+{
+  for(Retired &retired : pretired)
+    retired.second();
+}
+
+/// A read section of a reader slot (not nested)
+class ReadGuard
+{
+public:
+  ReadGuard(Rcu &rcu, int reader)
+    : prcu(rcu), preader(reader)
+  {
+    prcu.readLock(preader);
+  }
+
+  ~ReadGuard()
+  {
+    prcu.readUnlock(preader);
+  }
+
+  ReadGuard(const ReadGuard &) = delete;
+  ReadGuard &operator=(const ReadGuard &) = delete;
+
+private:
+  Rcu &prcu;
+  int preader;
+};
+
+int
+readers() const
+{
+  return preaders;
+}
+
+void
+readLock(int reader)
+{
+  if(reader < 0 || reader >= preaders)
+    throw runtime_error("Invalid reader slot: " + to_string(reader));
+
+  // Sequentially consistent, so a writer either sees the slot or the reader
+  // sees the newly published pointer
+  pslots[reader].epoch.store(pepoch.load(memory_order_seq_cst),
+                             memory_order_seq_cst);
+}
+
+void
+readUnlock(int reader)
+{
+  pslots[reader].epoch.store(QUIESCENT, memory_order_release);
+}
+
+/// Frees an object (by deleter) after the readers are done with it, call it
+/// after the object was unpublished
+void
+retire(function<void()> deleter)
+{
+  lock_guard<mutex> lock(pmutex);
+  pretired.push_back(Retired(pepoch.fetch_add(1, memory_order_seq_cst),
+                             move(deleter)));
+}
+
+/// Frees the retired objects no reader can hold, returns their number
+size_t
+reclaim()
+{
+  lock_guard<mutex> lock(pmutex);
+  uint64_t oldest = UINT64_MAX;
+
+  for(int i=0; i<preaders; i++)
+  {
+    uint64_t epoch = pslots[i].epoch.load(memory_order_seq_cst);
+
+    if(epoch != QUIESCENT && epoch < oldest)
+      oldest = epoch;
+  }
+
+  // Retired in epoch order
+  size_t freed = 0;
+
+  while(freed < pretired.size() && pretired[freed].first < oldest)
+    pretired[freed++].second();
+
+  pretired.erase(pretired.begin(), pretired.begin() + freed);
+  return freed;
+}
+
+/// Number of objects waiting to be freed
+size_t
+pending()
+{
+  lock_guard<mutex> lock(pmutex);
+  return pretired.size();
+}
+
+/// Waits until every retired object is freed
+void
+synchronize()
+{
+  while(reclaim(), pending())
+    this_thread::yield();
+}
+
+private:
+
+static const uint64_t QUIESCENT = UINT64_MAX;
+
+// The slots of the readers on separate cache lines
+struct Slot
+{
+  atomic<uint64_t> epoch{QUIESCENT};
+  char pad[64 - sizeof(atomic<uint64_t>)];
+};
+
+typedef pair<uint64_t, function<void()>> Retired;
+
+int preaders;
+unique_ptr<Slot[]> pslots;
+atomic<uint64_t> pepoch{1};
+mutex pmutex;
+vector<Retired> pretired;
+
+};
+
+}
+
+#endif // PTBM_RCU_H
@@ -0,0 +1,662 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_SERVER_H
+#define PTBM_SERVER_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define PTBM_SERVER
+#endif
+
+#include "ptbm-config.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+#ifdef PTBM_SERVER
+
+// Serves a configured header processor (virtual ports, layout) on a Unix
+// domain stream socket. One thread multiplexes the clients by epoll, every
+// client can send any number of requests without waiting for the replies,
+// the replies come in the order of the requests.
+//
+// Every integer is 4 bytes little endian, a header is HEADER_BYTES bytes
+// (see Ptbm::headerToBytes). A request is a frame of a batch of items:
+//
+//   length | op (1 byte) | count | count items
+//
+// where length is the size of the rest of the frame. The reply is a frame of
+// the same op and count with one result per item:
+//
+//   PROCESS   item:   header
+//             result: 0 | outputs | outputs times (port | header)
+//   GENERATE  item:   brackets length | brackets | numbers | numbers times num
+//             result: 0 | header
+//   PRINT     item:   header
+//             result: 0 | text length | text
+//   RELOAD    item:   text length | text (virtual ports, empty: the file)
+//             result: 0 | version of the configuration
+//
+// An item that fails has the result 1 | message length | message. A frame
+// that cannot be parsed closes the connection.
+template<class P>
+class Server
+{
+
+public:
+
+typedef typename P::header_type header_type;
+
+enum Op
+{
+  PROCESS = 1,
+  GENERATE = 2,
+  PRINT = 3,
+  RELOAD = 4
+};
+
+/// Size limit of a request frame
+static const uint32_t MAX_FRAME = 64 << 20;
+
+/// Reads of a connection per wakeup (64 KiB each)
+static const int MAX_READS = 16;
+
+struct Stats
+{
+  long long connections = 0;
+  long long requests = 0;
+  long long items = 0;
+  long long errors = 0;       // Items that failed
+  long long protocolErrors = 0;
+};
+
+/// Listens on a socket path (a stale socket file is replaced)
+Server(P &ptbm, const string &path)
+  : pptbm(ptbm), ppath(path)
+{
+  sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if(path.empty() || path.size() >= sizeof(addr.sun_path))
+    throw runtime_error("Invalid socket path: " + path);
+
+  memcpy(addr.sun_path, path.c_str(), path.size());
+
+  struct stat st;
+
+  if(lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path.c_str());
+
+  plisten = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if(plisten < 0)
+    throw runtime_error(string("Cannot create socket: ") + strerror(errno));
+
+  if(bind(plisten, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+     listen(plisten, SOMAXCONN) < 0)
+  {
+    string error = strerror(errno);
+    close(plisten);
+    throw runtime_error("Cannot listen on " + path + ": " + error);
+  }
+
+  pepoll = epoll_create1(EPOLL_CLOEXEC);
+  pstop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if(pepoll < 0 || pstop < 0)
+  {
+    string error = strerror(errno);
+    closeAll();
+    throw runtime_error("Cannot create event loop: " + error);
+  }
+
+  watch(plisten, EPOLLIN);
+  watch(pstop, EPOLLIN);
+}
+
+Server(const Server &) = delete;
+Server &operator=(const Server &) = delete;
+
+~Server()
+{
+  for(auto &conn : pconnections)
+    close(conn.first);
+
+  closeAll();
+  unlink(ppath.c_str());
+}
+
+/// Serves the clients until stop()
+void
+run()
+{
+  epoll_event events[64];
+
+  for(;;)
+  {
+    int n = epoll_wait(pepoll, events, 64, -1);
+
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+
+      throw runtime_error(string("epoll_wait failed: ") + strerror(errno));
+    }
+
+    for(int i=0; i<n; i++)
+    {
+      int fd = events[i].data.fd;
+
+      if(fd == pstop)
+        return;
+
+      if(fd == plisten)
+      {
+        accept();
+        continue;
+      }
+
+      auto it = pconnections.find(fd);
+
+      if(it == pconnections.end())
+        continue;
+
+      Connection &conn = *it->second;
+      bool open = true;
+
+      if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        open = receive(conn);
+
+      if(open)
+        open = send(conn);
+
+      if(!open)
+        drop(fd);
+    }
+  }
+}
+
+/// Takes the virtual ports from a configuration store as a reader slot, a
+/// new configuration is used from the next request frame
+void
+setConfig(ConfigStore *config, int reader = 0)
+{
+  pconfig = config;
+  preader = reader;
+  pversion = 0;
+}
+
+/// Makes run() return, can be called from a signal handler or another thread
+void
+stop()
+{
+  uint64_t one = 1;
+  ssize_t written = write(pstop, &one, sizeof(one));
+  (void)written;
+}
+
+/// The descriptor stop() writes (for signal handlers)
+int
+stopDescriptor() const
+{
+  return pstop;
+}
+
+const Stats &
+stats() const
+{
+  return pstats;
+}
+
+private:
+
+struct Connection
+{
+  int fd;
+  string in;                  // Received bytes not yet parsed
+  string out;                 // Replies not yet sent
+  size_t sent = 0;            // Sent bytes of out
+  bool eof = false;           // The client sends no more requests
+  uint32_t events = EPOLLIN | EPOLLRDHUP;
+};
+
+P &pptbm;
+string ppath;
+ConfigStore *pconfig = nullptr;
+int preader = 0;
+uint64_t pversion = 0;
+int plisten = -1;
+int pepoll = -1;
+int pstop = -1;
+unordered_map<int, unique_ptr<Connection>> pconnections;
+Stats pstats;
+
+// Scratch of the requests
+vector<unsigned int> pports;
+vector<header_type> psubtrees;
+vector<unsigned int> pnums;
+unsigned char pbytes[P::HEADER_BYTES];
+
+void
+closeAll()
+{
+  if(plisten >= 0)
+    close(plisten);
+
+  if(pepoll >= 0)
+    close(pepoll);
+
+  if(pstop >= 0)
+    close(pstop);
+}
+
+void
+watch(int fd, uint32_t events)
+{
+  epoll_event event;
+
+  event.events = events;
+  event.data.fd = fd;
+
+  if(epoll_ctl(pepoll, EPOLL_CTL_ADD, fd, &event) < 0)
+    throw runtime_error(string("epoll_ctl failed: ") + strerror(errno));
+}
+
+void
+accept()
+{
+  for(;;)
+  {
+    int fd = accept4(plisten, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if(fd < 0)
+    {
+      // EAGAIN: no more pending, anything else drops only that client
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      return;
+    }
+
+    unique_ptr<Connection> conn(new Connection);
+    conn->fd = fd;
+
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = fd;
+
+    if(epoll_ctl(pepoll, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      close(fd);
+      continue;
+    }
+
+    pconnections[fd] = move(conn);
+    ++pstats.connections;
+  }
+}
+
+void
+drop(int fd)
+{
+  epoll_ctl(pepoll, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  pconnections.erase(fd);
+}
+
+/// Reads what a client sent and answers the complete frames, returns false
+/// when the connection is to be closed
+bool
+receive(Connection &conn)
+{
+  char buffer[65536];
+
+  // A client that does not read its replies is not read either. At most a
+  // frame is read ahead and a few reads per wakeup, the rest waits for the
+  // next one (level triggered), so a client streaming without a pause
+  // neither grows its buffer nor starves the others.
+  for(int reads=0;
+      reads < MAX_READS && !conn.eof && conn.in.size() <= MAX_FRAME + 4 &&
+      conn.out.size() - conn.sent < MAX_FRAME;
+      reads++)
+  {
+    ssize_t n = read(conn.fd, buffer, sizeof(buffer));
+
+    if(n > 0)
+    {
+      conn.in.append(buffer, n);
+      continue;
+    }
+
+    if(n == 0)
+      conn.eof = true;
+    else if(errno == EINTR)
+      continue;
+    else if(errno != EAGAIN && errno != EWOULDBLOCK)
+      return false;
+
+    break;
+  }
+
+  size_t pos = 0;
+
+  while(conn.in.size() - pos >= 4)
+  {
+    uint32_t length = getU32(conn.in.data() + pos);
+
+    if(length > MAX_FRAME)
+    {
+      ++pstats.protocolErrors;
+      return false;
+    }
+
+    if(conn.in.size() - pos - 4 < length)
+      break;
+
+    if(!request((const unsigned char *)conn.in.data() + pos + 4, length,
+                conn.out))
+    {
+      ++pstats.protocolErrors;
+      return false;
+    }
+
+    pos += 4 + length;
+  }
+
+  conn.in.erase(0, pos);
+  return true;
+}
+
+/// Sends the pending replies, returns false when the connection is to be
+/// closed
+bool
+send(Connection &conn)
+{
+  while(conn.sent < conn.out.size())
+  {
+    ssize_t n = ::send(conn.fd, conn.out.data() + conn.sent,
+                       conn.out.size() - conn.sent, MSG_NOSIGNAL);
+
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+
+      break;
+    }
+
+    conn.sent += n;
+  }
+
+  if(conn.sent == conn.out.size())
+  {
+    conn.out.clear();
+    conn.sent = 0;
+  }
+
+  // The replies of a half closed client are still sent
+  if(conn.eof && conn.out.empty())
+    return false;
+
+  // Waits for EPOLLOUT only while a reply is pending
+  bool reading = !conn.eof && conn.out.size() - conn.sent < MAX_FRAME;
+  uint32_t events = (reading ? EPOLLIN | EPOLLRDHUP : 0) |
+                    (conn.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+
+  if(events != conn.events)
+  {
+    epoll_event event;
+
+    event.events = events;
+    event.data.fd = conn.fd;
+
+    if(epoll_ctl(pepoll, EPOLL_CTL_MOD, conn.fd, &event) < 0)
+      return false;
+
+    conn.events = events;
+  }
+
+  return true;
+}
+
+/// Answers a request frame, returns false if it cannot be parsed
+bool
+request(const unsigned char *data, uint32_t length, string &out)
+{
+  if(length < 5)
+    return false;
+
+  unsigned char op = data[0];
+  uint32_t count = getU32(data + 1);
+  const unsigned char *end = data + length;
+
+  if(op != PROCESS && op != GENERATE && op != PRINT && op != RELOAD)
+    return false;
+
+  if(pconfig)
+    pconfig->apply(pptbm, preader, pversion);
+
+  size_t start = out.size();
+
+  putU32(out, 0);               // Length, set at the end
+  out.push_back((char)op);
+  putU32(out, count);
+  data += 5;
+
+  for(uint32_t i=0; i<count; i++)
+  {
+    if(op == GENERATE ? !generate(data, end, out) :
+       op == RELOAD ? !reload(data, end, out) : !header(op, data, end, out))
+    {
+      out.resize(start);
+      return false;
+    }
+  }
+
+  if(data != end)
+  {
+    out.resize(start);
+    return false;
+  }
+
+  uint32_t reply = out.size() - start - 4;
+
+  for(int b=0; b<4; b++)
+    out[start + b] = (char)(reply >> (8 * b));
+
+  ++pstats.requests;
+  pstats.items += count;
+  return true;
+}
+
+/// Answers a PROCESS or PRINT item
+bool
+header(unsigned char op, const unsigned char *&data, const unsigned char *end,
+       string &out)
+{
+  if(end - data < P::HEADER_BYTES)
+    return false;
+
+  header_type bits = P::headerFromBytes(data);
+  data += P::HEADER_BYTES;
+
+  try
+  {
+    if(op == PROCESS)
+    {
+      pports.clear();
+      psubtrees.clear();
+      P::process(pptbm.context(), bits, pports, psubtrees);
+
+      out.push_back(0);
+      putU32(out, pports.size());
+
+      for(size_t n=0; n<pports.size(); n++)
+      {
+        putU32(out, pports[n]);
+        P::headerToBytes(psubtrees[n], pbytes);
+        out.append((const char *)pbytes, P::HEADER_BYTES);
+      }
+    }
+    else
+    {
+      pptbm.setHeaderBits(bits);
+
+      string text = pptbm.getHeaderString();
+
+      out.push_back(0);
+      putU32(out, text.size());
+      out += text;
+    }
+  }
+  catch(exception &e)
+  {
+    failed(e.what(), out);
+  }
+
+  return true;
+}
+
+/// Answers a GENERATE item
+bool
+generate(const unsigned char *&data, const unsigned char *end, string &out)
+{
+  if(end - data < 4)
+    return false;
+
+  uint32_t size = getU32(data);
+  data += 4;
+
+  if((uint32_t)(end - data) < size)
+    return false;
+
+  string brackets((const char *)data, size);
+  data += size;
+
+  if(end - data < 4)
+    return false;
+
+  uint32_t count = getU32(data);
+  data += 4;
+
+  if((uint32_t)(end - data) / 4 < count)
+    return false;
+
+  pnums.clear();
+
+  for(uint32_t i=0; i<count; i++, data += 4)
+    pnums.push_back(getU32(data));
+
+  try
+  {
+    pptbm.setHeader(brackets, pnums);
+    P::headerToBytes(pptbm.getHeaderBits(), pbytes);
+
+    out.push_back(0);
+    out.append((const char *)pbytes, P::HEADER_BYTES);
+  }
+  catch(exception &e)
+  {
+    failed(e.what(), out);
+  }
+
+  return true;
+}
+
+/// Answers a RELOAD item
+bool
+reload(const unsigned char *&data, const unsigned char *end, string &out)
+{
+  if(end - data < 4)
+    return false;
+
+  uint32_t size = getU32(data);
+  data += 4;
+
+  if((uint32_t)(end - data) < size)
+    return false;
+
+  string text((const char *)data, size);
+  data += size;
+
+  try
+  {
+    if(!pconfig)
+      throw runtime_error("The server has no configuration");
+
+    uint64_t version = text.empty() ? pconfig->reload() :
+                                      pconfig->publish(RouterConfig::parse(text));
+
+    out.push_back(0);
+    putU32(out, (uint32_t)version);
+  }
+  catch(exception &e)
+  {
+    failed(e.what(), out);
+  }
+
+  return true;
+}
+
+void
+failed(const string &message, string &out)
+{
+  out.push_back(1);
+  putU32(out, message.size());
+  out += message;
+  ++pstats.errors;
+}
+
+static uint32_t
+getU32(const void *data)
+{
+  const unsigned char *bytes = (const unsigned char *)data;
+
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static void
+putU32(string &out, uint32_t value)
+{
+  for(int b=0; b<4; b++)
+    out.push_back((char)(value >> (8 * b)));
+}
+
+};
+
+#endif // PTBM_SERVER
+
+}
+
+#endif // PTBM_SERVER_H
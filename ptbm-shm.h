@@ -0,0 +1,848 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_SHM_H
+#define PTBM_SHM_H
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#define PTBM_SHM
+#endif
+
+#include "ptbm-config.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+#ifdef PTBM_SHM
+
+// Shared memory transport of headers between processes. A region (a file in
+// /dev/shm, or a memfd opened as /proc/PID/fd/N) holds:
+//
+//   - a request ring of many producers and one consumer: every slot has a
+//     sequence number telling whose turn it is, a producer claims a slot by a
+//     compare and swap of the tail and publishes it by its sequence number
+//   - a result ring per producer (one producer, one consumer): the consumer
+//     writes the outputs of the requests of the producer
+//
+// The consumer dequeues requests in batches and publishes their results once
+// per batch. A side with nothing to do either spins (busy poll) or sleeps on
+// a futex in the region, the other side wakes it only if it sleeps.
+//
+// A producer has at most a result ring of requests on the way, so the
+// consumer never waits for a producer to read its results.
+
+/// Waits until *word is not expected (or the timeout in ms passed)
+inline void
+futexWait(atomic<uint32_t> *word, uint32_t expected, int timeoutMs)
+{
+  timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &timeout,
+          nullptr, 0);
+}
+
+inline void
+futexWake(atomic<uint32_t> *word)
+{
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT32_MAX, nullptr,
+          nullptr, 0);
+}
+
+// A side that can sleep: it announces the sleep, checks its ring again and
+// sleeps on the wake counter, the other side bumps the counter only if it
+// announced the sleep
+struct ShmSleeper
+{
+  atomic<uint32_t> sleeping{0};
+  atomic<uint32_t> wakes{0};
+
+  /// Sleeps unless ready() (timeout in ms), returns true if it slept
+  template<class Ready>
+  bool
+  sleep(Ready ready, int timeoutMs)
+  {
+    uint32_t wake = wakes.load(memory_order_seq_cst);
+
+    sleeping.store(1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    bool slept = !ready();
+
+    if(slept)
+      futexWait(&wakes, wake, timeoutMs);
+
+    sleeping.store(0, memory_order_relaxed);
+    return slept;
+  }
+
+  /// Wakes the side if it sleeps (after its ring was changed)
+  void
+  wake()
+  {
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(sleeping.load(memory_order_seq_cst))
+    {
+      wakes.fetch_add(1, memory_order_seq_cst);
+      futexWake(&wakes);
+    }
+  }
+};
+
+// The outputs of a request in a result ring
+struct ShmResult
+{
+  enum Status
+  {
+    OK = 0,
+    INVALID = 1,        // The header could not be processed
+    TRUNCATED = 2       // More outputs than a result holds
+  };
+
+  uint64_t id;
+  uint32_t status;
+  uint32_t outputs;
+  const unsigned char *data;    // outputs times (port, header)
+  uint32_t headerBytes;
+
+  uint32_t
+  port(uint32_t i) const
+  {
+    uint32_t port;
+
+    memcpy(&port, data + (size_t)i * (4 + headerBytes), 4);
+    return port;
+  }
+
+  const unsigned char *
+  header(uint32_t i) const
+  {
+    return data + (size_t)i * (4 + headerBytes) + 4;
+  }
+};
+
+// The region and its rings, used by the producers and the consumer
+class ShmQueue
+{
+
+public:
+
+struct Params
+{
+  uint32_t headerBytes;
+  uint32_t capacity = 4096;     // Request slots (a power of 2)
+  uint32_t results = 1024;      // Result slots per producer (a power of 2)
+  uint32_t producers = 8;
+  uint32_t maxOutputs = 64;     // Outputs a result holds
+};
+
+/// Creates a region (replacing a file of the path)
+static ShmQueue *
+create(const string &path, Params params)
+{
+  params.capacity = roundUp(params.capacity);
+  params.results = roundUp(params.results);
+
+  if(!params.producers || !params.maxOutputs || !params.headerBytes)
+    throw runtime_error("Invalid shared memory ring parameters");
+
+  Layout layout = computeLayout(params);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+  if(fd < 0)
+    throw runtime_error("Cannot create " + path + ": " + strerror(errno));
+
+  if(ftruncate(fd, layout.size) < 0)
+  {
+    close(fd);
+    throw runtime_error("Cannot size " + path + ": " + strerror(errno));
+  }
+
+  ShmQueue *queue = new ShmQueue(fd, layout.size, path);
+  Control *control = new(queue->pbase) Control;
+
+  control->params = params;
+  control->layout = layout;
+  queue->ppending.assign(params.producers, 0);
+
+  for(uint32_t i=0; i<params.capacity; i++)
+    (new(queue->requestSlot(i)) RequestSlot)->seq.store(i);
+
+  for(uint32_t p=0; p<params.producers; p++)
+    new(queue->resultRing(p)) ResultRing;
+
+  // The producers check the magic last
+  memcpy(control->magic, magic(), sizeof(control->magic));
+  atomic_thread_fence(memory_order_release);
+  return queue;
+}
+
+/// Opens the region of a consumer
+static ShmQueue *
+attach(const string &path)
+{
+  int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+  if(fd < 0)
+    throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+  struct stat st;
+
+  if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Control))
+  {
+    close(fd);
+    throw runtime_error("Not a shared memory ring: " + path);
+  }
+
+  ShmQueue *queue = new ShmQueue(fd, st.st_size, "");
+
+  atomic_thread_fence(memory_order_acquire);
+
+  if(memcmp(queue->control()->magic, magic(), sizeof(queue->control()->magic)) ||
+     queue->control()->layout.size > (uint64_t)st.st_size)
+  {
+    delete queue;
+    throw runtime_error("Not a shared memory ring: " + path);
+  }
+
+  return queue;
+}
+
+ShmQueue(const ShmQueue &) = delete;
+ShmQueue &operator=(const ShmQueue &) = delete;
+
+~ShmQueue()
+{
+  munmap(pbase, psize);
+  close(pfd);
+
+  if(!powner.empty())
+    unlink(powner.c_str());
+}
+
+const Params &
+params() const
+{
+  return control()->params;
+}
+
+/// A producer id not used yet, throws if every producer is attached
+uint32_t
+attachProducer()
+{
+  uint32_t id = control()->attached.fetch_add(1);
+
+  if(id >= params().producers)
+    throw runtime_error("Every producer of the shared memory ring is attached");
+
+  return id;
+}
+
+/// Enqueues a request (producer), returns false if the ring is full
+bool
+push(uint32_t producer, uint64_t id, const unsigned char *header)
+{
+  Control *c = control();
+  uint64_t mask = c->params.capacity - 1;
+  uint64_t pos = c->requestTail.load(memory_order_relaxed);
+  RequestSlot *slot;
+
+  for(;;)
+  {
+    slot = requestSlot(pos & mask);
+
+    int64_t dif = (int64_t)(slot->seq.load(memory_order_acquire) - pos);
+
+    if(dif == 0)
+    {
+      if(c->requestTail.compare_exchange_weak(pos, pos + 1,
+                                              memory_order_relaxed))
+        break;
+    }
+    else if(dif < 0)
+      return false;
+    else
+      pos = c->requestTail.load(memory_order_relaxed);
+  }
+
+  slot->producer = producer;
+  slot->id = id;
+  memcpy(slot->header(), header, c->params.headerBytes);
+  slot->seq.store(pos + 1, memory_order_release);
+  return true;
+}
+
+/// Dequeues at most max requests (the consumer) and calls handle(producer,
+/// id, header) for each, returns their number
+template<class Handle>
+size_t
+popBatch(size_t max, Handle handle)
+{
+  Control *c = control();
+  uint64_t mask = c->params.capacity - 1;
+  size_t count = 0;
+
+  for(; count < max; count++)
+  {
+    RequestSlot *slot = requestSlot(phead & mask);
+
+    if(slot->seq.load(memory_order_acquire) != phead + 1)
+      break;
+
+    handle(slot->producer, slot->id, (const unsigned char *)slot->header());
+    slot->seq.store(phead + c->params.capacity, memory_order_release);
+    ++phead;
+  }
+
+  return count;
+}
+
+/// Whether a request is waiting (consumer)
+bool
+requestReady()
+{
+  RequestSlot *slot = requestSlot(phead & (params().capacity - 1));
+
+  return slot->seq.load(memory_order_acquire) == phead + 1;
+}
+
+/// The slot of the next result of a producer (consumer), null if its ring is
+/// full
+unsigned char *
+resultSlot(uint32_t producer)
+{
+  ResultRing *ring = resultRing(producer);
+  uint64_t tail = ring->tail.load(memory_order_relaxed) + ppending[producer];
+
+  if(tail - ring->head.load(memory_order_acquire) >= params().results)
+    return nullptr;
+
+  ++ppending[producer];
+  return resultData(producer, tail);
+}
+
+/// Publishes the results written since the last publish (consumer)
+void
+publishResults(uint32_t producer)
+{
+  ResultRing *ring = resultRing(producer);
+
+  ring->tail.fetch_add(ppending[producer], memory_order_release);
+  ppending[producer] = 0;
+  ring->sleeper.wake();
+}
+
+/// Calls handle(result) for at most max results of a producer, returns their
+/// number
+template<class Handle>
+size_t
+popResults(uint32_t producer, size_t max, Handle handle)
+{
+  ResultRing *ring = resultRing(producer);
+  uint64_t head = ring->head.load(memory_order_relaxed);
+  uint64_t count = ring->tail.load(memory_order_acquire) - head;
+
+  if(count > max)
+    count = max;
+
+  for(uint64_t i=0; i<count; i++)
+  {
+    const unsigned char *data = resultData(producer, head + i);
+    ShmResult result;
+
+    memcpy(&result.id, data, 8);
+    memcpy(&result.status, data + 8, 4);
+    memcpy(&result.outputs, data + 12, 4);
+    result.data = data + 16;
+    result.headerBytes = params().headerBytes;
+    handle(result);
+  }
+
+  ring->head.store(head + count, memory_order_release);
+  return count;
+}
+
+bool
+resultReady(uint32_t producer)
+{
+  ResultRing *ring = resultRing(producer);
+
+  return ring->tail.load(memory_order_acquire) !=
+         ring->head.load(memory_order_relaxed);
+}
+
+/// The sleeper of the consumer (woken by the producers)
+ShmSleeper &
+consumerSleeper()
+{
+  return control()->consumer;
+}
+
+/// The sleeper of a producer (woken by the consumer)
+ShmSleeper &
+producerSleeper(uint32_t producer)
+{
+  return resultRing(producer)->sleeper;
+}
+
+/// Bytes of a result slot
+size_t
+resultSize() const
+{
+  return control()->layout.resultSlotSize;
+}
+
+size_t
+size() const
+{
+  return psize;
+}
+
+private:
+
+static const char *
+magic()
+{
+  return "PTBMSHM1";
+}
+
+struct Layout
+{
+  uint64_t size;
+  uint64_t requests;            // Offset of the request slots
+  uint64_t results;             // Offset of the result rings
+  uint64_t requestSlotSize;
+  uint64_t resultSlotSize;
+  uint64_t resultRingSize;
+};
+
+struct alignas(64) Control
+{
+  char magic[8];
+  ShmQueue::Params params;
+  Layout layout;
+  alignas(64) atomic<uint32_t> attached{0};
+  alignas(64) atomic<uint64_t> requestTail{0};
+  alignas(64) ShmSleeper consumer;
+};
+
+struct RequestSlot
+{
+  atomic<uint64_t> seq;
+  uint64_t id;
+  uint32_t producer;
+  uint32_t pad;
+
+  unsigned char *
+  header()
+  {
+    return (unsigned char *)(this + 1);
+  }
+};
+
+struct alignas(64) ResultRing
+{
+  alignas(64) atomic<uint64_t> head{0};     // Producer
+  alignas(64) atomic<uint64_t> tail{0};     // Consumer
+  alignas(64) ShmSleeper sleeper;
+};
+
+int pfd;
+unsigned char *pbase;
+size_t psize;
+string powner;                  // The path of a created region
+uint64_t phead = 0;             // Of the request ring (consumer)
+vector<uint64_t> ppending;      // Unpublished results of the producers
+
+ShmQueue(int fd, size_t size, const string &owner)
+  : pfd(fd), psize(size), powner(owner)
+{
+  void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if(base == MAP_FAILED)
+  {
+    close(fd);
+    throw runtime_error(string("Cannot map the shared memory ring: ") +
+                        strerror(errno));
+  }
+
+  pbase = (unsigned char *)base;
+}
+
+static uint32_t
+roundUp(uint32_t value)
+{
+  uint32_t size = 1;
+
+  while(size < value)
+    size *= 2;
+
+  return size;
+}
+
+static uint64_t
+align(uint64_t value, uint64_t to)
+{
+  return (value + to - 1) / to * to;
+}
+
+static Layout
+computeLayout(const Params &params)
+{
+  Layout layout;
+
+  layout.requestSlotSize = align(sizeof(RequestSlot) + params.headerBytes, 8);
+  layout.resultSlotSize =
+      align(16 + (uint64_t)params.maxOutputs * (4 + params.headerBytes), 8);
+  layout.resultRingSize = align(sizeof(ResultRing) +
+                                params.results * layout.resultSlotSize, 64);
+  layout.requests = align(sizeof(Control), 64);
+  layout.results = align(layout.requests +
+                         params.capacity * layout.requestSlotSize, 64);
+  layout.size = layout.results + params.producers * layout.resultRingSize;
+  return layout;
+}
+
+Control *
+control() const
+{
+  return (Control *)pbase;
+}
+
+RequestSlot *
+requestSlot(uint64_t index)
+{
+  return (RequestSlot *)(pbase + control()->layout.requests +
+                         index * control()->layout.requestSlotSize);
+}
+
+ResultRing *
+resultRing(uint32_t producer)
+{
+  return (ResultRing *)(pbase + control()->layout.results +
+                        producer * control()->layout.resultRingSize);
+}
+
+unsigned char *
+resultData(uint32_t producer, uint64_t position)
+{
+  return (unsigned char *)(resultRing(producer) + 1) +
+         (position & (params().results - 1)) * control()->layout.resultSlotSize;
+}
+
+};
+
+// The producer library: a process (or thread) sending headers to the consumer
+// and reading their results
+class ShmProducer
+{
+
+public:
+
+/// Attaches to the region of a consumer, busy polls for the results or
+/// sleeps on a futex
+explicit ShmProducer(const string &path, bool busyPoll = false)
+  : pqueue(ShmQueue::attach(path)),
+    pbusyPoll(busyPoll)
+{
+  try
+  {
+    pid = pqueue->attachProducer();
+  }
+  catch(...)
+  {
+    delete pqueue;
+    throw;
+  }
+}
+
+ShmProducer(const ShmProducer &) = delete;
+ShmProducer &operator=(const ShmProducer &) = delete;
+
+~ShmProducer()
+{
+  delete pqueue;
+}
+
+/// Bytes of a header (in binary form, see Ptbm::headerToBytes)
+uint32_t
+headerBytes() const
+{
+  return pqueue->params().headerBytes;
+}
+
+/// Enqueues a header of an id, returns false if the request ring is full or
+/// a result ring of requests is on the way
+bool
+submit(uint64_t id, const unsigned char *header)
+{
+  if(poutstanding >= pqueue->params().results ||
+     !pqueue->push(pid, id, header))
+    return false;
+
+  ++poutstanding;
+  pqueue->consumerSleeper().wake();
+  return true;
+}
+
+/// Calls handle(const ShmResult &) for at most max results (the result is
+/// valid during the call), returns their number
+template<class Handle>
+size_t
+receive(Handle handle, size_t max = SIZE_MAX)
+{
+  size_t count = pqueue->popResults(pid, max, handle);
+
+  poutstanding -= count;
+  return count;
+}
+
+/// Waits for a result (at most timeoutMs)
+void
+wait(int timeoutMs = 100)
+{
+  if(pbusyPoll)
+  {
+    auto deadline = chrono::steady_clock::now() +
+                    chrono::milliseconds(timeoutMs);
+
+    while(!pqueue->resultReady(pid) && chrono::steady_clock::now() < deadline)
+      ;
+  }
+  else
+    pqueue->producerSleeper(pid).sleep(
+          [this]() { return pqueue->resultReady(pid); }, timeoutMs);
+}
+
+/// Requests without a result yet
+size_t
+outstanding() const
+{
+  return poutstanding;
+}
+
+private:
+
+ShmQueue *pqueue;
+bool pbusyPoll;
+uint32_t pid;
+size_t poutstanding = 0;
+
+};
+
+// The consumer loop: processes the requests of the producers by a configured
+// processor (virtual ports, layout)
+template<class P>
+class ShmConsumer
+{
+
+public:
+
+typedef typename P::header_type header_type;
+
+struct Stats
+{
+  long long requests = 0;
+  long long invalid = 0;
+  long long truncated = 0;
+  long long batches = 0;
+  long long sleeps = 0;         // Futex waits of the consumer
+};
+
+/// Creates the region of the producers
+ShmConsumer(P &ptbm, const string &path, ShmQueue::Params params,
+            size_t batch = 64, bool busyPoll = false)
+  : pptbm(ptbm),
+    pbatch(batch),
+    pbusyPoll(busyPoll)
+{
+  params.headerBytes = P::HEADER_BYTES;
+  pqueue = ShmQueue::create(path, params);
+  ptouched.assign(params.producers, 0);
+}
+
+ShmConsumer(const ShmConsumer &) = delete;
+ShmConsumer &operator=(const ShmConsumer &) = delete;
+
+/// Removes the region
+~ShmConsumer()
+{
+  delete pqueue;
+}
+
+const ShmQueue &
+queue() const
+{
+  return *pqueue;
+}
+
+/// Takes the virtual ports from a configuration store as a reader slot, a
+/// new configuration is used from the next batch
+void
+setConfig(ConfigStore *config, int reader = 0)
+{
+  pconfig = config;
+  preader = reader;
+  pversion = 0;
+}
+
+/// Processes the requests until stop becomes true
+void
+run(const atomic<bool> &stop)
+{
+  pstop = &stop;
+
+  while(!stop.load(memory_order_relaxed))
+  {
+    if(pconfig)
+      pconfig->apply(pptbm, preader, pversion);
+
+    size_t count = pqueue->popBatch(pbatch,
+        [this](uint32_t producer, uint64_t id, const unsigned char *header)
+        {
+          handle(producer, id, header);
+        });
+
+    if(count)
+    {
+      ++pstats.batches;
+      pstats.requests += count;
+
+      for(uint32_t producer : ptouchedList)
+      {
+        pqueue->publishResults(producer);
+        ptouched[producer] = 0;
+      }
+
+      ptouchedList.clear();
+    }
+    else if(!pbusyPoll &&
+            pqueue->consumerSleeper().sleep(
+              [this]() { return pqueue->requestReady(); }, 100))
+      ++pstats.sleeps;
+  }
+}
+
+const Stats &
+stats() const
+{
+  return pstats;
+}
+
+private:
+
+P &pptbm;
+ConfigStore *pconfig = nullptr;
+int preader = 0;
+uint64_t pversion = 0;
+ShmQueue *pqueue;
+size_t pbatch;
+bool pbusyPoll;
+const atomic<bool> *pstop = nullptr;
+Stats pstats;
+vector<unsigned char> ptouched;
+vector<uint32_t> ptouchedList;
+vector<unsigned int> pports;
+vector<header_type> psubtrees;
+
+/// Writes the result of a request
+void
+handle(uint32_t producer, uint64_t id, const unsigned char *header)
+{
+  if(producer >= ptouched.size())
+    return;
+
+  unsigned char *slot;
+
+  // Cannot happen to a producer keeping its limit, waits for it otherwise:
+  // the results of the batch so far are published for it to take them, the
+  // request is given up on stop
+  while(!(slot = pqueue->resultSlot(producer)))
+  {
+    pqueue->publishResults(producer);
+
+    if(pstop->load(memory_order_relaxed))
+      return;
+
+    this_thread::yield();
+  }
+
+  if(!ptouched[producer])
+  {
+    ptouched[producer] = 1;
+    ptouchedList.push_back(producer);
+  }
+
+  uint32_t status = ShmResult::OK, outputs = 0;
+
+  pports.clear();
+  psubtrees.clear();
+
+  try
+  {
+    P::process(pptbm.context(), P::headerFromBytes(header), pports,
+               psubtrees);
+
+    outputs = pports.size();
+
+    if(outputs > pqueue->params().maxOutputs)
+    {
+      outputs = pqueue->params().maxOutputs;
+      status = ShmResult::TRUNCATED;
+      ++pstats.truncated;
+    }
+  }
+  catch(exception &)
+  {
+    status = ShmResult::INVALID;
+    ++pstats.invalid;
+  }
+
+  memcpy(slot, &id, 8);
+  memcpy(slot + 8, &status, 4);
+  memcpy(slot + 12, &outputs, 4);
+
+  unsigned char *out = slot + 16;
+
+  for(uint32_t i=0; i<outputs; i++, out += 4 + P::HEADER_BYTES)
+  {
+    uint32_t port = pports[i];
+
+    memcpy(out, &port, 4);
+    P::headerToBytes(psubtrees[i], out + 4);
+  }
+}
+
+};
+
+#endif // PTBM_SHM
+
+}
+
+#endif // PTBM_SHM_H
@@ -0,0 +1,652 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_SIM_H
+#define PTBM_SIM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <queue>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <stdexcept>
+
+#include "ptbm.h"
+#include "ptbm-spsc.h"
+#include "ptbm-topology.h"
+
+using namespace std;
+
+namespace ptbm
+{
+
+// Discrete event simulation of a header travelling through a topology.
+//
+// Every router processes one packet at a time (serviceTime ticks each) from
+// its own queue, then sends each output subtree to the neighbor on the output
+// port. A router receiving an empty header is a destination of the packet.
+//
+// Routers of the same virtual ports share a context (Ptbm::Context), which
+// the shards only read.
+//
+// The routers are split into shards (one per thread). A shard owns the
+// scratch of its outputs, the queues and the events of its routers and sends
+// the packets for the routers of other shards through SPSC mailboxes. The shards advance in time
+// windows as long as the shortest link delay: a packet sent in a window
+// arrives in a later one, so every shard can process its window without
+// waiting for the others. Events are ordered by time and by the sender's
+// sequence number, so the result is the same with any number of threads.
+template<class P>
+class Simulator
+{
+
+public:
+
+typedef typename P::header_type header_type;
+
+/// A packet reaching one of its destinations
+struct Delivery
+{
+  uint64_t time;
+  int router;
+  long long packet;       // Index of the injected packet
+  uint64_t latency;       // Ticks since the injection
+  int hops;               // Links traversed
+
+  bool operator<(const Delivery &other) const
+  {
+    return tie(time, router, packet, hops) <
+           tie(other.time, other.router, other.packet, other.hops);
+  }
+};
+
+struct Stats
+{
+  long long injected = 0;
+  long long processed = 0;      // Headers processed by the routers
+  long long delivered = 0;
+  long long dropped = 0;        // Sent on a port without a neighbor
+  long long queueDrops = 0;     // Arrived at a full queue
+  long long errors = 0;         // Invalid headers
+  size_t maxQueue = 0;
+  uint64_t latencySum = 0;
+  uint64_t latencyMin = UINT64_MAX;
+  uint64_t latencyMax = 0;
+  long long hopsSum = 0;
+  uint64_t endTime = 0;
+  long long windows = 0;
+  double seconds = 0;
+  vector<double> busySeconds;   // Time each shard spent processing events
+
+  void
+  add(const Stats &other)
+  {
+    injected += other.injected;
+    processed += other.processed;
+    delivered += other.delivered;
+    dropped += other.dropped;
+    queueDrops += other.queueDrops;
+    errors += other.errors;
+    maxQueue = max(maxQueue, other.maxQueue);
+    latencySum += other.latencySum;
+    latencyMin = min(latencyMin, other.latencyMin);
+    latencyMax = max(latencyMax, other.latencyMax);
+    hopsSum += other.hopsSum;
+    endTime = max(endTime, other.endTime);
+  }
+
+  void
+  print(ostream &out) const
+  {
+    out << "injected: " << injected << endl
+        << "processed: " << processed << endl
+        << "delivered: " << delivered << endl
+        << "dropped: " << dropped << endl
+        << "queue drops: " << queueDrops << endl
+        << "errors: " << errors << endl
+        << "max queue: " << maxQueue << endl
+        << "latency min/avg/max: "
+        << (delivered ? latencyMin : 0) << "/"
+        << (delivered ? (double)latencySum / delivered : 0) << "/"
+        << latencyMax << " ticks" << endl
+        << "hops avg: " << (delivered ? (double)hopsSum / delivered : 0)
+        << endl
+        << "simulated time: " << endTime << " ticks" << endl
+        << "time windows: " << windows << endl
+        << "threads: " << busySeconds.size() << endl
+        << "wall time: " << seconds << " s" << endl
+        << "processed/s: " << (seconds > 0 ? processed / seconds : 0) << endl;
+
+    for(size_t s=0; s<busySeconds.size(); s++)
+      out << "thread " << s << " utilization: "
+          << (seconds > 0 ? busySeconds[s] / seconds * 100 : 0) << "%" << endl;
+  }
+};
+
+/// serviceTime: ticks to process a header, queueLimit: 0 for no limit
+Simulator(
+    const Topology &topology,
+    unsigned int serviceTime = 1,
+    size_t queueLimit = 0,
+    bool compact = false,
+    int threads = 1)
+  : ptopology(topology),
+    pserviceTime(serviceTime),
+    pqueueLimit(queueLimit)
+{
+  int routers = topology.routerCount();
+
+  threads = max(1, min(threads, max(routers, 1)));
+
+  // Conservative lookahead: no packet arrives sooner than the shortest delay
+  plookahead = UINT64_MAX;
+  for(int r=0; r<routers; r++)
+    for(const Topology::Link &link : topology.links(r))
+      plookahead = min(plookahead, (uint64_t)link.delay);
+  if(plookahead == UINT64_MAX)
+    plookahead = 1;
+
+  map<vector<unsigned int>, int> contexts;
+
+  pcontextOf.resize(routers);
+
+  for(int r=0; r<routers; r++)
+  {
+    vector<unsigned int> vports = topology.virtualPorts(r);
+    auto context = contexts.find(vports);
+
+    if(context == contexts.end())
+    {
+      context = contexts.insert(make_pair(vports, (int)pcontexts.size())).first;
+      pcontexts.push_back(typename P::Context(vports, compact));
+    }
+
+    pcontextOf[r] = context->second;
+  }
+
+  for(int s=0; s<threads; s++)
+  {
+    pshards.emplace_back(new Shard);
+    Shard &shard = *pshards.back();
+
+    shard.first = (long long)routers * s / threads;
+    shard.last = (long long)routers * (s+1) / threads;
+    shard.routers.resize(shard.last - shard.first);
+  }
+
+  for(int i=0; i<threads * threads; i++)
+    pmailboxes.emplace_back(new SpscRing<Message>(MAILBOX_SIZE));
+
+  plocalMin.resize(threads);
+}
+
+/// Injects a header at a router (index) at a given time
+void
+inject(uint64_t time, int router, const header_type &header)
+{
+  Shard &shard = *pshards[shardOf(router)];
+  int slot = shard.allocPacket();
+
+  shard.packets[slot].header = header;
+  shard.packets[slot].id = pinjected++;
+  shard.packets[slot].injectedAt = time;
+  shard.packets[slot].hops = 0;
+
+  shard.events.push({time, ARRIVAL, (unsigned int)ptopology.routerCount(),
+                     pinjectSeq++, router, slot});
+  ++shard.stats.injected;
+}
+
+/// Runs the simulation until every packet is delivered or dropped, the
+/// deliveries of each time window are reported in order
+void
+run(function<void(const Delivery &)> onDelivery = nullptr)
+{
+  auto start = chrono::steady_clock::now();
+  int threads = pshards.size();
+  vector<thread> workers;
+
+  ponDelivery = onDelivery;
+  pwindowEnd = 0;
+  pwindows = 0;
+
+  for(int s=1; s<threads; s++)
+    workers.emplace_back(&Simulator::runShard, this, s);
+
+  runShard(0);
+
+  for(thread &worker : workers)
+    worker.join();
+
+  pseconds += chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+}
+
+/// Gets the statistics of all shards
+Stats
+stats() const
+{
+  Stats total;
+
+  for(const unique_ptr<Shard> &shard : pshards)
+  {
+    total.add(shard->stats);
+    total.busySeconds.push_back(shard->busySeconds);
+  }
+
+  total.windows = pwindows;
+  total.seconds = pseconds;
+  return total;
+}
+
+private:
+
+enum { COMPLETION = 0, ARRIVAL = 1 };
+
+static const size_t MAILBOX_SIZE = 1024;
+
+struct Packet
+{
+  header_type header;
+  long long id;
+  uint64_t injectedAt;
+  int hops;
+  int next;               // Next packet in the queue or in the free list
+};
+
+// Ordered by time, then by a key not depending on the order of insertion:
+// completions by router, arrivals by sender and its sequence number
+struct Event
+{
+  uint64_t time;
+  int kind;
+  unsigned int sender;
+  uint64_t seq;
+  int router;
+  int slot;
+
+  bool operator>(const Event &other) const
+  {
+    return tie(time, kind, sender, seq) >
+           tie(other.time, other.kind, other.sender, other.seq);
+  }
+};
+
+// A packet sent to a router of another shard
+struct Message
+{
+  uint64_t time;
+  unsigned int sender;
+  uint64_t seq;
+  int router;
+  long long id;
+  uint64_t injectedAt;
+  int hops;
+  header_type header;
+};
+
+struct RouterState
+{
+  int head = -1;
+  int tail = -1;
+  size_t length = 0;
+  bool busy = false;
+  uint64_t seq = 0;       // Packets sent
+};
+
+struct Shard
+{
+  int first, last;        // Routers [first, last)
+  vector<RouterState> routers;
+  vector<Packet> packets;
+  int free = -1;
+  priority_queue<Event, vector<Event>, greater<Event>> events;
+  vector<Delivery> deliveries;
+  Stats stats;
+  double busySeconds = 0;
+
+  typename P::Scratch scratch;
+
+  int
+  allocPacket()
+  {
+    if(free < 0)
+    {
+      packets.push_back(Packet());
+      return packets.size() - 1;
+    }
+
+    int slot = free;
+    free = packets[slot].next;
+    return slot;
+  }
+
+  void
+  freePacket(int slot)
+  {
+    packets[slot].next = free;
+    free = slot;
+  }
+};
+
+const Topology &ptopology;
+vector<typename P::Context> pcontexts;
+vector<int> pcontextOf;         // Index of the context of a router
+unsigned int pserviceTime;
+size_t pqueueLimit;
+uint64_t plookahead;
+vector<unique_ptr<Shard>> pshards;
+vector<unique_ptr<SpscRing<Message>>> pmailboxes;   // [from * threads + to]
+long long pinjected = 0;
+uint64_t pinjectSeq = 0;
+function<void(const Delivery &)> ponDelivery;
+double pseconds = 0;
+
+// Window synchronization
+uint64_t pwindowEnd;
+long long pwindows;
+vector<uint64_t> plocalMin;
+atomic<int> parrived{0};
+atomic<int> pgeneration{0};
+
+int
+shardOf(int router) const
+{
+  long long routers = ptopology.routerCount();
+  int threads = pshards.size();
+  int s = router * (long long)threads / routers;
+
+  // Rounding of the shard bounds
+  while(router < pshards[s]->first)
+    --s;
+  while(router >= pshards[s]->last)
+    ++s;
+
+  return s;
+}
+
+SpscRing<Message> &
+mailbox(int from, int to)
+{
+  return *pmailboxes[from * pshards.size() + to];
+}
+
+/// Moves the packets sent by other shards into the events of a shard
+void
+drainMailboxes(int s)
+{
+  Shard &shard = *pshards[s];
+  Message msg;
+
+  for(size_t from=0; from<pshards.size(); from++)
+    while(mailbox(from, s).tryPop(msg))
+    {
+      int slot = shard.allocPacket();
+
+      shard.packets[slot].header = msg.header;
+      shard.packets[slot].id = msg.id;
+      shard.packets[slot].injectedAt = msg.injectedAt;
+      shard.packets[slot].hops = msg.hops;
+
+      shard.events.push({msg.time, ARRIVAL, msg.sender, msg.seq,
+                         msg.router, slot});
+    }
+}
+
+/// Waits for every shard, draining the mailboxes meanwhile
+void
+barrier(int s)
+{
+  int generation = pgeneration.load();
+
+  if(parrived.fetch_add(1) + 1 == (int)pshards.size())
+  {
+    parrived.store(0);
+    pgeneration.fetch_add(1);
+    return;
+  }
+
+  while(pgeneration.load() == generation)
+  {
+    drainMailboxes(s);
+    this_thread::yield();
+  }
+}
+
+void
+runShard(int s)
+{
+  Shard &shard = *pshards[s];
+
+  uint64_t next = shard.events.empty() ? UINT64_MAX : shard.events.top().time;
+  plocalMin[s] = next;
+  barrier(s);
+
+  for(;;)
+  {
+    uint64_t windowStart = *min_element(plocalMin.begin(), plocalMin.end());
+
+    if(windowStart == UINT64_MAX)
+      break;
+
+    uint64_t windowEnd = windowStart + plookahead;
+    auto start = chrono::steady_clock::now();
+
+    while(!shard.events.empty() && shard.events.top().time < windowEnd)
+    {
+      Event ev = shard.events.top();
+      shard.events.pop();
+
+      shard.stats.endTime = ev.time;
+
+      if(ev.kind == ARRIVAL)
+        arrive(s, ev.time, ev.router, ev.slot);
+      else
+        complete(s, ev.time, ev.router, ev.slot);
+    }
+
+    shard.busySeconds += chrono::duration<double>(
+          chrono::steady_clock::now() - start).count();
+
+    barrier(s);
+    drainMailboxes(s);
+
+    if(!s)
+    {
+      ++pwindows;
+      reportDeliveries();
+    }
+
+    plocalMin[s] = shard.events.empty() ? UINT64_MAX : shard.events.top().time;
+    barrier(s);
+  }
+}
+
+/// Reports the deliveries of the last window of all shards in order
+void
+reportDeliveries()
+{
+  if(!ponDelivery)
+    return;
+
+  vector<Delivery> window;
+
+  for(unique_ptr<Shard> &shard : pshards)
+  {
+    window.insert(window.end(),
+                  shard->deliveries.begin(), shard->deliveries.end());
+    shard->deliveries.clear();
+  }
+
+  sort(window.begin(), window.end());
+
+  for(const Delivery &delivery : window)
+    ponDelivery(delivery);
+}
+
+/// A packet arrives at the queue of a router
+void
+arrive(int s, uint64_t time, int router, int slot)
+{
+  Shard &shard = *pshards[s];
+  RouterState &rs = shard.routers[router - shard.first];
+
+  if(pqueueLimit && rs.length >= pqueueLimit)
+  {
+    ++shard.stats.queueDrops;
+    shard.freePacket(slot);
+    return;
+  }
+
+  shard.packets[slot].next = -1;
+  if(rs.tail < 0)
+    rs.head = slot;
+  else
+    shard.packets[rs.tail].next = slot;
+  rs.tail = slot;
+
+  shard.stats.maxQueue = max(shard.stats.maxQueue, ++rs.length);
+
+  if(!rs.busy)
+    serveNext(s, time, router);
+}
+
+/// The router starts processing the first packet of its queue
+void
+serveNext(int s, uint64_t time, int router)
+{
+  Shard &shard = *pshards[s];
+  RouterState &rs = shard.routers[router - shard.first];
+
+  if(rs.head < 0)
+  {
+    rs.busy = false;
+    return;
+  }
+
+  int slot = rs.head;
+  rs.head = shard.packets[slot].next;
+  if(rs.head < 0)
+    rs.tail = -1;
+  --rs.length;
+  rs.busy = true;
+
+  shard.events.push({time + pserviceTime, COMPLETION, (unsigned int)router, 0,
+                     router, slot});
+}
+
+/// The router has processed a packet: deliver it or send the outputs
+void
+complete(int s, uint64_t time, int router, int slot)
+{
+  Shard &shard = *pshards[s];
+  RouterState &rs = shard.routers[router - shard.first];
+  Packet &packet = shard.packets[slot];
+
+  ++shard.stats.processed;
+
+  if(packet.header.none())
+  {
+    Delivery delivery = {time, router, packet.id,
+                         time - packet.injectedAt, packet.hops};
+    Stats &stats = shard.stats;
+
+    ++stats.delivered;
+    stats.latencySum += delivery.latency;
+    stats.latencyMin = min(stats.latencyMin, delivery.latency);
+    stats.latencyMax = max(stats.latencyMax, delivery.latency);
+    stats.hopsSum += delivery.hops;
+
+    if(ponDelivery)
+      shard.deliveries.push_back(delivery);
+  }
+  else
+  {
+    try
+    {
+      P::process(pcontexts[pcontextOf[router]], packet.header, shard.scratch);
+    }
+    catch(const runtime_error &)
+    {
+      ++shard.stats.errors;
+      shard.scratch.ports.clear();
+    }
+
+    for(size_t n=0; n<shard.scratch.ports.size(); n++)
+    {
+      unsigned int delay;
+      int neighbor = ptopology.neighbor(router, shard.scratch.ports[n], delay);
+
+      if(neighbor < 0)
+      {
+        ++shard.stats.dropped;
+        continue;
+      }
+
+      send(s, time + delay, router, rs.seq++, neighbor, slot,
+           shard.scratch.subtrees[n]);
+    }
+  }
+
+  shard.freePacket(slot);
+  serveNext(s, time, router);
+}
+
+/// Sends a copy of a packet with a new header to a router of any shard
+void
+send(
+    int s,
+    uint64_t time,
+    int sender,
+    uint64_t seq,
+    int router,
+    int slot,
+    const header_type &header)
+{
+  Shard &shard = *pshards[s];
+  int to = router >= shard.first && router < shard.last ? s : shardOf(router);
+
+  if(to == s)
+  {
+    int out = shard.allocPacket();
+    Packet &from = shard.packets[slot];   // allocPacket may move the packets
+
+    shard.packets[out].header = header;
+    shard.packets[out].id = from.id;
+    shard.packets[out].injectedAt = from.injectedAt;
+    shard.packets[out].hops = from.hops + 1;
+
+    shard.events.push({time, ARRIVAL, (unsigned int)sender, seq, router, out});
+    return;
+  }
+
+  const Packet &from = shard.packets[slot];
+  Message msg = {time, (unsigned int)sender, seq, router,
+                 from.id, from.injectedAt, from.hops + 1, header};
+
+  // A full mailbox is emptied by its shard while it waits for us
+  while(!mailbox(s, to).tryPush(msg))
+  {
+    drainMailboxes(s);
+    this_thread::yield();
+  }
+}
+
+};
+
+}
+
+#endif // PTBM_SIM_H
@@ -0,0 +1,111 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_SPSC_H
+#define PTBM_SPSC_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <stdexcept>
+
+using namespace std;
+
+namespace ptbm
+{
+
+// Bounded lock-free queue of one producer and one consumer thread
+template<class T>
+class SpscRing
+{
+
+public:
+
+/// capacity is rounded up to a power of two
+explicit SpscRing(size_t capacity)
+{
+  size_t size = 1;
+
+  while(size < capacity)
+    size *= 2;
+
+  pbuffer.resize(size);
+  pmask = size - 1;
+}
+
+SpscRing(const SpscRing &) = delete;
+SpscRing &operator=(const SpscRing &) = delete;
+
+/// Appends an item (producer), returns false if the ring is full
+bool
+tryPush(const T &item)
+{
+  size_t tail = ptail.load(memory_order_relaxed);
+
+  if(tail - phead.load(memory_order_acquire) > pmask)
+    return false;
+
+  pbuffer[tail & pmask] = item;
+  ptail.store(tail + 1, memory_order_release);
+  return true;
+}
+
+/// Removes the first item (consumer), returns false if the ring is empty
+bool
+tryPop(T &item)
+{
+  size_t head = phead.load(memory_order_relaxed);
+
+  if(head == ptail.load(memory_order_acquire))
+    return false;
+
+  item = pbuffer[head & pmask];
+  phead.store(head + 1, memory_order_release);
+  return true;
+}
+
+/// Removes at most max items into out (consumer), returns the number removed
+size_t
+popBatch(T *out, size_t max)
+{
+  size_t head = phead.load(memory_order_relaxed);
+  size_t count = ptail.load(memory_order_acquire) - head;
+
+  if(count > max)
+    count = max;
+
+  for(size_t i=0; i<count; i++)
+    out[i] = pbuffer[(head + i) & pmask];
+
+  phead.store(head + count, memory_order_release);
+  return count;
+}
+
+bool
+empty() const
+{
+  return phead.load(memory_order_acquire) == ptail.load(memory_order_acquire);
+}
+
+private:
+vector<T> pbuffer;
+size_t pmask;
+
+// The producer and the consumer side on separate cache lines
+char ppad1[64];
+atomic<size_t> phead{0};
+char ppad2[64];
+atomic<size_t> ptail{0};
+char ppad3[64];
+
+};
+
+}
+
+#endif // PTBM_SPSC_H
@@ -0,0 +1,1043 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_TOPOLOGY_H
+#define PTBM_TOPOLOGY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PTBM_MMAP
+#endif
+
+using namespace std;
+
+namespace ptbm
+{
+
+// The routers of a network, the neighbor on each port and the virtual ports.
+//
+// Text format (one entry per line, # starts a comment):
+//
+//   router ID [virtual PORT1,PORT2,..]   Declares a router (and virtual ports)
+//   link ID PORT NEIGHBOR [DELAY]        Packets sent by ID on PORT reach
+//                                        NEIGHBOR after DELAY ticks (default 1)
+//
+// Routers are referenced by their index (0..routerCount()-1) in the API,
+// IDs are only used in files and in the output. Indexes are given in the
+// order the IDs first appear in the text.
+//
+// The links are stored in compressed sparse rows (the links of a router are
+// a slice of one array, ordered by port), the virtual ports below 64 in a
+// bitmap per router. The text is parsed and the rows are built by several
+// threads. save() writes the arrays to a binary file, load() maps such a
+// file into memory (copy on write) without building anything.
+class Topology
+{
+
+public:
+
+/// A port of a router connected to a neighbor
+struct Link
+{
+  unsigned int port;
+  int neighbor;
+  unsigned int delay;
+
+  bool operator<(const Link &other) const
+  {
+    return port < other.port;
+  }
+};
+
+/// The links of a router (valid until the topology is changed)
+class Links
+{
+public:
+  Links(const Link *begin, const Link *end)
+    : pbegin(begin), pend(end)
+  {
+  }
+
+  const Link *begin() const { return pbegin; }
+  const Link *end() const { return pend; }
+  size_t size() const { return pend - pbegin; }
+  bool empty() const { return pbegin == pend; }
+  const Link &operator[](size_t i) const { return pbegin[i]; }
+
+private:
+  const Link *pbegin;
+  const Link *pend;
+};
+
+Topology()
+{
+  poffsets.resize(1);
+  pvportOffsets.resize(1);
+}
+
+Topology(const Topology &) = delete;
+Topology &operator=(const Topology &) = delete;
+
+~Topology()
+{
+  unmap();
+}
+
+/// Loads the topology from a file: binary (written by save()) or text,
+/// threads: number of threads building from text (0: all cores)
+void
+load(string fileName, int threads = 0)
+{
+  ifstream in(fileName, ios::binary);
+
+  if(!in)
+    throw runtime_error("Cannot open topology: " + fileName);
+
+  char head[MAGIC_SIZE] = {};
+  in.read(head, MAGIC_SIZE);
+
+  // Loaded aside, the topology is replaced only if the file is valid (the
+  // old arrays and mapping go with loaded)
+  Topology loaded;
+
+  if(in && !memcmp(head, magic(), MAGIC_SIZE))
+  {
+    in.close();
+    loaded.loadBinary(fileName);
+    swap(loaded);
+    return;
+  }
+
+  in.clear();
+  in.seekg(0, ios::end);
+  string text(size_t(in.tellg()), '\0');
+  in.seekg(0);
+  in.read(&text[0], text.size());
+
+  if(threads <= 0)
+    threads = max(1u, thread::hardware_concurrency());
+
+  loaded.loadText(text, threads);
+  swap(loaded);
+}
+
+/// Writes the topology to a binary file (native byte order)
+void
+save(string fileName) const
+{
+  ofstream out(fileName, ios::binary);
+
+  if(!out)
+    throw runtime_error("Cannot write topology: " + fileName);
+
+  // Without the unused room of the rows and of the virtual port slices
+  vector<uint64_t> offsets(routerCount() + 1, 0);
+  vector<Link> links;
+  vector<uint64_t> vportOffsets(routerCount() + 1, 0);
+  vector<uint32_t> vports;
+
+  links.reserve(linkCount());
+  for(int r=0; r<routerCount(); r++)
+  {
+    Links row = this->links(r);
+    links.insert(links.end(), row.begin(), row.end());
+    offsets[r+1] = links.size();
+
+    const uint32_t *begin = pvportList.data + pvportOffsets[r];
+    vports.insert(vports.end(), begin, begin + pvportLengths[r]);
+    vportOffsets[r+1] = vports.size();
+  }
+
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, magic(), MAGIC_SIZE);
+  header.version = VERSION;
+  header.linkSize = sizeof(Link);
+  header.routers = routerCount();
+  header.links = links.size();
+  header.vports = vports.size();
+
+  out.write((const char *)&header, sizeof(header));
+  writeArray(out, pids.data, pids.size);
+  writeArray(out, porder.data, porder.size);
+  writeArray(out, offsets.data(), offsets.size());
+  writeArray(out, plengths.data, plengths.size);
+  writeArray(out, links.data(), links.size());
+  writeArray(out, pvportBits.data, pvportBits.size);
+  writeArray(out, vportOffsets.data(), vportOffsets.size());
+  writeArray(out, vports.data(), vports.size());
+
+  if(!out)
+    throw runtime_error("Cannot write topology: " + fileName);
+}
+
+/// Adds a router (if it does not exist yet) and returns its index
+int
+addRouter(unsigned int id)
+{
+  size_t pos = orderPos(id);
+
+  if(pos < porder.size && pids[porder[pos]] == id)
+    return porder[pos];
+
+  int router = routerCount();
+
+  pids.push_back(id);
+  porder.insert(pos, router);
+  poffsets.push_back(poffsets[router]);
+  plengths.push_back(0);
+  pvportBits.push_back(0);
+  pvportOffsets.push_back(pvportOffsets[router]);
+  pvportLengths.push_back(0);
+
+  return router;
+}
+
+/// Connects a port of a router to a neighbor
+void
+addLink(int router, unsigned int port, int neighbor, unsigned int delay)
+{
+  if(!delay)
+    throw runtime_error("Link delay must be at least 1");
+
+  Link link = {port, neighbor, delay};
+  Link *begin = plinks.data + poffsets[router];
+  Link *end = begin + plengths[router];
+  Link *it = lower_bound(begin, end, link);
+
+  if(it != end && it->port == port)
+    throw runtime_error("Port " + to_string(port) + " of router "
+                        + to_string(pids[router]) + " is already connected");
+
+  // The row is full: the rows are moved, this one gets more room
+  if(poffsets[router] + plengths[router] == poffsets[router+1])
+  {
+    size_t pos = it - begin;
+
+    growRow(router);
+    begin = plinks.data + poffsets[router];
+    it = begin + pos;
+    end = begin + plengths[router];
+  }
+
+  copy_backward(it, end, end + 1);
+  *it = link;
+  ++plengths[router];
+}
+
+/// Disconnects a port of a router, returns the removed link
+Link
+removeLink(int router, unsigned int port)
+{
+  Link *begin = plinks.data + poffsets[router];
+  Link *end = begin + plengths[router];
+  Link key = {port, 0, 0};
+  Link *it = lower_bound(begin, end, key);
+
+  if(it == end || it->port != port)
+    throw runtime_error("Port " + to_string(port) + " of router "
+                        + to_string(pids[router]) + " is not connected");
+
+  Link link = *it;
+  copy(it + 1, end, it);
+  --plengths[router];
+  return link;
+}
+
+/// Sets the virtual ports of a router
+void
+setVirtualPorts(int router, vector<unsigned int> vports)
+{
+  vector<uint32_t> overflow;
+
+  pvportBits[router] = 0;
+
+  for(unsigned int port : vports)
+    if(port < BITMAP_PORTS)
+      pvportBits[router] |= uint64_t(1) << port;
+    else
+      overflow.push_back(port);
+
+  sort(overflow.begin(), overflow.end());
+  overflow.erase(unique(overflow.begin(), overflow.end()), overflow.end());
+
+  // The slice of the router is overwritten if the ports fit in it, else they
+  // go to the end of the list (save() drops the unused room)
+  if(overflow.size() > pvportLengths[router])
+  {
+    pvportOffsets[router] = pvportList.size;
+
+    for(uint32_t port : overflow)
+      pvportList.push_back(port);
+
+    pvportOffsets[routerCount()] = pvportList.size;
+  }
+  else
+    copy(overflow.begin(), overflow.end(),
+         pvportList.data + pvportOffsets[router]);
+
+  pvportLengths[router] = overflow.size();
+}
+
+int
+routerCount() const
+{
+  return pids.size;
+}
+
+/// Number of connected ports
+size_t
+linkCount() const
+{
+  size_t count = 0;
+
+  for(size_t r=0; r<plengths.size; r++)
+    count += plengths[r];
+
+  return count;
+}
+
+/// Gets the index of a router from its ID
+int
+index(unsigned int id) const
+{
+  size_t pos = orderPos(id);
+
+  if(pos == porder.size || pids[porder[pos]] != id)
+    throw runtime_error("Unknown router: " + to_string(id));
+
+  return porder[pos];
+}
+
+/// Gets the ID of a router from its index
+unsigned int
+id(int router) const
+{
+  return pids[router];
+}
+
+/// Gets the neighbor on a port of a router (-1 if the port is not connected)
+int
+neighbor(int router, unsigned int port, unsigned int &delay) const
+{
+  Links row = links(router);
+  Link key = {port, 0, 0};
+  const Link *it = lower_bound(row.begin(), row.end(), key);
+
+  if(it == row.end() || it->port != port)
+    return -1;
+
+  delay = it->delay;
+  return it->neighbor;
+}
+
+/// Gets the connected ports of a router (ordered by port number)
+Links
+links(int router) const
+{
+  const Link *begin = plinks.data + poffsets[router];
+  return Links(begin, begin + plengths[router]);
+}
+
+/// Is a port of a router a virtual port
+bool
+isVirtualPort(int router, unsigned int port) const
+{
+  if(port < BITMAP_PORTS)
+    return (pvportBits[router] >> port) & 1;
+
+  const uint32_t *begin = pvportList.data + pvportOffsets[router];
+
+  return binary_search(begin, begin + pvportLengths[router], port);
+}
+
+/// Gets the virtual ports of a router (ordered)
+vector<unsigned int>
+virtualPorts(int router) const
+{
+  vector<unsigned int> vports;
+
+  for(uint64_t bits = pvportBits[router], port = 0; bits; bits >>= 1, port++)
+    if(bits & 1)
+      vports.push_back(port);
+
+  const uint32_t *begin = pvportList.data + pvportOffsets[router];
+
+  vports.insert(vports.end(), begin, begin + pvportLengths[router]);
+  return vports;
+}
+
+/// Bytes of the arrays of the topology
+size_t
+memoryUsage() const
+{
+  return pids.bytes() + porder.bytes() + poffsets.bytes() + plengths.bytes() +
+         plinks.bytes() + pvportBits.bytes() + pvportOffsets.bytes() +
+         pvportLengths.bytes() + pvportList.bytes();
+}
+
+/// Is the topology mapped from a binary file
+bool
+mapped() const
+{
+  return pmap != nullptr;
+}
+
+private:
+
+static const size_t MAGIC_SIZE = 8;
+
+static const char *
+magic()
+{
+  return "PTBMCSR";
+}
+
+static const uint32_t VERSION = 1;
+static const unsigned int BITMAP_PORTS = 64;
+
+struct FileHeader
+{
+  char magic[MAGIC_SIZE];
+  uint32_t version;
+  uint32_t linkSize;
+  uint64_t routers;
+  uint64_t links;                 // Rows without unused room
+  uint64_t vports;                // Virtual ports out of the bitmaps
+};
+
+// An array in the mapped file or in memory (copied before it is resized)
+template<class T>
+struct Array
+{
+  T *data = nullptr;
+  size_t size = 0;
+  vector<T> owned;
+
+  T &operator[](size_t i) { return data[i]; }
+  const T &operator[](size_t i) const { return data[i]; }
+
+  void
+  own()
+  {
+    if(data != owned.data())
+    {
+      owned.assign(data, data + size);
+      data = owned.data();
+    }
+  }
+
+  void
+  assign(vector<T> &&values)
+  {
+    owned = move(values);
+    data = owned.data();
+    size = owned.size();
+  }
+
+  void
+  push_back(const T &value)
+  {
+    own();
+    owned.push_back(value);
+    data = owned.data();
+    ++size;
+  }
+
+  void
+  insert(size_t pos, const T &value)
+  {
+    own();
+    owned.insert(owned.begin() + pos, value);
+    data = owned.data();
+    ++size;
+  }
+
+  void
+  resize(size_t n)
+  {
+    own();
+    owned.resize(n);
+    data = owned.data();
+    size = n;
+  }
+
+  size_t
+  bytes() const
+  {
+    return size * sizeof(T);
+  }
+};
+
+Array<uint32_t> pids;             // ID of each router
+Array<uint32_t> porder;           // Routers ordered by ID
+Array<uint64_t> poffsets;         // First link of each router (and the end)
+Array<uint32_t> plengths;         // Connected ports of each router
+Array<Link> plinks;               // Rows may have unused room at the end
+Array<uint64_t> pvportBits;       // Virtual ports below 64
+Array<uint64_t> pvportOffsets;    // Slice of the other virtual ports of each
+Array<uint32_t> pvportLengths;    // router (and the end) and its length
+Array<uint32_t> pvportList;       // The other virtual ports, slices with room
+
+void *pmap = nullptr;
+size_t pmapSize = 0;
+
+// A link line of the text
+struct TextLink
+{
+  uint32_t id;                    // Router index after the IDs are indexed
+  uint32_t neighbor;
+  Link link;
+};
+
+// What a thread parsed from a chunk of the text
+struct Chunk
+{
+  vector<uint32_t> ids;           // In the order they first appear
+  vector<TextLink> links;
+  vector<pair<uint32_t, uint32_t>> vports;    // (ID, port)
+  size_t lines = 0;
+  size_t errorLine = 0;           // In the chunk from 1, 0 if no error
+  string error;
+};
+
+size_t
+orderPos(unsigned int id) const
+{
+  const uint32_t *it = lower_bound(porder.data, porder.data + porder.size, id,
+                                   [this](uint32_t router, unsigned int key)
+                                   { return pids[router] < key; });
+  return it - porder.data;
+}
+
+template<class T>
+static void
+writeArray(ofstream &out, const T *data, size_t size)
+{
+  static const char zeros[8] = {};
+
+  out.write((const char *)data, size * sizeof(T));
+  out.write(zeros, (8 - size * sizeof(T) % 8) % 8);
+}
+
+/// Points an array into the file (8 byte aligned)
+template<class T>
+static bool
+bindArray(Array<T> &array, size_t count, char *data, size_t size, size_t &pos)
+{
+  if(pos > size || count > (size - pos) / sizeof(T))
+    return false;
+
+  size_t bytes = count * sizeof(T);
+
+  array.owned.clear();
+  array.data = (T *)(data + pos);
+  array.size = count;
+  pos += (bytes + 7) / 8 * 8;
+  return true;
+}
+
+void
+unmap()
+{
+#ifdef PTBM_MMAP
+  if(pmap)
+    munmap(pmap, pmapSize);
+#endif
+  pmap = nullptr;
+}
+
+void
+loadBinary(string fileName)
+{
+  char *data;
+  size_t size;
+
+  unmap();
+
+#ifdef PTBM_MMAP
+  int fd = open(fileName.c_str(), O_RDONLY);
+  struct stat st;
+
+  if(fd < 0 || fstat(fd, &st) < 0)
+  {
+    if(fd >= 0)
+      close(fd);
+    throw runtime_error("Cannot open topology: " + fileName);
+  }
+
+  size = st.st_size;
+  void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(map == MAP_FAILED)
+    throw runtime_error("Cannot map topology: " + fileName);
+
+  pmap = map;
+  pmapSize = size;
+  data = (char *)map;
+#else
+  ifstream in(fileName, ios::binary);
+  vector<char> buffer((istreambuf_iterator<char>(in)),
+                      istreambuf_iterator<char>());
+  size = buffer.size();
+  data = buffer.data();
+#endif
+
+  FileHeader header;
+
+  if(size < sizeof(header))
+    throw runtime_error("Invalid topology file: " + fileName);
+
+  memcpy(&header, data, sizeof(header));
+
+  if(header.version != VERSION || header.linkSize != sizeof(Link))
+    throw runtime_error("Unsupported topology file: " + fileName);
+
+  size_t pos = sizeof(header);
+  size_t n = header.routers;
+
+  if(!bindArray(pids, n, data, size, pos) ||
+     !bindArray(porder, n, data, size, pos) ||
+     !bindArray(poffsets, n + 1, data, size, pos) ||
+     !bindArray(plengths, n, data, size, pos) ||
+     !bindArray(plinks, header.links, data, size, pos) ||
+     !bindArray(pvportBits, n, data, size, pos) ||
+     !bindArray(pvportOffsets, n + 1, data, size, pos) ||
+     !bindArray(pvportList, header.vports, data, size, pos))
+    throw runtime_error("Truncated topology file: " + fileName);
+
+  checkBinary(header, fileName);
+
+  // The slices of the file have no room
+  vector<uint32_t> vportLengths(n);
+
+  for(size_t r=0; r<n; r++)
+    vportLengths[r] = pvportOffsets[r+1] - pvportOffsets[r];
+
+  pvportLengths.assign(move(vportLengths));
+
+  // Without a mapping the arrays are copied out of the buffer
+  if(!pmap)
+  {
+    pids.own(); porder.own(); poffsets.own(); plengths.own();
+    plinks.own(); pvportBits.own(); pvportOffsets.own(); pvportList.own();
+  }
+}
+
+/// Checks that the arrays bound from a binary file index only into each
+/// other (rows, links, virtual ports and the order of the IDs)
+void
+checkBinary(const FileHeader &header, const string &fileName) const
+{
+  size_t n = header.routers;
+  bool valid = n <= INT_MAX &&
+               poffsets[0] == 0 && poffsets[n] == header.links &&
+               pvportOffsets[0] == 0 && pvportOffsets[n] == header.vports;
+
+  for(size_t r=0; valid && r<n; r++)
+  {
+    valid = porder[r] < n &&
+            (!r || pids[porder[r-1]] < pids[porder[r]]) &&
+            poffsets[r] <= poffsets[r+1] &&
+            plengths[r] <= poffsets[r+1] - poffsets[r] &&
+            pvportOffsets[r] <= pvportOffsets[r+1];
+
+    for(uint64_t l=poffsets[r]; valid && l<poffsets[r]+plengths[r]; l++)
+      valid = plinks[l].neighbor >= 0 && (size_t)plinks[l].neighbor < n &&
+              plinks[l].delay >= 1 &&
+              (l == poffsets[r] || plinks[l-1].port < plinks[l].port);
+  }
+
+  if(!valid)
+    throw runtime_error("Invalid topology file: " + fileName);
+}
+
+/// Swaps the arrays and the mappings of two topologies
+void
+swap(Topology &other)
+{
+  std::swap(pids, other.pids);
+  std::swap(porder, other.porder);
+  std::swap(poffsets, other.poffsets);
+  std::swap(plengths, other.plengths);
+  std::swap(plinks, other.plinks);
+  std::swap(pvportBits, other.pvportBits);
+  std::swap(pvportOffsets, other.pvportOffsets);
+  std::swap(pvportLengths, other.pvportLengths);
+  std::swap(pvportList, other.pvportList);
+  std::swap(pmap, other.pmap);
+  std::swap(pmapSize, other.pmapSize);
+}
+
+/// Builds the arrays from the text by several threads
+void
+loadText(const string &text, int threads)
+{
+  unmap();
+
+  // Chunks end at line ends
+  vector<size_t> bounds(1, 0);
+
+  for(int t=1; t<threads; t++)
+  {
+    size_t pos = max(bounds.back(), text.size() * t / threads);
+    size_t eol = text.find('\n', pos);
+    bounds.push_back(eol == string::npos ? text.size() : eol + 1);
+  }
+  bounds.push_back(text.size());
+
+  vector<Chunk> chunks(threads);
+
+  parallel(threads, [&](int t)
+  {
+    parseChunk(text, bounds[t], bounds[t+1], chunks[t]);
+  });
+
+  size_t firstLine = 0;
+  for(Chunk &chunk : chunks)
+  {
+    if(chunk.errorLine)
+      throw runtime_error(chunk.error + " at line " +
+                          to_string(firstLine + chunk.errorLine));
+    firstLine += chunk.lines;
+  }
+
+  // Indexes in the order of the first appearance
+  unordered_map<uint32_t, int> indexes;
+  vector<uint32_t> ids;
+
+  for(Chunk &chunk : chunks)
+    for(uint32_t id : chunk.ids)
+      if(indexes.emplace(id, ids.size()).second)
+        ids.push_back(id);
+
+  int n = ids.size();
+  vector<atomic<uint32_t>> counts(n);
+
+  for(auto &count : counts)
+    count.store(0, memory_order_relaxed);
+
+  parallel(threads, [&](int t)
+  {
+    for(TextLink &link : chunks[t].links)
+    {
+      link.link.neighbor = indexes.find(link.neighbor)->second;
+      link.id = indexes.find(link.id)->second;
+      counts[link.id].fetch_add(1, memory_order_relaxed);
+    }
+  });
+
+  vector<uint64_t> offsets(n + 1, 0);
+  for(int r=0; r<n; r++)
+    offsets[r+1] = offsets[r] + counts[r].load(memory_order_relaxed);
+
+  // Rows are filled in any order and sorted by port
+  vector<Link> links(offsets[n]);
+  vector<atomic<uint64_t>> cursors(n);
+
+  for(int r=0; r<n; r++)
+    cursors[r].store(offsets[r], memory_order_relaxed);
+
+  parallel(threads, [&](int t)
+  {
+    for(const TextLink &link : chunks[t].links)
+      links[cursors[link.id].fetch_add(1, memory_order_relaxed)] = link.link;
+  });
+
+  vector<string> errors(threads);
+
+  parallel(threads, [&](int t)
+  {
+    for(int r = (long long)n * t / threads; r < (long long)n * (t+1) / threads; r++)
+    {
+      sort(links.begin() + offsets[r], links.begin() + offsets[r+1]);
+
+      for(uint64_t i = offsets[r] + 1; i < offsets[r+1]; i++)
+        if(links[i].port == links[i-1].port && errors[t].empty())
+          errors[t] = "Port " + to_string(links[i].port) + " of router " +
+                      to_string(ids[r]) + " is already connected";
+    }
+  });
+
+  for(string &error : errors)
+    if(!error.empty())
+      throw runtime_error(error);
+
+  vector<uint64_t> vportBits(n, 0);
+  vector<vector<uint32_t>> overflow(n);
+
+  for(Chunk &chunk : chunks)
+    for(auto &vport : chunk.vports)
+    {
+      int router = indexes[vport.first];
+
+      if(vport.second < BITMAP_PORTS)
+        vportBits[router] |= uint64_t(1) << vport.second;
+      else
+        overflow[router].push_back(vport.second);
+    }
+
+  vector<uint32_t> order(n), lengths(n);
+
+  for(int r=0; r<n; r++)
+  {
+    order[r] = r;
+    lengths[r] = offsets[r+1] - offsets[r];
+  }
+
+  sort(order.begin(), order.end(), [&ids](uint32_t a, uint32_t b)
+       { return ids[a] < ids[b]; });
+
+  pids.assign(move(ids));
+  porder.assign(move(order));
+  poffsets.assign(move(offsets));
+  plengths.assign(move(lengths));
+  plinks.assign(move(links));
+  pvportBits.assign(move(vportBits));
+  buildOverflow(overflow);
+}
+
+/// Parses the lines of a chunk of the text
+static void
+parseChunk(const string &text, size_t begin, size_t end, Chunk &chunk)
+{
+  unordered_map<uint32_t, bool> seen;
+  auto appear = [&](uint32_t id)
+  {
+    if(seen.emplace(id, true).second)
+      chunk.ids.push_back(id);
+  };
+  auto tooLarge = [&](unsigned long long number)
+  {
+    if(number <= UINT32_MAX)
+      return false;
+
+    chunk.error = "Number larger than " + to_string(UINT32_MAX);
+    chunk.errorLine = chunk.lines;
+    return true;
+  };
+
+  for(size_t pos = begin; pos < end && !chunk.errorLine;)
+  {
+    size_t eol = text.find('\n', pos);
+    if(eol == string::npos || eol > end)
+      eol = end;
+
+    const char *p = text.data() + pos;
+    const char *e = text.data() + eol;
+    const char *comment = (const char *)memchr(p, '#', e - p);
+
+    if(comment)
+      e = comment;
+
+    ++chunk.lines;
+    pos = eol + 1;
+
+    string kind, key;
+    unsigned long long id, port, neighbor, delay = 1;
+
+    if(!readWord(p, e, kind))
+      continue;
+
+    if(kind == "router")
+    {
+      if(!readNumber(p, e, id))
+      {
+        chunk.error = "Missing router ID";
+        chunk.errorLine = chunk.lines;
+        break;
+      }
+
+      if(tooLarge(id))
+        break;
+
+      appear(id);
+
+      if(readWord(p, e, key))
+      {
+        if(key != "virtual" || !readNumber(p, e, port))
+        {
+          chunk.error = "Invalid router";
+          chunk.errorLine = chunk.lines;
+          break;
+        }
+
+        if(tooLarge(port))
+          break;
+
+        chunk.vports.push_back(make_pair(uint32_t(id), uint32_t(port)));
+
+        while(p < e && *p == ',' && readNumber(++p, e, port))
+        {
+          if(tooLarge(port))
+            break;
+
+          chunk.vports.push_back(make_pair(uint32_t(id), uint32_t(port)));
+        }
+      }
+    }
+    else if(kind == "link")
+    {
+      if(!readNumber(p, e, id) || !readNumber(p, e, port) ||
+         !readNumber(p, e, neighbor))
+      {
+        chunk.error = "Invalid link";
+        chunk.errorLine = chunk.lines;
+        break;
+      }
+
+      readNumber(p, e, delay);
+
+      if(tooLarge(id) || tooLarge(port) || tooLarge(neighbor) ||
+         tooLarge(delay))
+        break;
+
+      if(!delay)
+      {
+        chunk.error = "Link delay must be at least 1";
+        chunk.errorLine = chunk.lines;
+        break;
+      }
+
+      appear(id);
+      appear(neighbor);
+      chunk.links.push_back({uint32_t(id), uint32_t(neighbor),
+                             {unsigned(port), 0, unsigned(delay)}});
+    }
+    else
+    {
+      chunk.error = "Unknown entry '" + kind + "'";
+      chunk.errorLine = chunk.lines;
+    }
+  }
+}
+
+static bool
+readWord(const char *&p, const char *end, string &word)
+{
+  while(p < end && isspace((unsigned char)*p))
+    ++p;
+
+  const char *begin = p;
+  while(p < end && !isspace((unsigned char)*p) && *p != ',')
+    ++p;
+
+  word.assign(begin, p);
+  return p > begin;
+}
+
+static bool
+readNumber(const char *&p, const char *end, unsigned long long &number)
+{
+  while(p < end && isspace((unsigned char)*p))
+    ++p;
+
+  if(p == end || !isdigit((unsigned char)*p))
+    return false;
+
+  // Stops growing above 32 bits, the caller rejects it
+  number = 0;
+  while(p < end && isdigit((unsigned char)*p))
+    number = min(number * 10 + (*p++ - '0'),
+                 (unsigned long long)UINT32_MAX + 1);
+
+  return true;
+}
+
+/// Runs body(0..threads-1) on that many threads
+template<class F>
+static void
+parallel(int threads, F body)
+{
+  vector<thread> workers;
+
+  for(int t=1; t<threads; t++)
+    workers.emplace_back(body, t);
+
+  body(0);
+
+  for(thread &worker : workers)
+    worker.join();
+}
+
+/// Rebuilds the list of the virtual ports out of the bitmaps
+void
+buildOverflow(vector<vector<uint32_t>> &overflow)
+{
+  vector<uint64_t> offsets(overflow.size() + 1, 0);
+  vector<uint32_t> list;
+
+  for(size_t r=0; r<overflow.size(); r++)
+  {
+    sort(overflow[r].begin(), overflow[r].end());
+    overflow[r].erase(unique(overflow[r].begin(), overflow[r].end()),
+                      overflow[r].end());
+    list.insert(list.end(), overflow[r].begin(), overflow[r].end());
+    offsets[r+1] = list.size();
+  }
+
+  vector<uint32_t> lengths(overflow.size());
+
+  for(size_t r=0; r<overflow.size(); r++)
+    lengths[r] = offsets[r+1] - offsets[r];
+
+  pvportOffsets.assign(move(offsets));
+  pvportLengths.assign(move(lengths));
+  pvportList.assign(move(list));
+}
+
+/// Moves every row to a new array, the row of a router with twice the room
+void
+growRow(int router)
+{
+  int n = routerCount();
+  vector<uint64_t> offsets(n + 1, 0);
+  vector<Link> links;
+
+  for(int r=0; r<n; r++)
+  {
+    uint64_t room = poffsets[r+1] - poffsets[r];
+
+    if(r == router)
+      room = room * 2 + 1;
+
+    links.insert(links.end(), plinks.data + poffsets[r],
+                 plinks.data + poffsets[r] + plengths[r]);
+    links.resize(offsets[r] + room);
+    offsets[r+1] = links.size();
+  }
+
+  poffsets.assign(move(offsets));
+  plinks.assign(move(links));
+}
+
+};
+
+}
+
+#endif // PTBM_TOPOLOGY_H
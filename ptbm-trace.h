@@ -0,0 +1,261 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_TRACE_H
+#define PTBM_TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PTBM_MMAP
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PTBM_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PTBM_PREFETCH(addr) ((void)(addr))
+#endif
+
+using namespace std;
+
+namespace ptbm
+{
+
+// A binary trace: the headers in binary form one after the other (see
+// Ptbm::headerToBytes), mapped into memory (read into a buffer without mmap).
+template<class P>
+class TraceFile
+{
+
+public:
+
+explicit TraceFile(const string &fileName)
+{
+  size_t size;
+
+#ifdef PTBM_MMAP
+  int fd = open(fileName.c_str(), O_RDONLY);
+  struct stat st;
+
+  if(fd < 0 || fstat(fd, &st) < 0)
+  {
+    if(fd >= 0)
+      close(fd);
+    throw runtime_error("Cannot open trace: " + fileName);
+  }
+
+  size = st.st_size;
+
+  if(size)
+  {
+    int flags = MAP_PRIVATE;
+
+#ifdef MAP_POPULATE
+    // A benchmark measures the misses of the caches, not page faults
+    flags |= MAP_POPULATE;
+#endif
+
+    void *map = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+
+    if(map == MAP_FAILED)
+    {
+      close(fd);
+      throw runtime_error("Cannot map trace: " + fileName);
+    }
+
+    pmap = map;
+    pmapSize = size;
+    pdata = (const unsigned char *)map;
+  }
+
+  close(fd);
+#else
+  ifstream in(fileName, ios::binary);
+
+  if(!in)
+    throw runtime_error("Cannot open trace: " + fileName);
+
+  pbuffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  size = pbuffer.size();
+  pdata = (const unsigned char *)pbuffer.data();
+#endif
+
+  if(size % P::HEADER_BYTES)
+    throw runtime_error("Invalid trace: " + fileName + " (not a multiple of " +
+                        to_string(P::HEADER_BYTES) + " bytes)");
+
+  pcount = size / P::HEADER_BYTES;
+}
+
+TraceFile(const TraceFile &) = delete;
+TraceFile &operator=(const TraceFile &) = delete;
+
+~TraceFile()
+{
+#ifdef PTBM_MMAP
+  if(pmap)
+    munmap(pmap, pmapSize);
+#endif
+}
+
+/// Headers of the trace
+size_t
+size() const
+{
+  return pcount;
+}
+
+/// A header in binary form
+const unsigned char *
+header(size_t index) const
+{
+  return pdata + index * P::HEADER_BYTES;
+}
+
+private:
+const unsigned char *pdata = nullptr;
+size_t pcount = 0;
+void *pmap = nullptr;
+size_t pmapSize = 0;
+vector<char> pbuffer;
+
+};
+
+// Processing of the headers of a trace interleaved to hide the latency of
+// memory.
+//
+// A header far in a trace larger than the caches is a miss, and the walk of
+// its brackets can not start before its bytes arrive. The processor keeps
+// width headers in flight, each a small state machine in a slot: a slot
+// prefetches the bytes of its next header and yields to the next slot, and
+// processes the header when the round comes back to it. The width - 1 headers
+// processed in the meantime cover the latency of the prefetch. Width 1 is the
+// plain loop (prefetch, then process at once).
+template<class P>
+class Interleaver
+{
+
+public:
+
+typedef typename P::Context Context;
+typedef typename P::Scratch Scratch;
+
+/// An interleaver of width headers in flight, the context must outlive it
+Interleaver(const Context &context, size_t width = 8)
+  : pcontext(context),
+    pslots(width)
+{
+  if(width < 1)
+    throw runtime_error("Interleave width must be at least 1");
+}
+
+size_t
+width() const
+{
+  return pslots.size();
+}
+
+/// Processes count headers of a trace, the index-th one is order[index] (or
+/// index if order is null), and calls sink(header, outputs, error) in the
+/// order of the headers (error: null or the message of an invalid header)
+template<class Sink>
+void
+run(const TraceFile<P> &trace,
+    const uint32_t *order,
+    size_t count,
+    Sink &&sink)
+{
+  size_t next = 0, active = 0;
+
+  for(Slot &slot : pslots)
+    slot.state = IDLE;
+
+  // Round robin over the slots, every visit is a step of a slot
+  for(size_t s=0; next < count || active; s = s + 1 < width() ? s + 1 : 0)
+  {
+    Slot &slot = pslots[s];
+
+    if(slot.state == PROCESS)
+    {
+      const char *error = nullptr;
+
+      try
+      {
+        P::process(pcontext, P::headerFromBytes(slot.bytes), pscratch);
+      }
+      catch(exception &e)
+      {
+        pscratch.ports.clear();
+        pscratch.subtrees.clear();
+        pmessage = e.what();
+        error = pmessage.c_str();
+      }
+
+      sink(slot.header, pscratch, error);
+      slot.state = IDLE;
+      --active;
+    }
+
+    if(slot.state == IDLE && next < count)
+    {
+      slot.header = order ? order[next] : next;
+      slot.bytes = trace.header(slot.header);
+      ++next;
+
+      // Every line of the header, the last one too if it straddles a line
+      const unsigned char *last = slot.bytes + P::HEADER_BYTES - 1;
+
+      for(const unsigned char *line=slot.bytes; line<last; line+=CACHE_LINE)
+        PTBM_PREFETCH(line);
+
+      PTBM_PREFETCH(last);
+
+      slot.state = PROCESS;
+      ++active;
+    }
+  }
+}
+
+private:
+
+static const int CACHE_LINE = 64;
+
+enum State
+{
+  IDLE,
+  PROCESS       // The bytes of the header are prefetched
+};
+
+struct Slot
+{
+  State state = IDLE;
+  size_t header = 0;
+  const unsigned char *bytes = nullptr;
+};
+
+const Context &pcontext;
+vector<Slot> pslots;
+Scratch pscratch;
+string pmessage;
+
+};
+
+}
+
+#endif // PTBM_TRACE_H
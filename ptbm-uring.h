@@ -0,0 +1,282 @@
+/**
+ * Parentheses Tree Based Multicast header processor
+ *
+ * Written by Andras Majdan
+ * License: GNU General Public License Version 3
+ *
+ * Report bugs to <majdan.andras@gmail.com>
+ */
+
+#ifndef PTBM_URING_H
+#define PTBM_URING_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Multishot receive and provided buffer rings (Linux 6.0)
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define PTBM_URING
+#endif
+#endif
+
+using namespace std;
+
+namespace ptbm
+{
+
+#ifdef PTBM_URING
+
+// A minimal io_uring on the system calls: a submission and a completion ring
+// and a provided buffer ring.
+//
+// Submission entries are published by submit(), which also waits for
+// completions. Completions are copied out one by one by pop(). Buffers given
+// back by provide() are published on the next submit().
+class Uring
+{
+
+public:
+
+/// Sets up a ring of entries submission and cqEntries completion entries,
+/// throws if io_uring is not available
+Uring(unsigned int entries, unsigned int cqEntries)
+{
+  io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = cqEntries;
+
+  pfd = syscall(__NR_io_uring_setup, entries, &params);
+
+  if(pfd < 0)
+    throw runtime_error(string("io_uring_setup failed: ") + strerror(errno));
+
+  try
+  {
+    mapRings(params);
+  }
+  catch(...)
+  {
+    release();
+    throw;
+  }
+}
+
+Uring(const Uring &) = delete;
+Uring &operator=(const Uring &) = delete;
+
+~Uring()
+{
+  release();
+}
+
+/// A cleared submission entry, null if the ring is full
+io_uring_sqe *
+sqe()
+{
+  if(ptail - __atomic_load_n(psqHead, __ATOMIC_ACQUIRE) >= psqEntries)
+    return nullptr;
+
+  io_uring_sqe *entry = &psqes[ptail++ & psqMask];
+
+  memset(entry, 0, sizeof(*entry));
+  return entry;
+}
+
+/// Submits the new entries and waits for wait completions, returns the
+/// number of entries submitted
+int
+submit(unsigned int wait = 0)
+{
+  __atomic_store_n(psqTail, ptail, __ATOMIC_RELEASE);
+  __atomic_store_n(pcqHead, phead, __ATOMIC_RELEASE);
+
+  if(pbufs)
+    __atomic_store_n(&pbufs->tail, pbufTail, __ATOMIC_RELEASE);
+
+  for(;;)
+  {
+    int n = syscall(__NR_io_uring_enter, pfd, ptail - psubmitted, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+    if(n >= 0)
+    {
+      psubmitted += n;
+      return n;
+    }
+
+    if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      throw runtime_error(string("io_uring_enter failed: ") + strerror(errno));
+
+    // Busy: the completions are to be consumed first
+    if(errno != EINTR)
+      return 0;
+  }
+}
+
+/// Copies and consumes the next completion, returns false if there is none
+bool
+pop(io_uring_cqe &cqe)
+{
+  if(phead == __atomic_load_n(pcqTail, __ATOMIC_ACQUIRE))
+    return false;
+
+  cqe = pcqes[phead++ & pcqMask];
+  return true;
+}
+
+/// Registers count buffers of size bytes from base as a provided buffer ring
+/// of a group (count is a power of 2), all of them are given to the kernel
+void
+provideBuffers(unsigned short group, unsigned char *base, unsigned int count,
+               unsigned int size)
+{
+  pbufsSize = count * sizeof(io_uring_buf);
+  pbufs = (io_uring_buf_ring *)mmap(nullptr, pbufsSize,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if(pbufs == MAP_FAILED)
+  {
+    pbufs = nullptr;
+    throw runtime_error("Cannot map the buffer ring");
+  }
+
+  io_uring_buf_reg reg;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)pbufs;
+  reg.ring_entries = count;
+  reg.bgid = group;
+
+  if(syscall(__NR_io_uring_register, pfd, IORING_REGISTER_PBUF_RING, &reg, 1)
+     < 0)
+    throw runtime_error(string("Cannot register the buffer ring: ") +
+                        strerror(errno));
+
+  pbase = base;
+  pbufSize = size;
+  pbufMask = count - 1;
+  pbufTail = 0;
+
+  for(unsigned int i=0; i<count; i++)
+    provide(i);
+
+  __atomic_store_n(&pbufs->tail, pbufTail, __ATOMIC_RELEASE);
+}
+
+/// Gives a buffer back to the kernel
+void
+provide(unsigned short id)
+{
+  // Not pbufs->bufs, its empty struct prefix has a size in C++
+  io_uring_buf &buf = ((io_uring_buf *)pbufs)[pbufTail++ & pbufMask];
+
+  buf.addr = (uint64_t)(pbase + (size_t)id * pbufSize);
+  buf.len = pbufSize;
+  buf.bid = id;
+}
+
+private:
+
+int pfd = -1;
+unsigned char *psq = nullptr;
+unsigned char *pcq = nullptr;
+io_uring_sqe *psqes = nullptr;
+size_t psqSize = 0, pcqSize = 0, psqesSize = 0;
+
+unsigned int *psqHead, *psqTail, psqMask, psqEntries;
+unsigned int *pcqHead, *pcqTail, pcqMask;
+io_uring_cqe *pcqes;
+unsigned int ptail, psubmitted, phead;
+
+io_uring_buf_ring *pbufs = nullptr;
+size_t pbufsSize = 0;
+unsigned char *pbase = nullptr;
+unsigned int pbufSize = 0;
+unsigned int pbufMask = 0;
+unsigned short pbufTail = 0;
+
+void
+mapRings(const io_uring_params &params)
+{
+  psqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  pcqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    psqSize = pcqSize = max(psqSize, pcqSize);
+
+  psq = map(psqSize, IORING_OFF_SQ_RING);
+  pcq = (params.features & IORING_FEAT_SINGLE_MMAP) ?
+        psq : map(pcqSize, IORING_OFF_CQ_RING);
+  psqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  psqes = (io_uring_sqe *)map(psqesSize, IORING_OFF_SQES);
+
+  psqHead = (unsigned int *)(psq + params.sq_off.head);
+  psqTail = (unsigned int *)(psq + params.sq_off.tail);
+  psqMask = *(unsigned int *)(psq + params.sq_off.ring_mask);
+  psqEntries = params.sq_entries;
+  pcqHead = (unsigned int *)(pcq + params.cq_off.head);
+  pcqTail = (unsigned int *)(pcq + params.cq_off.tail);
+  pcqMask = *(unsigned int *)(pcq + params.cq_off.ring_mask);
+  pcqes = (io_uring_cqe *)(pcq + params.cq_off.cqes);
+
+  // Entry i of the submission array is always the i-th entry
+  unsigned int *array = (unsigned int *)(psq + params.sq_off.array);
+
+  for(unsigned int i=0; i<psqEntries; i++)
+    array[i] = i;
+
+  ptail = *psqTail;
+  psubmitted = ptail;
+  phead = *pcqHead;
+}
+
+void
+release()
+{
+  if(pbufs)
+    munmap(pbufs, pbufsSize);
+
+  if(psqes)
+    munmap(psqes, psqesSize);
+
+  if(pcq && pcq != psq)
+    munmap(pcq, pcqSize);
+
+  if(psq)
+    munmap(psq, psqSize);
+
+  close(pfd);
+}
+
+unsigned char *
+map(size_t size, off_t offset)
+{
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, pfd, offset);
+
+  if(addr == MAP_FAILED)
+    throw runtime_error(string("Cannot map the io_uring: ") + strerror(errno));
+
+  return (unsigned char *)addr;
+}
+
+};
+
+#endif // PTBM_URING
+
+}
+
+#endif // PTBM_URING_H
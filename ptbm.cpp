@@ -8,54 +8,1493 @@
  */
 
 #include <stdio.h>
+#include <atomic>
+#include <csignal>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <sstream>
 #include <string>
 #include <stdexcept>
 
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
 #include <cxxopts.hpp>
 #include "ptbm.h"
+#include "ptbm-compiler.h"
+#include "ptbm-config.h"
+#include "ptbm-forwarder.h"
+#include "ptbm-grouptable.h"
+#include "ptbm-optimizer.h"
+#include "ptbm-pipeline.h"
+#include "ptbm-server.h"
+#include "ptbm-shm.h"
+#include "ptbm-sim.h"
+#include "ptbm-topology.h"
+#include "ptbm-trace.h"
+
+using namespace std;
+
+template<class P>
+void setVirtualPorts(P &p, cxxopts::ParseResult &opts)
+{
+  if(opts.count("virtual"))
+    p.setVirtualPorts(opts["virtual"].as<vector<unsigned int>>());
+}
+
+#ifdef __linux__
+// The pipe SIGHUP writes to wake the reloads
+static int reloadPipe[2] = {-1, -1};
+
+void requestReload(int)
+{
+  char c = 'r';
+  ssize_t written = write(reloadPipe[1], &c, 1);
+  (void)written;
+}
+#endif
+
+// The virtual ports of the config option, read from the file again on SIGHUP
+// by a thread of its own while the object lives
+class Reloads
+{
+
+public:
+
+explicit Reloads(cxxopts::ParseResult &opts)
+{
+  if(!opts.count("config"))
+    return;
+
+  if(opts.count("virtual"))
+    throw cxxopts::OptionException(
+        "config option cannot be used with: virtual");
+
+  string path = opts["config"].as<string>();
+
+  // Reader slot 0 is the processing thread's, 1 the reloader's
+  pstore.reset(new ptbm::ConfigStore(2, ptbm::RouterConfig::load(path), path));
+
+#ifdef __linux__
+  if(pipe(reloadPipe) < 0)
+    throw runtime_error("Cannot create the reload pipe");
+
+  ptbm::ConfigStore *store = pstore.get();
+
+  preloader = thread([store]()
+  {
+    char c;
+
+    for(;;)
+    {
+      ssize_t n = read(reloadPipe[0], &c, 1);
+
+      if(n < 0 && errno == EINTR)
+        continue;
+
+      if(n != 1 || c != 'r')
+        break;
+
+      try
+      {
+        store->reload();
+
+        auto config = store->current(1);
+
+        cerr << "configuration " << config.version << ": virtual ports";
+        for(unsigned int port : config.virtualPorts)
+          cerr << " " << port;
+        cerr << endl;
+      }
+      catch(exception &e)
+      {
+        cerr << "Configuration not reloaded: " << e.what() << endl;
+      }
+    }
+  });
+
+  signal(SIGHUP, requestReload);
+#endif
+}
+
+Reloads(const Reloads &) = delete;
+Reloads &operator=(const Reloads &) = delete;
+
+~Reloads()
+{
+#ifdef __linux__
+  if(!preloader.joinable())
+    return;
+
+  signal(SIGHUP, SIG_DFL);
+
+  char c = 'q';
+  ssize_t written = write(reloadPipe[1], &c, 1);
+  (void)written;
+
+  preloader.join();
+  close(reloadPipe[0]);
+  close(reloadPipe[1]);
+#endif
+}
+
+/// The store of the configuration, null without the config option
+ptbm::ConfigStore *
+store()
+{
+  return pstore.get();
+}
+
+private:
+
+unique_ptr<ptbm::ConfigStore> pstore;
+thread preloader;
+
+};
+
+void printProcLine(string line)
+{
+  cout << line << endl;
+}
+
+/// Prints the outputs of the header, only the first output of a port
+/// (--output) or their number (--count-outputs) if asked: both walk the header
+/// lazily and skip the subtrees they do not print
+template<class P>
+void printOutputs(P &p, cxxopts::ParseResult &opts)
+{
+  if(opts.count("output") && opts["count-outputs"].as<bool>())
+    throw cxxopts::OptionException(
+        "output option cannot be used with: count-outputs");
+
+  auto outputs = P::outputs(p.context(), p.getHeaderBits());
+
+  if(opts["count-outputs"].as<bool>())
+    cout << outputs.count() << endl;
+  else if(opts.count("output"))
+  {
+    unsigned int port = opts["output"].as<unsigned int>();
+    typename P::header_type subtree;
+
+    if(!outputs.find(port, subtree))
+      throw runtime_error("No output on port " + to_string(port));
+
+    p.setHeaderBits(subtree);
+
+    string text = p.getHeaderString();
+    printProcLine(to_string(port) + " " + (text.size() ? text : "*"));
+  }
+  else
+    p.procHeader(printProcLine);
+}
+
+/// Processes the header count times and prints the throughput, threads
+/// share the context of the processor and have a scratch of their own
+template<class P>
+void benchmark(P &p, long long count, int threads = 1)
+{
+  const typename P::Context &context = p.context();
+  typename P::header_type header = p.getHeaderBits();
+  atomic<long long> outputs(0);
+  vector<thread> workers;
+
+  threads = max(1, threads);
+
+  auto start = chrono::steady_clock::now();
+
+  for(int t=0; t<threads; t++)
+    workers.emplace_back([&, t]()
+    {
+      typename P::Scratch scratch;
+      long long total = count / threads + (t < count % threads), outs = 0;
+
+      for(long long n=0; n<total; n++)
+      {
+        P::process(context, header, scratch);
+        outs += scratch.ports.size();
+      }
+
+      outputs += outs;
+    });
+
+  for(thread &worker : workers)
+    worker.join();
+
+  double secs = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+  cout << "header size: " << typename P::header_type().size() << " bits, ";
+
+  if(threads > 1)
+    cout << "threads: " << threads << ", ";
+
+  cout << "headers: " << count << ", "
+       << "outputs: " << outputs << ", "
+       << "seconds: " << secs << ", "
+       << "headers/s: " << (secs > 0 ? count / secs : 0) << ", "
+       << "ns/header: " << (count ? secs * 1e9 / count : 0)
+       << endl;
+}
+
+/// Reads comma separated numbers
+vector<unsigned int> readNumbers(string text)
+{
+  vector<unsigned int> nums;
+  stringstream ss(text);
+
+  for(unsigned int num; ss >> num;)
+  {
+    nums.push_back(num);
+    if(ss.peek() == ',')
+      ss.ignore();
+  }
+
+  return nums;
+}
+
+/// Compares the fixed and the compact layout on trees read from stdin
+/// (one tree per line in textual form: brackets and port numbers)
+template<class P>
+void layoutReport(P &p)
+{
+  int headerSize = typename P::header_type().size();
+  int capacity = p.maxOpenBrackets();
+  long long totalLeaves = 0, totalNodes = 0, totalCompactBits = 0;
+  int fixedFits = 0, compactFits = 0, trees = 0;
+  string line;
+
+  cout << "leaves nodes fixed_bits compact_bits" << endl;
+
+  while(getline(cin, line))
+  {
+    if(line.empty())
+      continue;
+
+    string::size_type sep = line.find(' ');
+    string brackets = line.substr(0, sep);
+    vector<unsigned int> nums =
+        sep == string::npos ? vector<unsigned int>() :
+                              readNumbers(line.substr(sep+1));
+
+    int nodes = nums.size();
+    int leaves = 0;
+    for(string::size_type i=0; i+1<brackets.size(); i++)
+      if(brackets[i] == '(' && brackets[i+1] == ')')
+        ++leaves;
+
+    int fixedBits = p.fixedHeaderSize(nodes);
+    int compactBits = p.compactHeaderSize(brackets, nums);
+
+    cout << leaves << " " << nodes << " "
+         << fixedBits << " " << compactBits << endl;
+
+    totalLeaves += leaves;
+    totalNodes += nodes;
+    totalCompactBits += compactBits;
+    fixedFits += nodes <= capacity;
+    compactFits += compactBits <= headerSize;
+    ++trees;
+  }
+
+  if(!trees || !totalNodes)
+    return;
+
+  // Destinations per header if the trees grew (or were cut) to fill a header
+  int overhead = p.compactHeaderSize("", {});
+  double fixedDests = (double)totalLeaves / totalNodes * capacity;
+  double compactDests = (double)totalLeaves * (headerSize - overhead)
+                        / (totalCompactBits - (long long)trees * overhead);
+
+  cout << "trees: " << trees << ", "
+       << "fit fixed: " << fixedFits << ", "
+       << "fit compact: " << compactFits << endl
+       << "destinations per header: fixed " << fixedDests << ", "
+       << "compact " << compactDests << " ("
+       << showpos << (compactDests / fixedDests - 1) * 100 << noshowpos
+       << "%)" << endl;
+}
+
+/// Prints the destination count, depth and fan-out of the header
+template<class P>
+void printQuery(P &p)
+{
+  cout << "leaves: " << p.leafCount() << ", "
+       << "nodes: " << p.nodeCount() << ", "
+       << "depth: " << p.maxDepth() << ", "
+       << "root fan-out: " << p.rootFanout() << endl;
+}
+
+/// Simulates the headers of a trace read from stdin in a topology
+/// (one header per line: TIME ROUTER_ID HEADER_BITS)
+template<class P>
+void simulate(cxxopts::ParseResult &opts)
+{
+  ptbm::Topology topology;
+  topology.load(opts["simulate"].as<string>());
+
+  ptbm::Simulator<P> sim(topology,
+                         opts["service-time"].as<unsigned int>(),
+                         opts["queue-limit"].as<size_t>(),
+                         opts["compact"].as<bool>(),
+                         opts["threads"].as<int>());
+
+  unsigned long long time;
+  unsigned int router;
+  string bits;
+
+  while(cin >> time >> router >> bits)
+    sim.inject(time, topology.index(router),
+               typename P::header_type(bits));
+
+  if(opts["deliveries"].as<bool>())
+    sim.run([&topology](const typename ptbm::Simulator<P>::Delivery &d)
+    {
+      cout << d.packet << " " << topology.id(d.router) << " "
+           << d.time << " " << d.hops << "\n";
+    });
+  else
+    sim.run();
+
+  sim.stats().print(cout);
+}
+
+/// Prints the routers the headers of a trace read from stdin are delivered
+/// to in a topology (one line per header: PACKET: ROUTER_ID..)
+template<class P>
+void deliverySets(P &pt, cxxopts::ParseResult &opts)
+{
+  ptbm::Topology topology;
+  topology.load(opts["delivery-set"].as<string>());
+
+  unsigned long long time;
+  unsigned int router;
+  string bits;
+  vector<int> deliveries;
+  vector<unsigned int> ids;
+  long long packet = 0, dropped = 0;
+
+  while(cin >> time >> router >> bits)
+  {
+    deliveries.clear();
+    ids.clear();
+    dropped += pt.deliverySet(typename P::header_type(bits),
+                              topology.index(router), topology, deliveries);
+
+    for(int r : deliveries)
+      ids.push_back(topology.id(r));
+    sort(ids.begin(), ids.end());
+
+    cout << packet++ << ":";
+    for(unsigned int id : ids)
+      cout << " " << id;
+    cout << "\n";
+  }
+
+  cerr << "headers: " << packet << ", dropped subtrees: " << dropped << endl;
+}
+
+/// Processes the headers of a trace read from stdin in pipelined stages and
+/// prints their outputs (PACKET PORT SUBTREE), the stats of the stages to
+/// stderr
+template<class P>
+void pipeline(P &pt, cxxopts::ParseResult &opts)
+{
+  setVirtualPorts(pt, opts);
+
+  // The stages use getline and write, not stdio
+  ios::sync_with_stdio(false);
+
+  ptbm::Pipeline<P> pipeline(pt, max(0, opts["batch"].as<int>()),
+                             max(0, opts["pipeline-depth"].as<int>()));
+  Reloads reloads(opts);
+
+  if(reloads.store())
+    pipeline.setConfig(reloads.store());
+
+  pipeline.run(cin, cout);
+  pipeline.stats().print(cerr);
+}
+
+/// Saves the headers of a trace read from stdin (TIME ROUTER BITS or BITS per
+/// line) in binary form one after the other, invalid lines are skipped
+template<class P>
+void saveTrace(cxxopts::ParseResult &opts)
+{
+  string fileName = opts["save-trace"].as<string>();
+  ofstream out(fileName, ios::binary);
+  vector<unsigned char> bytes(P::HEADER_BYTES);
+  long long headers = 0, invalid = 0, lines = 0;
+
+  if(!out)
+    throw runtime_error("Cannot create trace: " + fileName);
+
+  for(string line; getline(cin, line);)
+  {
+    ++lines;
+
+    size_t end = line.find_last_not_of(" \t\r");
+
+    if(end == string::npos)
+      continue;
+
+    size_t begin = line.find_last_of(" \t", end) + 1;
+    typename P::header_type header;
+
+    if(end + 1 - begin != header.size() ||
+       line.find_first_not_of("01", begin) <= end)
+    {
+      // Skipped like an invalid header of the pipeline, the trace goes on
+      cerr << "line " << lines << " invalid: Invalid header bits" << endl;
+      ++invalid;
+      continue;
+    }
+
+    header = typename P::header_type(line, begin, end + 1 - begin);
+    P::headerToBytes(header, bytes.data());
+    out.write((const char *)bytes.data(), bytes.size());
+    ++headers;
+  }
+
+  if(!out.flush())
+    throw runtime_error("Cannot write trace: " + fileName);
+
+  cerr << "headers: " << headers << ", invalid: " << invalid << ", bytes: "
+       << headers * P::HEADER_BYTES << endl;
+}
+
+/// Processes the headers of a binary trace interleaved and prints their
+/// outputs (PACKET PORT SUBTREE), with --bench the throughput of bench passes
+/// over the trace one header at a time and interleaved
+template<class P>
+void processTrace(P &pt, cxxopts::ParseResult &opts)
+{
+  setVirtualPorts(pt, opts);
+
+  ptbm::TraceFile<P> trace(opts["trace"].as<string>());
+  int width = opts["interleave"].as<int>();
+  vector<uint32_t> order;
+
+  if(width < 1)
+    throw cxxopts::OptionException("interleave must be at least 1");
+
+  // Packets are rarely processed in the order of their buffers
+  if(opts["shuffle"].as<bool>())
+  {
+    if(trace.size() > UINT32_MAX)
+      throw runtime_error("Too many headers to shuffle");
+
+    order.resize(trace.size());
+    for(size_t i=0; i<order.size(); i++)
+      order[i] = i;
+    shuffle(order.begin(), order.end(), mt19937(1));
+  }
+
+  const uint32_t *orderData = order.empty() ? nullptr : order.data();
+
+  if(!opts.count("bench"))
+  {
+    ptbm::Interleaver<P> interleaver(pt.context(), width);
+    P printer(pt);
+
+    ios::sync_with_stdio(false);
+
+    interleaver.run(trace, orderData, trace.size(),
+        [&](size_t header, const typename P::Scratch &outputs,
+            const char *error)
+    {
+      if(error)
+        cout << header << " invalid: " << error << "\n";
+
+      for(size_t n=0; n<outputs.ports.size(); n++)
+      {
+        printer.setHeaderBits(outputs.subtrees[n]);
+
+        string subtree = printer.getHeaderString();
+
+        cout << header << " " << outputs.ports[n] << " "
+             << (subtree.size() ? subtree : "*") << "\n";
+      }
+    });
+
+    cout.flush();
+    return;
+  }
+
+  long long passes = max(1LL, opts["bench"].as<long long>());
+  vector<int> widths = {1};
+
+  if(width > 1)
+    widths.push_back(width);
+
+  for(int w : widths)
+  {
+    ptbm::Interleaver<P> interleaver(pt.context(), w);
+    long long outputs = 0, invalid = 0;
+    auto start = chrono::steady_clock::now();
+
+    for(long long n=0; n<passes; n++)
+      interleaver.run(trace, orderData, trace.size(),
+          [&](size_t, const typename P::Scratch &outs, const char *error)
+      {
+        outputs += outs.ports.size();
+        invalid += error != nullptr;
+      });
+
+    double secs = chrono::duration<double>(
+          chrono::steady_clock::now() - start).count();
+    long long headers = passes * trace.size();
+
+    cout << "interleave: " << w << ", "
+         << "headers: " << headers << ", "
+         << "trace bytes: " << trace.size() * P::HEADER_BYTES << ", "
+         << "outputs: " << outputs << ", "
+         << "invalid: " << invalid << ", "
+         << "seconds: " << secs << ", "
+         << "headers/s: " << (secs > 0 ? headers / secs : 0) << ", "
+         << "ns/header: " << (headers ? secs * 1e9 / headers : 0)
+         << endl;
+  }
+}
+
+/// Compiles the headers of the groups read from stdin in a topology
+/// (one group per line: SOURCE_ID DEST_ID,DEST_ID,..) and prints them as
+/// a trace (0 SOURCE_ID HEADER_BITS) or in textual form with print
+template<class P>
+void compileGroups(P &pt, cxxopts::ParseResult &opts)
+{
+  ptbm::Topology topology;
+  topology.load(opts["compile"].as<string>());
+
+  ptbm::HeaderCompiler<P> compiler(topology, opts["compact"].as<bool>());
+  bool print = opts["print"].as<bool>();
+  unsigned int source;
+  string line, dests;
+  long long groups = 0, headers = 0;
+
+  // Optimized trees instead of the shortest path trees
+  typedef ptbm::TreeOptimizer<P> Optimizer;
+  unique_ptr<Optimizer> optimizer;
+  double budget = 0;
+  long long baseHeaders = 0, brackets = 0, baseBrackets = 0, candidates = 0;
+
+  if(opts.count("optimize"))
+  {
+    string objective = opts["objective"].as<string>();
+
+    if(objective != "fragments" && objective != "brackets")
+      throw cxxopts::OptionException("objective must be fragments or brackets");
+
+    budget = opts["optimize"].as<double>() / 1000;
+    optimizer.reset(new Optimizer(topology, opts["compact"].as<bool>(),
+                                  opts["threads"].as<int>(),
+                                  objective == "brackets" ?
+                                    Optimizer::BRACKETS : Optimizer::FRAGMENTS));
+  }
+
+  auto start = chrono::steady_clock::now();
+
+  while(getline(cin, line))
+  {
+    stringstream ss(line);
+
+    if(!(ss >> source))
+      continue;
+
+    dests.clear();
+    ss >> dests;
+
+    vector<int> destinations;
+    for(unsigned int dest : readNumbers(dests))
+      destinations.push_back(topology.index(dest));
+
+    vector<typename P::header_type> compiled;
+
+    if(optimizer)
+    {
+      auto result = optimizer->optimize(topology.index(source), destinations,
+                                        budget);
+
+      compiled.swap(result.headers);
+      baseHeaders += result.baseHeaders;
+      brackets += result.openBrackets;
+      baseBrackets += result.baseOpenBrackets;
+      candidates += result.candidates;
+    }
+    else
+      compiled = compiler.compile(topology.index(source), destinations);
+
+    for(auto &header : compiled)
+    {
+      if(print)
+      {
+        pt.setHeaderBits(header);
+        cout << source << " " << pt.getHeaderString() << "\n";
+      }
+      else
+        cout << "0 " << source << " " << header << "\n";
+
+      ++headers;
+    }
+
+    ++groups;
+  }
+
+  double secs = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+  cerr << "groups: " << groups << ", headers: " << headers << ", "
+       << "groups/s: " << (secs > 0 ? groups / secs : 0) << endl;
+
+  if(optimizer)
+  {
+    // Bits of the brackets and the numbers of the trees, bits of the headers
+    long long nodeBits = 2 + P::PORT_BITS;
+    long long headerBits = typename P::header_type().size();
+
+    cerr << "shortest path trees: " << baseBrackets << " open brackets, "
+         << baseHeaders << " headers" << endl
+         << "optimized trees: " << brackets << " open brackets, "
+         << headers << " headers (" << candidates << " candidates)" << endl
+         << "tree bits saved: " << (baseBrackets - brackets) * nodeBits
+         << ", header bits saved: " << (baseHeaders - headers) * headerBits
+         << endl;
+  }
+}
+
+/// Fails random links one by one (restored after each) and compares the
+/// rebuild of the affected groups to the rebuild of every group
+template<class P>
+void linkFailures(ptbm::GroupTable<P> &table, ptbm::Topology &topology,
+                  int failures)
+{
+  mt19937 rng(1);
+  long long marked = 0, maxMarked = 0;
+  double failSecs = 0, restoreSecs = 0;
+  vector<int> linked;
+
+  for(int router=0; router<(int)topology.routerCount(); router++)
+    if(!topology.links(router).empty())
+      linked.push_back(router);
+
+  if(failures > 0 && linked.empty())
+    throw runtime_error("The topology has no links to fail");
+
+  for(int i=0; i<failures; i++)
+  {
+    int router = linked[rng() % linked.size()];
+    auto links = topology.links(router);
+    auto link = links[rng() % links.size()];
+    long long before = table.stats().linkMarks;
+
+    auto start = chrono::steady_clock::now();
+    table.removeLink(router, link.port);
+    table.flush();
+    auto failed = chrono::steady_clock::now();
+
+    long long count = table.stats().linkMarks - before;
+    marked += count;
+    maxMarked = max(maxMarked, count);
+
+    table.addLink(router, link.port, link.neighbor, link.delay);
+    table.flush();
+
+    failSecs += chrono::duration<double>(failed - start).count();
+    restoreSecs += chrono::duration<double>(
+          chrono::steady_clock::now() - failed).count();
+  }
+
+  auto start = chrono::steady_clock::now();
+  table.updateTopology([](ptbm::Topology &) {});
+  table.flush();
+  double fullSecs = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+  cerr << "link failures: " << failures << ", groups rebuilt per failure: "
+       << (failures ? double(marked) / failures : 0) << " (max: " << maxMarked
+       << ")" << endl
+       << "failure: " << (failures ? failSecs / failures * 1e3 : 0) << " ms, "
+       << "restore: " << (failures ? restoreSecs / failures * 1e3 : 0) << " ms, "
+       << "full rebuild: " << fullSecs * 1e3 << " ms" << endl;
+}
+
+template<class P>
+void groupTable(P &pt, cxxopts::ParseResult &opts)
+{
+  ptbm::Topology topology;
+  topology.load(opts["group-table"].as<string>());
+
+  int readers = opts["threads"].as<int>();
+  ptbm::GroupTable<P> table(topology, opts["compact"].as<bool>(), readers);
+  typedef typename ptbm::GroupTable<P>::ReadGuard ReadGuard;
+  bool print = opts["print"].as<bool>();
+  bool pending = false;
+  string line, command, members;
+  vector<pair<int, unsigned int>> sent;
+  long long sends = 0, headers = 0;
+
+  while(getline(cin, line))
+  {
+    stringstream ss(line);
+    unsigned int source, group;
+
+    if(!(ss >> command))
+      continue;
+
+    if(command == "join" || command == "leave")
+    {
+      if(!(ss >> source >> group >> members))
+        throw runtime_error("Invalid command: " + line);
+
+      for(unsigned int member : readNumbers(members))
+        if(command == "join")
+          table.join(topology.index(source), group, topology.index(member));
+        else
+          table.leave(topology.index(source), group, topology.index(member));
+
+      pending = true;
+      continue;
+    }
+
+    if(command == "down" || command == "up")
+    {
+      unsigned int router, port, neighbor, delay = 1;
+
+      if(!(ss >> router >> port))
+        throw runtime_error("Invalid command: " + line);
+
+      if(command == "down")
+        table.removeLink(topology.index(router), port);
+      else
+      {
+        if(!(ss >> neighbor))
+          throw runtime_error("Invalid command: " + line);
+
+        ss >> delay;
+        table.addLink(topology.index(router), port, topology.index(neighbor),
+                      delay);
+      }
+
+      pending = true;
+      continue;
+    }
+
+    unsigned long long time;
+
+    if(command != "send" || !(ss >> time >> source >> group))
+      throw runtime_error("Invalid command: " + line);
+
+    // The output does not depend on the speed of the background thread
+    if(pending)
+      table.flush();
+    pending = false;
+
+    ReadGuard guard(table, 0);
+    auto entry = table.lookup(topology.index(source), group);
+
+    if(!entry)
+      throw runtime_error("No members in group " + to_string(group) +
+                          " of router " + to_string(source));
+    if(!entry->error.empty())
+      throw runtime_error(entry->error);
+
+    for(auto &header : entry->headers)
+    {
+      if(print)
+      {
+        pt.setHeaderBits(header);
+        cout << source << " " << pt.getHeaderString() << "\n";
+      }
+      else
+        cout << time << " " << source << " " << header << "\n";
+
+      ++headers;
+    }
+
+    sent.push_back(make_pair(topology.index(source), group));
+    ++sends;
+  }
+
+  table.flush();
+
+  auto stats = table.stats();
+
+  cerr << "sends: " << sends << ", headers: " << headers << ", "
+       << "changes: " << stats.changes << ", rebuilds: " << stats.rebuilds
+       << ", batches: " << stats.batches << endl;
+
+  if(opts.count("link-failures"))
+    linkFailures(table, topology, opts["link-failures"].as<int>());
+
+  if(!opts.count("bench") || sent.empty())
+    return;
+
+  // Lookups of the sent groups by every reader at the same time
+  long long count = opts["bench"].as<long long>();
+  atomic<long long> found(0);
+  vector<thread> threads;
+
+  auto start = chrono::steady_clock::now();
+
+  for(int reader=0; reader<readers; reader++)
+    threads.emplace_back([&table, &sent, &found, count, reader]()
+    {
+      long long hits = 0;
+
+      for(long long i=0; i<count; i++)
+      {
+        ReadGuard guard(table, reader);
+        auto &key = sent[(i + reader) % sent.size()];
+
+        if(table.lookup(key.first, key.second))
+          ++hits;
+      }
+
+      found += hits;
+    });
+
+  for(thread &t : threads)
+    t.join();
+
+  double secs = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+  cerr << "lookups: " << count * readers << ", found: " << found << ", "
+       << "lookups/s: " << (secs > 0 ? count * readers / secs : 0) << endl;
+}
+
+/// Resident memory of the process in bytes (0 if unknown)
+size_t residentBytes()
+{
+#ifdef __linux__
+  ifstream statm("/proc/self/statm");
+  size_t pages, resident;
+
+  if(statm >> pages >> resident)
+    return resident * sysconf(_SC_PAGESIZE);
+#endif
+  return 0;
+}
+
+/// Loads a topology (text or binary), prints its size and the memory per
+/// router, saves it in binary if asked
+void topologyInfo(cxxopts::ParseResult &opts)
+{
+  ptbm::Topology topology;
+  size_t before = residentBytes();
+  auto start = chrono::steady_clock::now();
+
+  topology.load(opts["topology-info"].as<string>(),
+                opts.count("threads") ? opts["threads"].as<int>() : 0);
+
+  double secs = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+  size_t resident = residentBytes() - before;
+  int routers = max(topology.routerCount(), 1);
+
+  cout << "routers: " << topology.routerCount() << endl
+       << "links: " << topology.linkCount() << endl
+       << "load time: " << secs << " s" << (topology.mapped() ? " (mapped)" : "")
+       << endl
+       << "topology bytes: " << topology.memoryUsage() << ", per router: "
+       << (double)topology.memoryUsage() / routers << endl;
+
+  // Pages of a mapped file are only resident when they are read
+  if(resident)
+    cout << "resident bytes: " << resident << ", per router: "
+         << (double)resident / routers << endl;
+
+  if(opts.count("save-topology"))
+    topology.save(opts["save-topology"].as<string>());
+}
+
+#ifdef PTBM_SERVER
+// The event descriptor that stops the server
+static int serverStop = -1;
+
+void stopServer(int)
+{
+  uint64_t one = 1;
+  ssize_t written = write(serverStop, &one, sizeof(one));
+  (void)written;
+}
+#endif
+
+/// Serves the configured processor on a Unix domain socket until SIGINT or
+/// SIGTERM
+template<class P>
+void serve(P &pt, cxxopts::ParseResult &opts)
+{
+#ifdef PTBM_SERVER
+  setVirtualPorts(pt, opts);
+
+  ptbm::Server<P> server(pt, opts["serve"].as<string>());
+  Reloads reloads(opts);
+
+  if(reloads.store())
+    server.setConfig(reloads.store());
+
+  serverStop = server.stopDescriptor();
+  signal(SIGINT, stopServer);
+  signal(SIGTERM, stopServer);
+
+  server.run();
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  auto &stats = server.stats();
+
+  cerr << "connections: " << stats.connections << ", "
+       << "requests: " << stats.requests << ", "
+       << "items: " << stats.items << ", "
+       << "errors: " << stats.errors << ", "
+       << "protocol errors: " << stats.protocolErrors << endl;
+#else
+  (void)pt;
+  (void)opts;
+  throw runtime_error("The serve option needs Linux (epoll)");
+#endif
+}
+
+#ifdef PTBM_FORWARDER
+// The event descriptor that stops the forwarder
+static int forwarderStop = -1;
+
+void stopForwarder(int)
+{
+  uint64_t one = 1;
+  ssize_t written = write(forwarderStop, &one, sizeof(one));
+  (void)written;
+}
 
-using namespace std;
+/// Reads the UDP destinations of the ports (PORT=a.b.c.d:port,...)
+map<unsigned int, sockaddr_in> readPortMap(const string &text)
+{
+  map<unsigned int, sockaddr_in> destinations;
+  stringstream ss(text);
+
+  for(string item; getline(ss, item, ',');)
+  {
+    size_t eq = item.find('=');
+
+    if(eq == string::npos)
+      throw runtime_error("Invalid port map item (PORT=a.b.c.d:port): " + item);
+
+    destinations[stoul(item.substr(0, eq))] =
+        ptbm::parseUdpAddress(item.substr(eq + 1));
+  }
+
+  return destinations;
+}
 
-void setVirtualPorts(ptbm::Ptbm<> &p, cxxopts::ParseResult opts)
+/// Reads the forwarder engine option
+template<class P>
+typename ptbm::Forwarder<P>::Engine readEngine(const string &name)
 {
-  if(opts.count("virtual"))
-    p.setVirtualPorts(opts["virtual"].as<vector<unsigned int>>());
+  typedef ptbm::Forwarder<P> Forwarder;
+
+  if(name == "auto")
+    return Forwarder::AUTO;
+  if(name == "mmsg")
+    return Forwarder::MMSG;
+  if(name == "uring")
+    return Forwarder::URING;
+
+  throw cxxopts::OptionException("Unknown engine: " + name +
+                                 " (auto, mmsg, uring)");
 }
 
-void printProcLine(string line)
+/// Sets the port queues of the forwarder by the options
+template<class P>
+void setForwarderQueues(ptbm::Forwarder<P> &forwarder,
+                        cxxopts::ParseResult &opts)
 {
-  cout << line << endl;
+  typedef typename ptbm::Forwarder<P>::Queues Queues;
+
+  // The io_uring engine sends every output at once, it has no port queues
+  if(forwarder.engine() == ptbm::Forwarder<P>::URING)
+  {
+    for(const char *option : {"queue-depth", "drop-policy", "quantum"})
+      if(opts.count(option))
+        cerr << "Warning: --" << option << " has no effect with the io_uring "
+             << "engine" << endl;
+
+    return;
+  }
+
+  string policy = opts["drop-policy"].as<string>();
+
+  if(policy != "tail" && policy != "head")
+    throw cxxopts::OptionException("Unknown drop policy: " + policy +
+                                   " (tail, head)");
+
+  forwarder.setQueues(opts["queue-depth"].as<unsigned int>(),
+                      policy == "tail" ? Queues::DROP_TAIL : Queues::DROP_HEAD,
+                      opts["quantum"].as<unsigned int>());
 }
 
-int main(int argc, char **argv)
+/// Prints the counters of the port queues of the forwarder
+template<class P>
+void printForwarderQueues(const ptbm::Forwarder<P> &forwarder, ostream &out)
 {
-  cxxopts::Options options("PTBM", "Parentheses Tree Based Multicast");
+  for(unsigned int port : forwarder.queues().ports())
+  {
+    auto counters = forwarder.queues().counters(port);
 
-  options.add_options()
-    ("b,brackets", "Brackets in the header",
-      cxxopts::value<string>()->default_value(""))
-    ("n,numbers", "Numbers in the header",
-      cxxopts::value<vector<unsigned int>>())
-    ("v,virtual", "Virtual ports",
-      cxxopts::value<vector<unsigned int>>())
-    ("g,generate", "Generate header (binary)",
-      cxxopts::value<bool>()->default_value("false"))
-    ("i,input", "Input header (binary)",
-      cxxopts::value<bool>()->default_value("false"))
-    ("p,print", "Print header",
-      cxxopts::value<bool>()->default_value("false"))
-    ("help", "Print usage")
-    ;
+    out << "port " << port << ": "
+        << "enqueued: " << counters.enqueued << ", "
+        << "dropped: " << counters.dropped << ", "
+        << "flushed: " << counters.flushed << endl;
+  }
+}
 
-  auto opts = options.parse(argc, argv);
+/// Forwards count packets of the header through the forwarder on loopback:
+/// a sender thread, the forwarder and a sink socket for every output port
+template<class P>
+void forwardBench(P &pt, cxxopts::ParseResult &opts, long long count,
+                  typename ptbm::Forwarder<P>::Engine engine)
+{
+  vector<unsigned int> nums;
 
-  if (opts.count("help"))
+  if(opts["numbers"].count())
+    nums = opts["numbers"].as<vector<unsigned int>>();
+
+  pt.setHeader(opts["brackets"].as<string>(), nums);
+
+  vector<unsigned int> ports;
+  vector<typename P::header_type> subtrees;
+
+  pt.procHeaderBits(ports, subtrees);
+
+  if(ports.empty())
+    throw runtime_error("The header has no outputs");
+
+  // Sinks of the ports
+  map<unsigned int, sockaddr_in> destinations;
+  vector<int> sinks;
+
+  for(unsigned int port : ports)
   {
-    std::cout << options.help() << std::endl;
-     exit(0);
+    if(destinations.count(port))
+      continue;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    sockaddr_in addr = ptbm::parseUdpAddress("127.0.0.1:0");
+    socklen_t size = sizeof(addr);
+    int bufferSize = 8 << 20;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    if(bind(fd, (sockaddr *)&addr, size) < 0)
+      throw runtime_error("Cannot bind a sink socket");
+
+    getsockname(fd, (sockaddr *)&addr, &size);
+    destinations[port] = addr;
+    sinks.push_back(fd);
+  }
+
+  ptbm::Forwarder<P> forwarder(pt, opts["forward"].as<string>(), destinations,
+                               opts["batch"].as<int>(), engine);
+  setForwarderQueues(forwarder, opts);
+  sockaddr_in target = ptbm::parseUdpAddress(
+        "127.0.0.1:" + to_string(forwarder.port()));
+  atomic<long long> received(0);
+  atomic<bool> done(false);
+
+  thread forwarding([&forwarder]() { forwarder.run(); });
+  thread sinking([&sinks, &received, &done]()
+  {
+    vector<pollfd> fds;
+    vector<mmsghdr> msgs(64);
+    vector<iovec> vecs(64);
+    vector<char> buffer(64 * 2048);
+
+    for(int fd : sinks)
+      fds.push_back({fd, POLLIN, 0});
+
+    for(int i=0; i<64; i++)
+    {
+      vecs[i] = {&buffer[i * 2048], 2048};
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_iov = &vecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(!done)
+    {
+      if(poll(fds.data(), fds.size(), 10) <= 0)
+        continue;
+
+      for(pollfd &fd : fds)
+        if(fd.revents)
+          for(int n; (n = recvmmsg(fd.fd, msgs.data(), 64, MSG_DONTWAIT,
+                                   nullptr)) > 0;)
+            received += n;
+    }
+  });
+
+  // The packets: the header and the payload
+  vector<unsigned char> packet(P::HEADER_BYTES + opts["payload"].as<int>(), 0);
+  P::headerToBytes(pt.getHeaderBits(), packet.data());
+
+  int sender = socket(AF_INET, SOCK_DGRAM, 0);
+  vector<mmsghdr> msgs(64);
+  iovec vec = {packet.data(), packet.size()};
+
+  for(mmsghdr &msg : msgs)
+  {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_name = &target;
+    msg.msg_hdr.msg_namelen = sizeof(target);
+    msg.msg_hdr.msg_iov = &vec;
+    msg.msg_hdr.msg_iovlen = 1;
+  }
+
+  // At most window packets on the way, so the socket buffers do not overflow
+  const long long window = 256;
+  long long outputs = ports.size(), sent = 0;
+  auto start = chrono::steady_clock::now();
+
+  while(sent < count)
+  {
+    auto wait = chrono::steady_clock::now();
+
+    while((sent - window) * outputs > received &&
+          chrono::steady_clock::now() - wait < chrono::milliseconds(100))
+      this_thread::yield();
+
+    int n = sendmmsg(sender, msgs.data(), min(64LL, count - sent), 0);
+
+    if(n > 0)
+      sent += n;
+  }
+
+  // Waits for the last packets (lost ones for 100 ms)
+  for(auto wait = chrono::steady_clock::now();
+      received < sent * outputs &&
+      chrono::steady_clock::now() - wait < chrono::milliseconds(100);)
+    this_thread::yield();
+
+  double secs = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+  forwarder.stop();
+  forwarding.join();
+  done = true;
+  sinking.join();
+  close(sender);
+
+  for(int fd : sinks)
+    close(fd);
+
+  cout << "engine: " << forwarder.engineName(forwarder.engine()) << endl;
+  forwarder.stats().print(cout, secs);
+  printForwarderQueues(forwarder, cout);
+  cout << "received by the sinks: " << received << " of "
+       << sent * outputs << endl;
+}
+#endif
+
+/// Forwards UDP datagrams until SIGINT or SIGTERM (or benchmarks the
+/// forwarder on loopback)
+template<class P>
+void forward(P &pt, cxxopts::ParseResult &opts)
+{
+#ifdef PTBM_FORWARDER
+  setVirtualPorts(pt, opts);
+
+  string engine = opts["engine"].as<string>();
+
+  // Both engines side by side
+  if(opts.count("bench") && engine == "both")
+  {
+    forwardBench(pt, opts, opts["bench"].as<long long>(),
+                 ptbm::Forwarder<P>::MMSG);
+    cout << endl;
+    forwardBench(pt, opts, opts["bench"].as<long long>(),
+                 ptbm::Forwarder<P>::URING);
+    return;
+  }
+
+  if(opts.count("bench"))
+  {
+    forwardBench(pt, opts, opts["bench"].as<long long>(),
+                 readEngine<P>(engine));
+    return;
+  }
+
+  map<unsigned int, sockaddr_in> destinations;
+
+  if(opts.count("port-map"))
+    destinations = readPortMap(opts["port-map"].as<string>());
+
+  ptbm::Forwarder<P> forwarder(pt, opts["forward"].as<string>(), destinations,
+                               opts["batch"].as<int>(), readEngine<P>(engine));
+  setForwarderQueues(forwarder, opts);
+
+  Reloads reloads(opts);
+
+  if(reloads.store())
+    forwarder.setConfig(reloads.store());
+
+  cerr << "engine: " << forwarder.engineName(forwarder.engine()) << endl;
+
+  forwarderStop = forwarder.stopDescriptor();
+  signal(SIGINT, stopForwarder);
+  signal(SIGTERM, stopForwarder);
+
+  auto start = chrono::steady_clock::now();
+
+  forwarder.run(opts["report"].as<double>(), &cerr);
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  forwarder.stats().print(cerr, chrono::duration<double>(
+                            chrono::steady_clock::now() - start).count());
+  printForwarderQueues(forwarder, cerr);
+#else
+  (void)pt;
+  (void)opts;
+  throw runtime_error("The forward option needs Linux (recvmmsg)");
+#endif
+}
+
+#ifdef PTBM_SHM
+// Set by SIGINT and SIGTERM to stop the shared memory consumer
+static atomic<bool> shmStop(false);
+
+void stopShm(int)
+{
+  shmStop = true;
+}
+
+/// Sends count requests of the header from producer threads to a consumer
+/// thread through the shared memory rings
+template<class P>
+void shmBench(P &pt, cxxopts::ParseResult &opts, long long count)
+{
+  vector<unsigned int> nums;
+
+  if(opts["numbers"].count())
+    nums = opts["numbers"].as<vector<unsigned int>>();
+
+  pt.setHeader(opts["brackets"].as<string>(), nums);
+
+  vector<unsigned char> header(P::HEADER_BYTES);
+  P::headerToBytes(pt.getHeaderBits(), header.data());
+
+  string path = opts["shm"].as<string>();
+  bool busyPoll = opts["busy-poll"].as<bool>();
+  int threads = opts["threads"].as<int>();
+  ptbm::ShmQueue::Params params;
+
+  params.capacity = opts["ring-size"].as<unsigned int>();
+  params.producers = threads;
+  params.maxOutputs = opts["max-outputs"].as<unsigned int>();
+
+  ptbm::ShmConsumer<P> consumer(pt, path, params, opts["batch"].as<int>(),
+                                busyPoll);
+  atomic<bool> stop(false);
+  atomic<long long> outputs(0);
+  atomic<uint64_t> roundTrips(0);
+
+  thread consuming([&consumer, &stop]() { consumer.run(stop); });
+
+  auto start = chrono::steady_clock::now();
+  vector<thread> producers;
+
+  for(int t=0; t<threads; t++)
+    producers.emplace_back([&, t]()
+    {
+      ptbm::ShmProducer producer(path, busyPoll);
+      long long total = count / threads + (t < count % threads);
+      long long sent = 0, received = 0, outs = 0;
+      uint64_t trips = 0;
+
+      auto handle = [&](const ptbm::ShmResult &result)
+      {
+        // The id is the send time
+        trips += chrono::duration_cast<chrono::nanoseconds>(
+              chrono::steady_clock::now().time_since_epoch()).count() -
+            result.id;
+        outs += result.outputs;
+        ++received;
+      };
+
+      while(received < total)
+      {
+        while(sent < total &&
+              producer.submit(chrono::duration_cast<chrono::nanoseconds>(
+                  chrono::steady_clock::now().time_since_epoch()).count(),
+                              header.data()))
+          ++sent;
+
+        if(!producer.receive(handle))
+          producer.wait();
+      }
+
+      outputs += outs;
+      roundTrips += trips;
+    });
+
+  for(thread &t : producers)
+    t.join();
+
+  double secs = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+  stop = true;
+  consuming.join();
+
+  auto &stats = consumer.stats();
+
+  cout << "producers: " << threads << ", "
+       << "requests: " << count << ", "
+       << "outputs: " << outputs << ", "
+       << "seconds: " << secs << endl
+       << "requests/s: " << (secs > 0 ? count / secs : 0) << ", "
+       << "round trip avg: " << (count ? roundTrips / count / 1000.0 : 0)
+       << " us" << endl
+       << "batches: " << stats.batches << ", "
+       << "requests/batch: "
+       << (stats.batches ? (double)stats.requests / stats.batches : 0) << ", "
+       << "consumer sleeps: " << stats.sleeps << endl;
+}
+#endif
+
+/// Processes the requests of other processes through shared memory rings
+/// until SIGINT or SIGTERM (or benchmarks the rings with producer threads)
+template<class P>
+void shmConsume(P &pt, cxxopts::ParseResult &opts)
+{
+#ifdef PTBM_SHM
+  setVirtualPorts(pt, opts);
+
+  if(opts.count("bench"))
+  {
+    shmBench(pt, opts, opts["bench"].as<long long>());
+    return;
+  }
+
+  ptbm::ShmQueue::Params params;
+
+  params.capacity = opts["ring-size"].as<unsigned int>();
+  params.producers = opts["producers"].as<unsigned int>();
+  params.maxOutputs = opts["max-outputs"].as<unsigned int>();
+
+  ptbm::ShmConsumer<P> consumer(pt, opts["shm"].as<string>(), params,
+                                opts["batch"].as<int>(),
+                                opts["busy-poll"].as<bool>());
+  Reloads reloads(opts);
+
+  if(reloads.store())
+    consumer.setConfig(reloads.store());
+
+  signal(SIGINT, stopShm);
+  signal(SIGTERM, stopShm);
+
+  consumer.run(shmStop);
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  auto &stats = consumer.stats();
+
+  cerr << "requests: " << stats.requests << ", "
+       << "invalid: " << stats.invalid << ", "
+       << "truncated: " << stats.truncated << ", "
+       << "batches: " << stats.batches << ", "
+       << "sleeps: " << stats.sleeps << endl;
+#else
+  (void)pt;
+  (void)opts;
+  throw runtime_error("The shm option needs Linux (futex)");
+#endif
+}
+
+template<class P>
+int run(cxxopts::ParseResult &opts)
+{
+  P pt;
+
+  pt.setCompactLayout(opts["compact"].as<bool>());
+
+  if(opts.count("topology-info"))
+  {
+    topologyInfo(opts);
+    return 0;
   }
 
-  ptbm::Ptbm<> pt;
+  if(opts.count("simulate"))
+  {
+    simulate<P>(opts);
+    return 0;
+  }
+
+  if(opts.count("compile"))
+  {
+    compileGroups(pt, opts);
+    return 0;
+  }
+
+  if(opts.count("group-table"))
+  {
+    groupTable(pt, opts);
+    return 0;
+  }
+
+  if(opts.count("forward"))
+  {
+    forward(pt, opts);
+    return 0;
+  }
+
+  if(opts.count("shm"))
+  {
+    shmConsume(pt, opts);
+    return 0;
+  }
+
+  if(opts.count("serve"))
+  {
+    serve(pt, opts);
+    return 0;
+  }
+
+  if(opts["pipeline"].as<bool>())
+  {
+    pipeline(pt, opts);
+    return 0;
+  }
+
+  if(opts.count("save-trace"))
+  {
+    saveTrace<P>(opts);
+    return 0;
+  }
+
+  if(opts.count("trace"))
+  {
+    processTrace(pt, opts);
+    return 0;
+  }
+
+  if(opts.count("delivery-set"))
+  {
+    deliverySets(pt, opts);
+    return 0;
+  }
+
+  if(opts["layout-report"].as<bool>())
+  {
+    layoutReport(pt);
+    return 0;
+  }
 
   if(opts["input"].as<bool>())
   {
@@ -73,13 +1512,19 @@ int main(int argc, char **argv)
 
     if(opts.count("print"))
       cout << pt.getHeaderString();
+    else if(opts.count("query"))
+      printQuery(pt);
     else
     {
       setVirtualPorts(pt, opts);
-      pt.procHeader(printProcLine);
+      if(opts.count("bench"))
+        benchmark(pt, opts["bench"].as<long long>(),
+                  opts["threads"].as<int>());
+      else
+        printOutputs(pt, opts);
     }
 
-    exit(0);
+    return 0;
   }
 
   string brackets = opts["brackets"].as<string>();
@@ -88,6 +1533,29 @@ int main(int argc, char **argv)
   if(opts["numbers"].count())
     nums = opts["numbers"].as<vector<unsigned int>>();
 
+  if(opts["fragment"].as<bool>())
+  {
+    if(opts.count("input") || opts.count("generate") || opts.count("compact"))
+      throw cxxopts::OptionException(
+          "fragment option cannot be used with: input, generate, compact");
+
+    auto fragments = pt.fragmentHeader(brackets, nums);
+
+    if(!pt.verifyFragments(brackets, nums, fragments))
+      throw runtime_error("Fragments do not deliver to the same leaves");
+
+    for(auto &fragment : fragments)
+    {
+      pt.setHeaderBits(fragment);
+      if(opts.count("print"))
+        cout << pt.getHeaderString() << endl;
+      else
+        cout << fragment << endl;
+    }
+
+    return 0;
+  }
+
   if(opts["generate"].as<bool>())
   {
     if(opts.count("input") || opts.count("print"))
@@ -96,12 +1564,198 @@ int main(int argc, char **argv)
 
     pt.setHeader(brackets, nums);
     cout << pt.getHeaderBits();
-    exit(0);
+    return 0;
   }
 
   pt.setHeader(brackets, nums);
   setVirtualPorts(pt, opts);
-  pt.procHeader(printProcLine);
+
+  if(opts.count("query"))
+    printQuery(pt);
+  else if(opts.count("bench"))
+    benchmark(pt, opts["bench"].as<long long>(), opts["threads"].as<int>());
+  else
+    printOutputs(pt, opts);
 
   return 0;
 }
+
+// The default header keeps the original Ptbm<> layout
+template<int HEADER_SIZE, int PORT_SIZE>
+struct Layout
+{
+  typedef ptbm::PtbmSized<HEADER_SIZE, PORT_SIZE> type;
+};
+
+template<>
+struct Layout<256, 4>
+{
+  typedef ptbm::Ptbm<> type;
+};
+
+template<int HEADER_SIZE>
+int runWithPortSize(cxxopts::ParseResult &opts)
+{
+  int portSize = opts["port-size"].as<int>();
+
+  switch(portSize)
+  {
+  case 4:  return run<typename Layout<HEADER_SIZE, 4>::type>(opts);
+  case 8:  return run<typename Layout<HEADER_SIZE, 8>::type>(opts);
+  case 16: return run<typename Layout<HEADER_SIZE, 16>::type>(opts);
+  }
+
+  throw cxxopts::OptionException(
+      "Unsupported port size: " + to_string(portSize) + " (4, 8, 16)");
+}
+
+int main(int argc, char **argv)
+{
+  cxxopts::Options options("PTBM", "Parentheses Tree Based Multicast");
+
+  options.add_options()
+    ("b,brackets", "Brackets in the header",
+      cxxopts::value<string>()->default_value(""))
+    ("n,numbers", "Numbers in the header",
+      cxxopts::value<vector<unsigned int>>())
+    ("v,virtual", "Virtual ports",
+      cxxopts::value<vector<unsigned int>>())
+    ("g,generate", "Generate header (binary)",
+      cxxopts::value<bool>()->default_value("false"))
+    ("i,input", "Input header (binary)",
+      cxxopts::value<bool>()->default_value("false"))
+    ("p,print", "Print header",
+      cxxopts::value<bool>()->default_value("false"))
+    ("f,fragment", "Split the header into fragments (binary, one per line)",
+      cxxopts::value<bool>()->default_value("false"))
+    ("q,query", "Print the number of leaves, nodes, depth and root fan-out",
+      cxxopts::value<bool>()->default_value("false"))
+    ("output", "Print only the first output of PORT, the other subtrees are "
+               "skipped", cxxopts::value<unsigned int>())
+    ("count-outputs", "Print the number of outputs without copying the "
+                      "subtrees", cxxopts::value<bool>()->default_value("false"))
+    ("c,compact", "Use the compact header layout",
+      cxxopts::value<bool>()->default_value("false"))
+    ("layout-report", "Compare the layouts on trees read from stdin",
+      cxxopts::value<bool>()->default_value("false"))
+    ("simulate", "Simulate the headers read from stdin in a topology file",
+      cxxopts::value<string>())
+    ("service-time", "Ticks a router needs to process a header",
+      cxxopts::value<unsigned int>()->default_value("1"))
+    ("queue-limit", "Maximal queue length of a router (0: no limit)",
+      cxxopts::value<size_t>()->default_value("0"))
+    ("deliveries", "Print every delivery of the simulation",
+      cxxopts::value<bool>()->default_value("false"))
+    ("threads", "Number of threads of the simulation, the optimizer, "
+                "the group table readers or the benchmark",
+      cxxopts::value<int>()->default_value("1"))
+    ("pipeline", "Process the headers of a trace read from stdin in "
+                 "pipelined threads and print their outputs",
+      cxxopts::value<bool>()->default_value("false"))
+    ("pipeline-depth", "Batches in flight in the pipeline",
+      cxxopts::value<int>()->default_value("16"))
+    ("save-trace", "Save the headers of a trace read from stdin in binary "
+                   "form (for trace)", cxxopts::value<string>())
+    ("trace", "Process the headers of a binary trace (memory mapped) "
+              "interleaved, with bench benchmark passes over it",
+      cxxopts::value<string>())
+    ("interleave", "Headers in flight of the trace processing",
+      cxxopts::value<int>()->default_value("8"))
+    ("shuffle", "Process the headers of the trace in a random order",
+      cxxopts::value<bool>()->default_value("false"))
+    ("config", "Read the virtual ports from a file, again on SIGHUP (with "
+               "serve, forward, shm, pipeline)",
+      cxxopts::value<string>())
+    ("delivery-set", "Print where the headers read from stdin are delivered "
+                     "in a topology file",
+      cxxopts::value<string>())
+    ("compile", "Compile the headers of the groups read from stdin "
+                "in a topology file",
+      cxxopts::value<string>())
+    ("group-table", "Serve the sends of the groups read from stdin "
+                    "from a group table of a topology file",
+      cxxopts::value<string>())
+    ("link-failures", "Fail COUNT random links one by one in the group table "
+                      "and print the rebuild times",
+      cxxopts::value<int>())
+    ("optimize", "Search smaller trees than the shortest path trees "
+                 "for MS milliseconds per group (with compile)",
+      cxxopts::value<double>())
+    ("objective", "What the optimizer minimizes first (fragments, brackets)",
+      cxxopts::value<string>()->default_value("fragments"))
+    ("topology-info", "Load a topology file (text or binary) and print its "
+                      "memory per router",
+      cxxopts::value<string>())
+    ("save-topology", "Save the topology in binary (with topology-info)",
+      cxxopts::value<string>())
+    ("serve", "Serve process, generate and print requests on a Unix domain "
+              "socket",
+      cxxopts::value<string>())
+    ("forward", "Forward the UDP datagrams (header and payload) received on "
+                "an address (a.b.c.d:port)",
+      cxxopts::value<string>())
+    ("port-map", "UDP destinations of the output ports "
+                 "(PORT=a.b.c.d:port,...)",
+      cxxopts::value<string>())
+    ("batch", "Datagrams per system call of the forwarder, requests per "
+              "dequeue of the shared memory consumer, lines per batch of the "
+              "pipeline",
+      cxxopts::value<int>()->default_value("64"))
+    ("engine", "I/O engine of the forwarder (auto, mmsg, uring, "
+               "both: with bench)",
+      cxxopts::value<string>()->default_value("auto"))
+    ("report", "Print the forwarder stats every SECONDS (0: on exit only)",
+      cxxopts::value<double>()->default_value("0"))
+    ("payload", "Payload bytes of the forwarder benchmark packets",
+      cxxopts::value<int>()->default_value("64"))
+    ("queue-depth", "Outputs a port queue of the forwarder holds",
+      cxxopts::value<unsigned int>()->default_value("1024"))
+    ("drop-policy", "Drop policy of a full port queue (tail: the new output, "
+                    "head: the oldest one)",
+      cxxopts::value<string>()->default_value("tail"))
+    ("quantum", "Bytes a port of the forwarder sends per round",
+      cxxopts::value<unsigned int>()->default_value("1500"))
+    ("shm", "Process the headers of other processes through shared memory "
+            "rings in a file (in /dev/shm)",
+      cxxopts::value<string>())
+    ("ring-size", "Request slots of the shared memory ring",
+      cxxopts::value<unsigned int>()->default_value("4096"))
+    ("producers", "Producers of the shared memory ring",
+      cxxopts::value<unsigned int>()->default_value("8"))
+    ("max-outputs", "Outputs a result of the shared memory ring holds",
+      cxxopts::value<unsigned int>()->default_value("64"))
+    ("busy-poll", "Spin instead of sleeping on a futex (with shm)",
+      cxxopts::value<bool>()->default_value("false"))
+    ("header-size", "Header size in bits (256, 512, 1024, 2048, 4096)",
+      cxxopts::value<int>()->default_value("256"))
+    ("port-size", "Port number size in bits (4, 8, 16)",
+      cxxopts::value<int>()->default_value("4"))
+    ("bench", "Process the header COUNT times and print the throughput "
+              "(with trace: COUNT passes over the trace)",
+      cxxopts::value<long long>())
+    ("help", "Print usage")
+    ;
+
+  auto opts = options.parse(argc, argv);
+
+  if (opts.count("help"))
+  {
+    std::cout << options.help() << std::endl;
+     exit(0);
+  }
+
+  int headerSize = opts["header-size"].as<int>();
+
+  switch(headerSize)
+  {
+  case 256:  return runWithPortSize<256>(opts);
+  case 512:  return runWithPortSize<512>(opts);
+  case 1024: return runWithPortSize<1024>(opts);
+  case 2048: return runWithPortSize<2048>(opts);
+  case 4096: return runWithPortSize<4096>(opts);
+  }
+
+  throw cxxopts::OptionException(
+      "Unsupported header size: " + to_string(headerSize) +
+      " (256, 512, 1024, 2048, 4096)");
+}
@@ -10,20 +10,56 @@
 #ifndef PTBM_H
 #define PTBM_H
 
+#include <algorithm>
 #include <bitset>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <stdexcept>
 
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
 using namespace std;
 
+// A bitset of libstdc++ and libc++ is an array of words, bit 0 in word 0: on
+// a little endian machine its bytes are the binary form of a header
+#if (defined(__GLIBCXX__) || defined(_LIBCPP_VERSION)) && \
+    defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PTBM_BITSET_BYTES
+#endif
+
 namespace ptbm
 {
 
+/// The number of bits needed to store a value
+constexpr int
+bitWidth(unsigned int value)
+{
+  return value ? 1 + bitWidth(value >> 1) : 0;
+}
+
 // HEADER_SIZE  The size of the header in bits
 // PORT_SIZE    The size of the port numbers in bits
 // MAX_OPEN_BRACKETS  The maximal number of open brackets in the header
 // PORTS_START_AT     At which bit does the list of ports start
+//
+// Headers of 512..4096 bits and port numbers of up to 16 bits are supported,
+// see PtbmSized for a layout derived from HEADER_SIZE and PORT_SIZE.
+//
+// The compact layout (see setCompactLayout) stores the number of open brackets
+// first, so the numbers follow the brackets right away, and it can store the
+// port numbers of each tree level on fewer bits:
+//
+//   count (COUNT_BITS) | per level flag (1 bit)
+//   [ levels (COUNT_BITS) | width of each level (WIDTH_BITS each) ]
+//   brackets (2 * count bits) | port numbers
 template
   <int HEADER_SIZE=256,
    int PORT_SIZE=4,
@@ -32,8 +68,27 @@ template
 class Ptbm
 {
 
+static_assert(PORT_SIZE > 0 && PORT_SIZE <= 16,
+              "PORT_SIZE must be between 1 and 16 bits");
+static_assert(PORTS_START_AT + MAX_OPEN_BRACKETS * PORT_SIZE <= HEADER_SIZE,
+              "Port numbers do not fit in the header");
+
+// The number of 64 bit words of the bracket region
+static const int BRACKET_WORDS = (PORTS_START_AT + 63) / 64;
+
+// Bytes readable (and writable) after a header in binary form for the word
+// and 128 bit loads of the bracket search and the bit range copy
+static const int BYTES_PADDING = 32;
+
 public:
 
+typedef bitset<HEADER_SIZE> header_type;
+
+static const int PORT_BITS = PORT_SIZE;
+
+/// Bytes of a header in binary form (see headerToBytes)
+static const int HEADER_BYTES = (HEADER_SIZE + 7) / 8;
+
 Ptbm()
 {
   pbs = bitset<HEADER_SIZE>(0);
@@ -50,14 +105,77 @@ setHeaderBitset(string bits)
 void
 setHeader(string brackets, vector<unsigned int> nums)
 {
-  pbs = generateHeader(brackets, nums);
+  pbs = pcontext.compact() ?
+        generateCompactHeader(brackets, nums) :
+        generateHeader(brackets, nums);
+}
+
+/// Sets the header from bits (in bitset form)
+void
+setHeaderBits(const bitset<HEADER_SIZE> &bits)
+{
+  pbs = bits;
+}
+
+/// Writes a header in binary form: bit i is bit i%8 of byte i/8
+static void
+headerToBytes(const bitset<HEADER_SIZE> &bits, unsigned char *bytes)
+{
+#ifdef PTBM_BITSET_BYTES
+  if(sizeof(bits) == HEADER_BYTES)
+  {
+    memcpy(bytes, &bits, HEADER_BYTES);
+    return;
+  }
+#endif
+
+  bitset<HEADER_SIZE> rest = bits;
+  const bitset<HEADER_SIZE> low(~0ULL);
+
+  // 64 bits at a time from the lowest word, as in bracketWords
+  for(int i=0; i<HEADER_BYTES; i+=8, rest >>= 64)
+  {
+    uint64_t word = (rest & low).to_ullong();
+
+    for(int b=0; b<8 && i+b < HEADER_BYTES; b++)
+      bytes[i+b] = word >> 8*b;
+  }
+}
+
+/// Reads a header in binary form (see headerToBytes)
+static bitset<HEADER_SIZE>
+headerFromBytes(const unsigned char *bytes)
+{
+  bitset<HEADER_SIZE> bits;
+
+#ifdef PTBM_BITSET_BYTES
+  if(sizeof(bits) == HEADER_BYTES)
+  {
+    memcpy(&bits, bytes, HEADER_BYTES);
+    return bits;
+  }
+#endif
+
+  // 64 bits at a time from the highest word, each shifted up by the next
+  for(int i=(HEADER_BYTES-1)/8*8; i>=0; i-=8)
+  {
+    uint64_t word = 0;
+
+    for(int b=0; b<8 && i+b < HEADER_BYTES; b++)
+      word |= (uint64_t)bytes[i+b] << 8*b;
+
+    bits <<= 64;
+    bits |= bitset<HEADER_SIZE>(word);
+  }
+
+  return bits;
 }
 
 /// Gets the header in string form (of brackets and port numbers)
 string
 getHeaderString()
 {
-  return headerToString(pbs);
+  return toString(pbs);
 }
 
 /// Returns the header in bitset form
@@ -71,7 +189,411 @@ getHeaderBits()
 void
 setVirtualPorts(vector<unsigned int> vports)
 {
-  pvports = vports;
+  pcontext = Context(move(vports), pcontext.compact());
+}
+
+/// Selects the compact layout (true) or the fixed layout (false, default)
+void
+setCompactLayout(bool compact)
+{
+  pcontext = Context(pcontext.virtualPorts(), compact);
+}
+
+// The configuration of a router (virtual ports and layout). It is not changed
+// after it was made, so any number of threads can process headers with the
+// same context.
+class Context
+{
+
+public:
+
+explicit Context(vector<unsigned int> virtualPorts = {}, bool compact = false)
+  : pvports(move(virtualPorts)), pcompact(compact)
+{
+}
+
+const vector<unsigned int> &
+virtualPorts() const
+{
+  return pvports;
+}
+
+bool
+compact() const
+{
+  return pcompact;
+}
+
+private:
+vector<unsigned int> pvports;
+bool pcompact;
+
+};
+
+// The outputs of a header, a thread reuses it from header to header
+struct Scratch
+{
+  vector<unsigned int> ports;
+  vector<bitset<HEADER_SIZE>> subtrees;
+};
+
+/// The context the header is processed with
+const Context &
+context() const
+{
+  return pcontext;
+}
+
+/// Processes a header as a router of a context into a scratch (replacing its
+/// outputs). It reads only its arguments, threads sharing a context need no
+/// synchronization.
+static void
+process(const Context &context, const bitset<HEADER_SIZE> &bs,
+        Scratch &scratch)
+{
+  scratch.ports.clear();
+  scratch.subtrees.clear();
+  process(context, bs, scratch.ports, scratch.subtrees);
+}
+
+/// Processes a header as a router of a context and appends the outputs
+static void
+process(
+    const Context &context,
+    const bitset<HEADER_SIZE> &bs,
+    vector<unsigned int> &portToSend,
+    vector<bitset<HEADER_SIZE>> &subtreesToSend)
+{
+  if(context.compact())
+    processCompactHeader(bs, context.virtualPorts(), portToSend,
+                         subtreesToSend);
+  else
+    processHeader(bs, context.virtualPorts(), portToSend, subtreesToSend);
+}
+
+// The outputs of a header, computed one at a time as the walk over the
+// bracket region reaches them, so the caller can stop at any output:
+//
+//   for(auto &output : P::outputs(context, header))
+//     if(output.port == port)
+//       break;
+//
+// nextPort() and find() jump over the subtrees they do not copy by the size
+// of the subtree (the excess table of the brackets). A skipped subtree is
+// checked only for its closing bracket, an error is thrown when the walk
+// reaches it (after the outputs before it). The compact layout has no such
+// jumps, its outputs are processed at once and handed out one by one. The
+// context must outlive the walk.
+class Outputs
+{
+
+public:
+
+struct Output
+{
+  unsigned int port;
+  bitset<HEADER_SIZE> subtree;
+};
+
+// An input iterator, the outputs it passed are gone
+class iterator
+{
+
+public:
+
+typedef input_iterator_tag iterator_category;
+typedef Output value_type;
+typedef ptrdiff_t difference_type;
+typedef const Output *pointer;
+typedef const Output &reference;
+
+explicit iterator(Outputs *outputs = nullptr)
+  : poutputs(outputs)
+{
+  ++*this;
+}
+
+const Output &
+operator*() const
+{
+  return poutput;
+}
+
+const Output *
+operator->() const
+{
+  return &poutput;
+}
+
+iterator &
+operator++()
+{
+  if(poutputs && !poutputs->next(poutput.port, poutput.subtree))
+    poutputs = nullptr;
+
+  return *this;
+}
+
+bool
+operator==(const iterator &other) const
+{
+  return poutputs == other.poutputs;
+}
+
+bool
+operator!=(const iterator &other) const
+{
+  return poutputs != other.poutputs;
+}
+
+private:
+Outputs *poutputs;
+Output poutput;
+
+};
+
+Outputs(const Context &context, const bitset<HEADER_SIZE> &bs)
+  : pcontext(&context), pbs(bs)
+{
+  if(context.compact())
+  {
+    process(context, bs, pscratch);
+    pbuffered = true;
+  }
+}
+
+/// Computes the next output, returns false after the last one
+bool
+next(unsigned int &port, bitset<HEADER_SIZE> &subtree)
+{
+  return advance(port, &subtree);
+}
+
+/// Skips to the port of the next output without copying its subtree
+bool
+nextPort(unsigned int &port)
+{
+  return advance(port, nullptr);
+}
+
+/// Skips to the next output of a port, returns false if there is none
+bool
+find(unsigned int port, bitset<HEADER_SIZE> &subtree)
+{
+  for(unsigned int curr; nextPort(curr);)
+    if(curr == port)
+    {
+      lastSubtree(subtree);
+      return true;
+    }
+
+  return false;
+}
+
+/// Counts the outputs left (and consumes them)
+size_t
+count()
+{
+  size_t outputs = 0;
+
+  for(unsigned int port; nextPort(port);)
+    ++outputs;
+
+  return outputs;
+}
+
+iterator
+begin()
+{
+  return iterator(this);
+}
+
+iterator
+end()
+{
+  return iterator();
+}
+
+private:
+const Context *pcontext;
+bitset<HEADER_SIZE> pbs;
+Scratch pscratch;               // The outputs of the compact layout
+size_t pindex = 0;
+bool pbuffered = false;
+bool pstarted = false;
+bool pdone = false;
+bool pinVirtual = false;        // Between the children of a virtual port
+unsigned int pvirtual = 0;
+int pbracketPos = 0;
+int pnumPos = PORTS_START_AT;
+int plastBracket = 0;           // After the port of the last output
+int plastNum = 0;
+bool pwords = false;            // The bracket words are set (on the 1st jump)
+uint64_t pbracketWords[BRACKET_WORDS];
+
+/// The next output, its subtree is copied only if subtree is not null
+bool
+advance(unsigned int &port, bitset<HEADER_SIZE> *subtree)
+{
+  if(pbuffered)
+  {
+    if(pindex == pscratch.ports.size())
+      return false;
+
+    port = pscratch.ports[pindex];
+    if(subtree)
+      *subtree = pscratch.subtrees[pindex];
+    ++pindex;
+    return true;
+  }
+
+  if(pdone)
+    return false;
+
+  if(!pstarted)
+  {
+    pstarted = true;
+
+    if(!pbs[0])
+    {
+      // It is for me
+      pdone = true;
+      port = 0;
+      plastBracket = -1;
+      if(subtree)
+        subtree->reset();
+      return true;
+    }
+  }
+
+  while(!pinVirtual)
+  {
+    if(!pbs[pbracketPos])
+    {
+      pdone = true;
+      return false;
+    }
+
+    if(pbracketPos >= PORTS_START_AT)
+      throw runtime_error("bracketPos >= PORTS_START_AT");
+
+    // (
+    unsigned int currPort = readInt(pbs, pnumPos);
+    ++pbracketPos;
+    pnumPos += PORT_SIZE;
+
+    const vector<unsigned int> &virtualPorts = pcontext->virtualPorts();
+
+    if(any_of(virtualPorts.begin(), virtualPorts.end(), compare(currPort)))
+    {
+      if(!pbs[pbracketPos])
+        throw runtime_error(
+            "Virtual port " + to_string(currPort) +
+            " has no child at " + to_string(pbracketPos+1));
+
+      pinVirtual = true;
+      pvirtual = currPort;
+    }
+    else
+    {
+      port = currPort;
+      return emit(subtree);
+    }
+  }
+
+  if(pbracketPos<PORTS_START_AT && pbs[pbracketPos])  // (
+  {
+    // +1 is mandatory because min(realPort) must be > max(normal port number)
+    unsigned long long realPort =
+        readInt(pbs, pnumPos) + (pvirtual+1ULL) * (1ULL<<PORT_SIZE);
+
+    if(realPort > UINT_MAX)
+      throw runtime_error(
+          "Virtual port " + to_string(pvirtual) + " out of range");
+
+    ++pbracketPos;
+    pnumPos += PORT_SIZE;
+    port = (unsigned int)realPort;
+    return emit(subtree);
+  }
+
+  // The closing bracket of the virtual port
+  pinVirtual = false;
+  ++pbracketPos;
+  return advance(port, subtree);
+}
+
+/// Copies or skips the subtree of the output at the position
+bool
+emit(bitset<HEADER_SIZE> *subtree)
+{
+  plastBracket = pbracketPos;
+  plastNum = pnumPos;
+
+  if(subtree)
+    copyRealSubtree(pbs, pbracketPos, pnumPos, *subtree);
+  else
+  {
+    if(!pwords)
+    {
+      bracketWords(pbs, pbracketWords);
+      pwords = true;
+    }
+
+    skipRealSubtree(pbracketWords, pbracketPos, pnumPos);
+  }
+
+  return true;
+}
+
+/// Copies the subtree of the last output (passed by nextPort)
+void
+lastSubtree(bitset<HEADER_SIZE> &subtree) const
+{
+  if(pbuffered)
+    subtree = pscratch.subtrees[pindex-1];
+  else if(plastBracket < 0)
+    subtree.reset();    // It is for me
+  else
+  {
+    int bracketPos = plastBracket, numPos = plastNum;
+    copyRealSubtree(pbs, bracketPos, numPos, subtree);
+  }
+}
+
+};
+
+/// A lazy walk over the outputs of a header processed as a router of a
+/// context (see Outputs)
+static Outputs
+outputs(const Context &context, const bitset<HEADER_SIZE> &bs)
+{
+  return Outputs(context, bs);
+}
+
+/// Returns the number of bits the fixed layout needs for a tree
+int
+fixedHeaderSize(int openBrackets)
+{
+  return PORTS_START_AT + openBrackets * PORT_SIZE;
+}
+
+/// Returns the maximal number of open brackets of a fixed layout header
+int
+maxOpenBrackets()
+{
+  return FRAGMENT_CAPACITY;
+}
+
+/// Returns the number of bits the compact layout needs for a tree
+int
+compactHeaderSize(string brackets, vector<unsigned int> nums)
+{
+  Tree tree = parseTree(brackets, nums);
+  vector<int> widths;
+  bool perLevel;
+
+  return compactLayoutSize(tree, widths, perLevel);
 }
 
 /// Process the header as a router and call procFunc for each port output
@@ -81,146 +603,1070 @@ procHeader(void (*procFunc)(string))
   vector<unsigned int> portToSend;
   vector<bitset<HEADER_SIZE>> subtreesToSend;
 
-  processHeader(pbs, pvports, portToSend, subtreesToSend);
+  procHeaderBits(portToSend, subtreesToSend);
 
   int cntPorts = portToSend.size();
 
   for(int n=0; n<cntPorts; n++)
   {
-    string strHeader = headerToString(subtreesToSend[n]);
+    string strHeader = toString(subtreesToSend[n]);
     procFunc(to_string(portToSend[n]) + " " +       // Output port
              (strHeader.size() ? strHeader : "*")); // Subtree to send
   }
 }
 
-private:
-bitset<HEADER_SIZE> pbs;
-vector<unsigned int> pvports = {};
+/// Process the header as a router and collect the outputs in bitset form
+void
+procHeaderBits(
+    vector<unsigned int> &portToSend,
+    vector<bitset<HEADER_SIZE>> &subtreesToSend)
+{
+  process(pcontext, pbs, portToSend, subtreesToSend);
+}
 
-struct compare
+/// Inserts a tree (brackets and port numbers) as the childIndex-th child of a
+/// node (preorder index of its open bracket, -1 for the root level)
+void
+graftSubtree(
+    int parent,
+    int childIndex,
+    string brackets,
+    vector<unsigned int> nums)
 {
-        int key;
-        compare(int const &i): key(i) { }
+  checkFixedLayout();
 
-        bool operator()(int const &i)
-        {
-                return (i == key);
-        }
-};
+  Tree tree = parseTree(brackets, nums);
+  int k = tree.ports.size();
+  int total = (pbs & rangeMask(0, PORTS_START_AT)).count();
 
-/// Reads a number from a position in a bitset
-unsigned int
-readInt(bitset<HEADER_SIZE> &bs, size_t pos)
-{
-  unsigned int res=0, bm = 0;
-  bool bit;
+  if(total + k > MAX_OPEN_BRACKETS || 2 * (total + k) > PORTS_START_AT)
+    throw runtime_error("Too many open brackets, header limit overflow");
 
-  for(size_t i=0; i<PORT_SIZE; i++)
+  for(unsigned int num : nums)
+    if(num > (1u<<PORT_SIZE)-1)
+      throw runtime_error(
+          "Number out of range: "
+          + to_string(num) + " cannot fit in "
+          + to_string(PORT_SIZE) + " bits");
+
+  // Skip the first childIndex children of the parent
+  int pos = parent < 0 ? 0 : openBracketPos(pbs, parent) + 1;
+
+  for(int i=0; i<childIndex; i++)
   {
-    bit = bs[pos+i];
-    res += bit ? 1<<bm : 0;
-    ++bm;
+    if(pos >= PORTS_START_AT || !pbs[pos])
+      throw runtime_error("Child index out of range: " + to_string(childIndex));
+    pos = closeBracketPos(pbs, pos) + 1;
   }
-  return res;
+
+  int ordinal = (pbs & rangeMask(0, pos)).count();
+  bitset<HEADER_SIZE> bs = pbs;
+
+  openGap(bs, pos, PORTS_START_AT, 2 * k);
+  for(int i=0; i<2*k; i++)
+    bs[pos + i] = brackets[i] == '(';
+
+  int numPos = PORTS_START_AT + ordinal * PORT_SIZE;
+
+  openGap(bs, numPos, HEADER_SIZE, k * PORT_SIZE);
+  for(int i=0; i<k; i++, numPos += PORT_SIZE)
+    setBits(bs, numPos, nums[i]);
+
+  pbs = bs;
+}
+
+/// Removes the subtree of a node (preorder index of its open bracket)
+void
+pruneSubtree(int node)
+{
+  checkFixedLayout();
+
+  int pos = openBracketPos(pbs, node);
+  int k = (closeBracketPos(pbs, pos) - pos + 1) / 2;
+
+  closeGap(pbs, pos, PORTS_START_AT, 2 * k);
+  closeGap(pbs, PORTS_START_AT + node * PORT_SIZE, HEADER_SIZE, k * PORT_SIZE);
+}
+
+/// Rewrites the port number of a node (preorder index of its open bracket)
+void
+setPort(int node, unsigned int port)
+{
+  checkFixedLayout();
+
+  openBracketPos(pbs, node);
+  setBits(pbs, PORTS_START_AT + node * PORT_SIZE, port);
+}
+
+/// Returns the number of destinations (leaves) of the header
+int
+leafCount()
+{
+  checkFixedLayout();
+
+  bitset<HEADER_SIZE> br = pbs & rangeMask(0, PORTS_START_AT);
+  return (br & ~(br >> 1)).count();   // ( followed by )
+}
+
+/// Returns the number of nodes (open brackets) of the header
+int
+nodeCount()
+{
+  checkFixedLayout();
+
+  return (pbs & rangeMask(0, PORTS_START_AT)).count();
+}
+
+/// Returns the depth of the deepest node of the header (0: empty header)
+int
+maxDepth()
+{
+  checkFixedLayout();
+
+  const ExcessTable &table = excessTable();
+  uint64_t words[BRACKET_WORDS];
+  int excess = 0, depth = 0;
+
+  bracketWords(pbs, words);
+
+  for(int i=0; i<BRACKET_WORDS * 8; i++)
+  {
+    unsigned char byte = words[i / 8] >> (i % 8 * 8);
+    depth = max(depth, excess + table.maxPrefix[byte]);
+    excess += table.total[byte];
+  }
+
+  return depth;
+}
+
+/// Returns the number of subtrees at the root level of the header
+int
+rootFanout()
+{
+  checkFixedLayout();
+
+  const ExcessTable &table = excessTable();
+  uint64_t words[BRACKET_WORDS];
+  int excess = 0, fanout = 0;
+
+  bracketWords(pbs, words);
+
+  for(int i=0; i<BRACKET_WORDS * 8; i++)
+  {
+    unsigned char byte = words[i / 8] >> (i % 8 * 8);
+
+    // Count the closing brackets of root subtrees (excess drops to 0)
+    if(excess + table.minPrefix[byte] <= 0)
+      for(int bit=0; bit<8; bit++)
+      {
+        bool open = byte >> bit & 1;
+        excess += open ? 1 : -1;
+        fanout += !open && !excess;
+      }
+    else
+      excess += table.total[byte];
+  }
+
+  return fanout;
+}
+
+/// Returns the number of nodes in the subtree of a node (preorder index)
+int
+subtreeSize(int node)
+{
+  checkFixedLayout();
+
+  int pos = openBracketPos(pbs, node);
+  return (closeBracketPos(pbs, pos) - pos + 1) / 2;
+}
+
+/// Collects the routers (indexes of a Topology) a header injected at a router
+/// is delivered to, without processing it router by router. Returns the
+/// number of subtrees sent on ports without a neighbor.
+template<class Topology>
+long long
+deliverySet(
+    const bitset<HEADER_SIZE> &bs,
+    int router,
+    const Topology &topology,
+    vector<int> &deliveries)
+{
+  WalkLayout layout;
+  CompactLayout compact;
+
+  if(pcontext.compact())
+  {
+    compact = readCompactLayout(bs);
+    layout = {compact.bracketsAt, compact.numbersAt, compact.numbersAt,
+              &compact};
+  }
+  else
+    layout = {0, PORTS_START_AT, PORTS_START_AT, nullptr};
+
+  int bracketPos = layout.bracketsAt;
+  int numPos = layout.numbersAt;
+  long long dropped = 0;
+
+  walkForest(bs, layout, 0, bracketPos, numPos, router, topology,
+             deliveries, dropped);
+
+  if(pcontext.compact() && bracketPos < layout.bracketsEnd)
+    throw runtime_error("Closing bracket without open bracket: "
+                        + to_string(bracketPos+1));
+
+  return dropped;
+}
+
+/// Splits a tree (brackets and port numbers) into few headers (first fit
+/// decreasing) which together deliver to the same leaves (fixed layout)
+vector<bitset<HEADER_SIZE>>
+fragmentHeader(string brackets, vector<unsigned int> nums)
+{
+  Tree tree = parseTree(brackets, nums);
+  int n = tree.ports.size();
+  vector<bitset<HEADER_SIZE>> fragments;
+
+  if(n <= FRAGMENT_CAPACITY)
+  {
+    fragments.push_back(generateHeader(brackets, nums));
+    return fragments;
+  }
+
+  // Subtrees which fit in a header (prefixed by the path of their parents)
+  vector<vector<int>> items;
+  vector<int> path;
+  vector<int> roots;
+
+  for(int i=0; i<n; i = tree.ends[i])
+    roots.push_back(i);
+
+  splitForest(tree, roots, path, items);
+
+  // First fit decreasing, shared parents are counted once per header
+  stable_sort(items.begin(), items.end(),
+              [](const vector<int> &a, const vector<int> &b)
+              { return a.size() > b.size(); });
+
+  vector<vector<bool>> bins;
+  vector<int> binSizes;
+
+  for(const vector<int> &item : items)
+  {
+    size_t b = 0;
+
+    for(; b<bins.size(); b++)
+    {
+      int added = 0;
+      for(int node : item)
+        if(!bins[b][node])
+          ++added;
+
+      if(binSizes[b] + added <= FRAGMENT_CAPACITY)
+        break;
+    }
+
+    if(b == bins.size())
+    {
+      bins.push_back(vector<bool>(n, false));
+      binSizes.push_back(0);
+    }
+
+    for(int node : item)
+      if(!bins[b][node])
+      {
+        bins[b][node] = true;
+        ++binSizes[b];
+      }
+  }
+
+  for(const vector<bool> &bin : bins)
+    fragments.push_back(generateFragment(tree, bin));
+
+  return fragments;
+}
+
+/// Checks that the fragments deliver to every leaf of the tree exactly once
+bool
+verifyFragments(
+    string brackets,
+    vector<unsigned int> nums,
+    const vector<bitset<HEADER_SIZE>> &fragments)
+{
+  vector<vector<unsigned int>> expected = leafPaths(parseTree(brackets, nums));
+  vector<vector<unsigned int>> delivered;
+
+  for(const bitset<HEADER_SIZE> &fragment : fragments)
+  {
+    string text = headerToString(fragment);
+    string::size_type sep = text.find(' ');
+    vector<unsigned int> fragmentNums;
+
+    if(sep != string::npos)
+    {
+      stringstream ss(text.substr(sep+1));
+      for(unsigned int num; ss >> num;)
+      {
+        fragmentNums.push_back(num);
+        if(ss.peek() == ',')
+          ss.ignore();
+      }
+    }
+
+    vector<vector<unsigned int>> paths =
+        leafPaths(parseTree(text.substr(0, sep), fragmentNums));
+    delivered.insert(delivered.end(), paths.begin(), paths.end());
+  }
+
+  sort(expected.begin(), expected.end());
+  sort(delivered.begin(), delivered.end());
+
+  return expected == delivered;
+}
+
+private:
+bitset<HEADER_SIZE> pbs;
+Context pcontext;
+
+// Field sizes of the compact layout
+static const int COUNT_BITS = bitWidth(HEADER_SIZE / 2);
+static const int WIDTH_BITS = bitWidth(PORT_SIZE);
+
+/// Excess (open minus closing brackets) of the bytes of the bracket region
+struct ExcessTable
+{
+  signed char total[256];
+  signed char minPrefix[256];
+  signed char maxPrefix[256];
+
+  ExcessTable()
+  {
+    for(int byte=0; byte<256; byte++)
+    {
+      int excess = 0, lo = 8, hi = -8;
+
+      for(int bit=0; bit<8; bit++)
+      {
+        excess += byte >> bit & 1 ? 1 : -1;
+        lo = min(lo, excess);
+        hi = max(hi, excess);
+      }
+
+      total[byte] = excess;
+      minPrefix[byte] = lo;
+      maxPrefix[byte] = hi;
+    }
+  }
+};
+
+static const ExcessTable &
+excessTable()
+{
+  static const ExcessTable table;
+  return table;
+}
+
+/// The fields in front of the brackets of a compact header
+struct CompactLayout
+{
+  int count;
+  bool perLevel;
+  vector<int> widths;     // Port number size of each level (if perLevel)
+  int bracketsAt;
+  int numbersAt;
+};
+
+// The maximal number of nodes in a header (limited by the bracket bits too)
+static const int FRAGMENT_CAPACITY =
+    MAX_OPEN_BRACKETS < PORTS_START_AT/2 ? MAX_OPEN_BRACKETS : PORTS_START_AT/2;
+
+/// The multicast tree in textual form, nodes in preorder
+struct Tree
+{
+  vector<unsigned int> ports;
+  vector<int> parents;
+  vector<int> ends;       // Index after the last node of the subtree
+};
+
+struct compare
+{
+        int key;
+        compare(int const &i): key(i) { }
+
+        bool operator()(int const &i)
+        {
+                return (i == key);
+        }
+};
+
+/// Reads a number from a position in a bitset
+static unsigned int
+readInt(const bitset<HEADER_SIZE> &bs, size_t pos)
+{
+  unsigned int res = 0;
+
+  if(pos + PORT_SIZE > HEADER_SIZE)
+    throw runtime_error("Port number out of the header: " + to_string(pos+1));
+
+  for(size_t i=0; i<PORT_SIZE; i++)
+    if(bs[pos+i])
+      res |= 1u << i;
+
+  return res;
+}
+
+/// Sets bits of a number from a position in a bitset
+static void
+setBits(bitset<HEADER_SIZE> &bs, size_t pos, unsigned int num)
+{
+  if(num > (1u<<PORT_SIZE)-1 )
+    throw runtime_error(
+        "Number out of range: "
+        + to_string(num) + " cannot fit in "
+        + to_string(PORT_SIZE) + " bits");
+
+  if(pos + PORT_SIZE > HEADER_SIZE)
+    throw runtime_error("Port number out of the header: " + to_string(pos+1));
+
+  for(size_t i=0; i<PORT_SIZE; i++)
+  {
+    bs[pos+i] = num%2;
+    num /= 2;
+  }
+}
+
+// Gets bitset from the textual form (brackets and ports numbers) of the header
+bitset<HEADER_SIZE>
+generateHeader(string br, vector<unsigned int> nums)
+{
+  bitset<HEADER_SIZE> bs(0); // just for safety, default: initialize to zero
+  int totalOpenBrackets = 0;
+
+  if(br.size() > PORTS_START_AT)
+    throw runtime_error("Too many brackets, header limit overflow");
+
+  for(string::size_type i = 0; i < br.size(); i++)
+  {
+    if(br[i]=='(')
+    {
+      bs[i] = true;
+      ++totalOpenBrackets;
+    }
+    else if (br[i]!=')')
+      throw runtime_error("Invalid bracket: " + to_string(br[i]));
+  }
+
+  if(totalOpenBrackets>MAX_OPEN_BRACKETS)
+    throw runtime_error("Too many open brackets, header limit overflow");
+
+  if(totalOpenBrackets!=(int)nums.size())
+    throw runtime_error("Number of open brackets != Number of numbers");
+
+  for(int pos=PORTS_START_AT, i=0; i<totalOpenBrackets; i++, pos+=PORT_SIZE)
+    setBits(bs, pos, nums[i]);
+
+  return bs;
+}
+
+void
+checkFixedLayout()
+{
+  if(pcontext.compact())
+    throw runtime_error("Header editing needs the fixed layout");
+}
+
+/// Gets a bitset with the bits [from, to) set
+static bitset<HEADER_SIZE>
+rangeMask(int from, int to)
+{
+  bitset<HEADER_SIZE> mask;
+
+  if(from >= to)
+    return mask;
+
+  mask.set();
+  mask >>= HEADER_SIZE - (to - from);
+  mask <<= from;
+  return mask;
+}
+
+/// Moves the bits [at, end) up by size, the bits [at, at+size) are cleared
+void
+openGap(bitset<HEADER_SIZE> &bs, int at, int end, int size)
+{
+  bitset<HEADER_SIZE> mask = rangeMask(at, end);
+  bitset<HEADER_SIZE> moved = (bs & mask) << size;
+
+  bs = (bs & ~mask) | (moved & mask);
+}
+
+/// Moves the bits [at+size, end) down by size, the bits to end are cleared
+void
+closeGap(bitset<HEADER_SIZE> &bs, int at, int end, int size)
+{
+  bitset<HEADER_SIZE> mask = rangeMask(at, end);
+  bitset<HEADER_SIZE> moved = (bs & rangeMask(at + size, end)) >> size;
+
+  bs = (bs & ~mask) | moved;
+}
+
+/// Copies the bracket region into 64 bit words (bit 0 of word 0 first)
+static void
+bracketWords(const bitset<HEADER_SIZE> &bs, uint64_t words[BRACKET_WORDS])
+{
+  bitset<HEADER_SIZE> rest = bs & rangeMask(0, PORTS_START_AT);
+  const bitset<HEADER_SIZE> low(~0ULL);
+
+  for(int w=0; w<BRACKET_WORDS; w++, rest >>= 64)
+    words[w] = (rest & low).to_ullong();
+}
+
+/// Gets the position of the open bracket of a node (preorder index)
+int
+openBracketPos(const bitset<HEADER_SIZE> &bs, int node)
+{
+  uint64_t words[BRACKET_WORDS];
+  int skip = node;
+
+  bracketWords(bs, words);
+
+  for(int w=0; node>=0 && w<BRACKET_WORDS; w++)
+  {
+    int ones = bitset<64>(words[w]).count();
+
+    if(skip >= ones)
+    {
+      skip -= ones;
+      continue;
+    }
+
+    for(int bit=0;; bit++)
+      if(words[w] >> bit & 1 && !skip--)
+        return w * 64 + bit;
+  }
+
+  throw runtime_error("No node " + to_string(node) + " in the header");
+}
+
+/// Gets the position of the closing bracket of an open bracket
+static int
+closeBracketPos(const bitset<HEADER_SIZE> &bs, int pos)
+{
+  uint64_t words[BRACKET_WORDS];
+
+  bracketWords(bs, words);
+  return closeBracketPos(words, pos);
+}
+
+/// Gets the position of the closing bracket of an open bracket in the words
+/// of a bracket region (see bracketWords)
+static int
+closeBracketPos(const uint64_t words[BRACKET_WORDS], int pos)
+{
+  unsigned char bytes[BRACKET_WORDS * 8 + BYTES_PADDING] = {};
+
+  for(int i=0; i<BRACKET_WORDS * 8; i++)
+    bytes[i] = words[i / 8] >> (i % 8 * 8);
+
+  return closeBracketPos(bytes, pos);
+}
+
+/// Gets the position of the closing bracket of an open bracket in a header
+/// in binary form (BYTES_PADDING bytes readable after it)
+static int
+closeBracketPos(const unsigned char *bytes, int pos)
+{
+  const ExcessTable &table = excessTable();
+  int excess = 0;
+
+  // Bit by bit to the next byte, then skip the bytes not closing the subtree
+  // (the port bits of the last byte can not close it before its brackets)
+  for(; pos<PORTS_START_AT; pos++)
+  {
+    if(pos % 8 == 0)
+    {
+#ifdef __wasm_simd128__
+      skipBracketBytes(bytes, pos, excess);
+
+      if(pos >= PORTS_START_AT)
+        break;
+#endif
+
+      unsigned char byte = bytes[pos / 8];
+
+      if(excess + table.minPrefix[byte] > 0)
+      {
+        excess += table.total[byte];
+        pos += 7;
+        continue;
+      }
+    }
+
+    excess += bytes[pos / 8] >> (pos % 8) & 1 ? 1 : -1;
+
+    if(!excess)
+      return pos;
+  }
+
+  throw runtime_error("Subtree has no closing bracket");
+}
+
+#ifdef __wasm_simd128__
+/// Skips the bytes of the bracket region from a byte position, 16 at a time,
+/// up to the first byte the excess may reach 0 in (the excess of a byte is
+/// the one of its nibbles, looked up by a swizzle)
+static void
+skipBracketBytes(const unsigned char *bytes, int &pos, int &excess)
+{
+  const v128_t nibbleTotal =
+      wasm_i8x16_make(-4, -2, -2, 0, -2, 0, 0, 2, -2, 0, 0, 2, 0, 2, 2, 4);
+  const v128_t nibbleMin =
+      wasm_i8x16_make(-4, -2, -2, 0, -2, 0, -1, 1, -3, -1, -1, 1, -2, 0, -1, 1);
+  const v128_t zero = wasm_i8x16_splat(0);
+
+  for(; pos<PORTS_START_AT; pos+=128)
+  {
+    v128_t chunk = wasm_v128_load(bytes + pos / 8);
+    v128_t low = wasm_v128_and(chunk, wasm_i8x16_splat(15));
+    v128_t high = wasm_u8x16_shr(chunk, 4);
+    v128_t lowTotal = wasm_i8x16_swizzle(nibbleTotal, low);
+    v128_t total =
+        wasm_i8x16_add(lowTotal, wasm_i8x16_swizzle(nibbleTotal, high));
+    v128_t minPrefix = wasm_i8x16_min(
+        wasm_i8x16_swizzle(nibbleMin, low),
+        wasm_i8x16_add(lowTotal, wasm_i8x16_swizzle(nibbleMin, high)));
+
+    // The excess in front of each byte, the sum of the ones before it (at
+    // most 120 away from 0)
+    v128_t before = wasm_i8x16_shuffle(zero, total,
+        0, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30);
+    before = wasm_i8x16_add(before, wasm_i8x16_shuffle(zero, before,
+        0, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30));
+    before = wasm_i8x16_add(before, wasm_i8x16_shuffle(zero, before,
+        0, 1, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29));
+    before = wasm_i8x16_add(before, wasm_i8x16_shuffle(zero, before,
+        0, 1, 2, 3, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27));
+    before = wasm_i8x16_add(before, wasm_i8x16_shuffle(zero, before,
+        0, 1, 2, 3, 4, 5, 6, 7, 16, 17, 18, 19, 20, 21, 22, 23));
+
+    // 128 bits can not close more than 128 open brackets
+    if(excess <= 128)
+    {
+      int reach = wasm_i8x16_bitmask(wasm_i8x16_le(
+          wasm_i8x16_add(before, minPrefix), wasm_i8x16_splat(-excess)));
+
+      if(reach)
+      {
+        signed char lanes[16];
+        int lane = __builtin_ctz(reach);
+
+        wasm_v128_store(lanes, before);
+        excess += lanes[lane];
+        pos += lane * 8;
+        return;
+      }
+    }
+
+    excess += wasm_i8x16_extract_lane(before, 15) +
+              wasm_i8x16_extract_lane(total, 15);
+  }
+}
+#endif
+
+/// Reads 64 bits of a header in binary form
+static uint64_t
+loadWord(const unsigned char *bytes)
+{
+  uint64_t word = 0;
+
+  for(int i=7; i>=0; i--)
+    word = word << 8 | bytes[i];
+
+  return word;
+}
+
+/// Writes 64 bits of a header in binary form
+static void
+storeWord(unsigned char *bytes, uint64_t word)
+{
+  for(int i=0; i<8; i++)
+    bytes[i] = word >> 8*i;
+}
+
+/// Copies count bits from a position of a header in binary form to a
+/// position of another one (cleared there), both with BYTES_PADDING bytes
+/// after them. The source position must be at least the position of the
+/// destination in its byte.
+static void
+copyBitRange(
+    const unsigned char *from,
+    int fromPos,
+    unsigned char *to,
+    int toPos,
+    int count)
+{
+  int end = toPos + count;
+
+  if(count <= 0)
+    return;
+
+#ifdef __wasm_simd128__
+  // 16 bytes of the destination at a time, the bits of a byte from lo to hi
+  // kept by the masks of their low bits
+  const v128_t lowBits =
+      wasm_u8x16_make(0, 1, 3, 7, 15, 31, 63, 127, 255, 0, 0, 0, 0, 0, 0, 0);
+  const v128_t lanes = wasm_u8x16_make(
+      0, 8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120);
+  const v128_t eight = wasm_u8x16_splat(8);
+
+  for(int bit=toPos & ~7; bit<end; bit+=128)
+  {
+    int src = fromPos + bit - toPos;
+    int shift = src % 8;
+    v128_t chunk = wasm_v128_load(from + src / 8);
+
+    if(shift)
+      chunk = wasm_v128_or(
+          wasm_u8x16_shr(chunk, shift),
+          wasm_i8x16_shl(wasm_v128_load(from + src / 8 + 1), 8 - shift));
+
+    v128_t lo = wasm_u8x16_min(eight, wasm_u8x16_sub_sat(
+        wasm_u8x16_splat(max(toPos - bit, 0)), lanes));
+    v128_t hi = wasm_u8x16_min(eight, wasm_u8x16_sub_sat(
+        wasm_u8x16_splat(min(end - bit, 128)), lanes));
+    v128_t mask = wasm_v128_andnot(wasm_i8x16_swizzle(lowBits, hi),
+                                   wasm_i8x16_swizzle(lowBits, lo));
+
+    wasm_v128_store(to + bit / 8, wasm_v128_or(
+        wasm_v128_load(to + bit / 8), wasm_v128_and(chunk, mask)));
+  }
+#else
+  // 7 bytes of the destination at a time, from a shifted word of the source
+  for(int bit=toPos & ~7; bit<end; bit+=56)
+  {
+    int src = fromPos + bit - toPos;
+    int lo = max(toPos - bit, 0), hi = min(end - bit, 56);
+    uint64_t chunk = loadWord(from + src / 8) >> (src % 8);
+
+    chunk &= (1ULL << hi) - (1ULL << lo);
+    storeWord(to + bit / 8, loadWord(to + bit / 8) | chunk);
+  }
+#endif
+}
+
+/// Throws if the port numbers of count open brackets from a position run out
+/// of the header, at the first one out
+static void
+checkPortNumbers(int pos, int count)
+{
+  if(!count || pos + count * PORT_SIZE <= HEADER_SIZE)
+    return;
+
+  int fit = pos + PORT_SIZE > HEADER_SIZE ? 0 :
+            (HEADER_SIZE - pos - PORT_SIZE) / PORT_SIZE + 1;
+  int first = pos + fit * PORT_SIZE;
+
+  throw runtime_error("Port number out of the header: " + to_string(first+1));
+}
+
+/// Gets the tree from the textual form (brackets and ports numbers)
+Tree
+parseTree(const string &br, const vector<unsigned int> &nums)
+{
+  Tree tree;
+  vector<int> open;
+
+  for(string::size_type i = 0; i < br.size(); i++)
+  {
+    if(br[i]=='(')
+    {
+      if(tree.ports.size() >= nums.size())
+        throw runtime_error("Number of open brackets != Number of numbers");
+
+      tree.parents.push_back(open.empty() ? -1 : open.back());
+      tree.ports.push_back(nums[tree.ports.size()]);
+      tree.ends.push_back(0);
+      open.push_back(tree.ports.size()-1);
+    }
+    else if(br[i]==')')
+    {
+      if(open.empty())
+        throw runtime_error("Closing bracket without open bracket: "
+                            + to_string(i+1));
+      tree.ends[open.back()] = tree.ports.size();
+      open.pop_back();
+    }
+    else
+      throw runtime_error("Invalid bracket: " + to_string(br[i]));
+  }
+
+  if(!open.empty())
+    throw runtime_error("Not all brackets have been closed (after all)");
+
+  if(tree.ports.size() != nums.size())
+    throw runtime_error("Number of open brackets != Number of numbers");
+
+  return tree;
+}
+
+/// Gets the port numbers from the root to each leaf of the tree
+vector<vector<unsigned int>>
+leafPaths(const Tree &tree)
+{
+  vector<vector<unsigned int>> paths;
+  vector<unsigned int> path;
+  int n = tree.ports.size();
+
+  for(int i=0; i<n; i++)
+  {
+    int depth = 0;
+    for(int p = tree.parents[i]; p >= 0; p = tree.parents[p])
+      ++depth;
+
+    path.resize(depth);
+    path.push_back(tree.ports[i]);
+
+    if(tree.ends[i] == i+1)
+      paths.push_back(path);
+  }
+
+  return paths;
 }
 
-/// Sets bits of a number from a position in a bitset
+/// Splits the subtrees of a forest (below path) into items fitting a header
 void
-setBits(bitset<HEADER_SIZE> &bs, size_t pos, unsigned int num)
+splitForest(
+    const Tree &tree,
+    const vector<int> &roots,
+    vector<int> &path,
+    vector<vector<int>> &items)
 {
-  if(num > (1<<PORT_SIZE)-1 )
-    throw runtime_error(
-        "Number out of range: "
-        + to_string(num) + " cannot fit in "
-        + to_string(PORT_SIZE) + " bits");
+  int capacity = FRAGMENT_CAPACITY - path.size();
 
-  for(size_t i=0; i<PORT_SIZE; i++)
+  if(capacity <= 0)
+    throw runtime_error("Tree is too deep, header limit overflow");
+
+  for(int root : roots)
   {
-    bs[pos+i] = num%2;
-    num /= 2;
+    int end = tree.ends[root];
+
+    if(end - root <= capacity)
+    {
+      vector<int> item(path);
+      for(int i=root; i<end; i++)
+        item.push_back(i);
+      items.push_back(item);
+      continue;
+    }
+
+    vector<int> children;
+    for(int i=root+1; i<end; i = tree.ends[i])
+      children.push_back(i);
+
+    path.push_back(root);
+    splitForest(tree, children, path, items);
+    path.pop_back();
   }
 }
 
-// Gets bitset from the textual form (brackets and ports numbers) of the header
+/// Gets the header of the nodes of a tree selected by a fragment
 bitset<HEADER_SIZE>
-generateHeader(string br, vector<unsigned int> nums)
+generateFragment(const Tree &tree, const vector<bool> &selected)
 {
-  bitset<HEADER_SIZE> bs(0); // just for safety, default: initialize to zero
-  int totalOpenBrackets = 0;
+  string br;
+  vector<unsigned int> nums;
+  vector<int> open;
+  int n = tree.ports.size();
 
-  for(string::size_type i = 0; i < br.size(); i++)
+  for(int i=0; i<n; i++)
   {
-    if(br[i]=='(')
+    if(!selected[i])
+      continue;
+
+    while(!open.empty() && i >= tree.ends[open.back()])
     {
-      bs[i] = true;
-      ++totalOpenBrackets;
+      br.push_back(')');
+      open.pop_back();
     }
-    else if (br[i]!=')')
-      throw runtime_error("Invalid bracket: " + to_string(br[i]));
-  }
 
-  if(totalOpenBrackets>MAX_OPEN_BRACKETS)
-    throw runtime_error("Too many open brackets, header limit overflow");
-
-  if(totalOpenBrackets!=(int)nums.size())
-    throw runtime_error("Number of open brackets != Number of numbers");
+    br.push_back('(');
+    nums.push_back(tree.ports[i]);
+    open.push_back(i);
+  }
 
-  for(int pos=PORTS_START_AT, i=0; i<totalOpenBrackets; i++, pos+=PORT_SIZE)
-    setBits(bs, pos, nums[i]);
+  br.append(open.size(), ')');
 
-  return bs;
+  return generateHeader(br, nums);
 }
 
-/// Process a real subtree (no virtual port)
+// Where the brackets and the numbers are (and the level widths if compact)
+struct WalkLayout
+{
+  int bracketsAt;
+  int bracketsEnd;
+  int numbersAt;
+  const CompactLayout *compact;
+};
+
+/// Walks the subtrees of a forest (at level) received by a router (-1: the
+/// forest is dropped) and delivers an empty forest to the router
+template<class Topology>
 void
-processNextRealSubtree(
-    unsigned int port,
-    bitset<HEADER_SIZE> bs,
+walkForest(
+    const bitset<HEADER_SIZE> &bs,
+    const WalkLayout &layout,
+    int level,
     int &bracketPos,
     int &numPos,
-    vector<unsigned int> &portToSend,
-    vector<bitset<HEADER_SIZE>> &subtreesToSend)
+    int router,
+    const Topology &topology,
+    vector<int> &deliveries,
+    long long &dropped)
 {
-  int newBracketPos = 0;
-  int newNumPos = PORTS_START_AT;
-  bitset<HEADER_SIZE> newBitset(0);
+  if(bracketPos >= layout.bracketsEnd || !bs[bracketPos])
+  {
+    if(router >= 0)
+      deliveries.push_back(router);
+    return;
+  }
 
-  int currOpenBrackets = 1;
+  int width = layout.compact ? levelWidth(*layout.compact, level) : PORT_SIZE;
+  unsigned int delay;
 
-  for(;bracketPos<PORTS_START_AT; bracketPos++, newBracketPos++)
+  while(bracketPos < layout.bracketsEnd && bs[bracketPos])  // (
   {
-    if(bs[bracketPos])
+    unsigned int port = readField(bs, numPos, width);
+    ++bracketPos;
+    numPos += width;
+
+    if(router < 0 || !topology.isVirtualPort(router, port))
     {
-      // (
-      newBitset[newBracketPos] = 1;
-      setBits(newBitset, newNumPos, readInt(bs, numPos));
-      numPos += PORT_SIZE;
-      newNumPos += PORT_SIZE;
-      ++currOpenBrackets;
+      int neighbor = router >= 0 ? topology.neighbor(router, port, delay) : -1;
+      dropped += router >= 0 && neighbor < 0;
+
+      walkForest(bs, layout, level+1, bracketPos, numPos, neighbor, topology,
+                 deliveries, dropped);
     }
     else
     {
-      // )
-      if(!--currOpenBrackets)
-        break;
+      if(bracketPos >= layout.bracketsEnd || !bs[bracketPos])
+        throw runtime_error(
+            "Virtual port " + to_string(port) +
+            " has no child at " + to_string(bracketPos+1));
+
+      int pairWidth =
+          layout.compact ? levelWidth(*layout.compact, level+1) : PORT_SIZE;
+
+      while(bracketPos < layout.bracketsEnd && bs[bracketPos])  // (
+      {
+        unsigned int virtualPortPair = readField(bs, numPos, pairWidth);
+        // Same port numbering as processNextVirtualSubtree
+        unsigned long long realPort =
+            virtualPortPair + (port+1ULL) * (1ULL<<PORT_SIZE);
+
+        ++bracketPos;
+        numPos += pairWidth;
+
+        if(realPort > UINT_MAX)
+          throw runtime_error(
+              "Virtual port " + to_string(port) + " out of range");
+
+        int neighbor = topology.neighbor(router, (unsigned int)realPort, delay);
+        dropped += neighbor < 0;
+
+        walkForest(bs, layout, level+2, bracketPos, numPos, neighbor,
+                   topology, deliveries, dropped);
+
+        if(bracketPos >= layout.bracketsEnd)
+          throw runtime_error("Subtree has no closing bracket");
+        ++bracketPos;   // )
+      }
     }
+
+    if(bracketPos >= layout.bracketsEnd)
+      throw runtime_error("Subtree has no closing bracket");
+    ++bracketPos;   // )
   }
+}
 
-  if(currOpenBrackets)
-    throw runtime_error("Subtree has no closing bracket");
+/// Process a real subtree (no virtual port)
+static void
+processNextRealSubtree(
+    unsigned int port,
+    const bitset<HEADER_SIZE> &bs,
+    int &bracketPos,
+    int &numPos,
+    vector<unsigned int> &portToSend,
+    vector<bitset<HEADER_SIZE>> &subtreesToSend)
+{
+  bitset<HEADER_SIZE> newBitset;
 
+  copyRealSubtree(bs, bracketPos, numPos, newBitset);
   portToSend.push_back(port);
   subtreesToSend.push_back(newBitset);
+}
 
-  ++bracketPos;
+/// Copies the children of a real subtree (its port number read) into a
+/// header of their own, stops after the closing bracket of the subtree: their
+/// brackets and their port numbers are two ranges of bits
+static void
+copyRealSubtree(
+    const bitset<HEADER_SIZE> &bs,
+    int &bracketPos,
+    int &numPos,
+    bitset<HEADER_SIZE> &newBitset)
+{
+  unsigned char bytes[HEADER_BYTES + BYTES_PADDING] = {};
+  unsigned char subtree[HEADER_BYTES + BYTES_PADDING] = {};
+  int closePos;
+
+  headerToBytes(bs, bytes);
+
+  try
+  {
+    closePos = closeBracketPos(bytes, bracketPos - 1);
+  }
+  catch(runtime_error &)
+  {
+    // The port numbers of the open brackets up to the end are read first
+    checkPortNumbers(numPos,
+                     (bs & rangeMask(bracketPos, PORTS_START_AT)).count());
+    throw;
+  }
+
+  // The open brackets of the children, each has a port number
+  int ports = (closePos - bracketPos) / 2;
+
+  checkPortNumbers(numPos, ports);
+
+  copyBitRange(bytes, bracketPos, subtree, 0, closePos - bracketPos);
+  copyBitRange(bytes, numPos, subtree, PORTS_START_AT, ports * PORT_SIZE);
+  newBitset = headerFromBytes(subtree);
+
+  numPos += ports * PORT_SIZE;
+  bracketPos = closePos + 1;
+}
+
+/// Jumps over the children of a real subtree (its port number read) by the
+/// size of the subtree, stops after its closing bracket
+static void
+skipRealSubtree(
+    const uint64_t words[BRACKET_WORDS],
+    int &bracketPos,
+    int &numPos)
+{
+  int closePos = closeBracketPos(words, bracketPos - 1);
+
+  // The open brackets of the children, each has a port number
+  numPos += (closePos - bracketPos) / 2 * PORT_SIZE;
+  bracketPos = closePos + 1;
 }
 
 
 /// Process a virtual subtree (virtual port passed as parameter)
-void
+static void
 processNextVirtualSubtree(
     unsigned int port,
-    bitset<HEADER_SIZE> bs,
+    const bitset<HEADER_SIZE> &bs,
     int &bracketPos,
     int &numPos,
     vector<unsigned int> &portToSend,
@@ -231,31 +1677,35 @@ processNextVirtualSubtree(
         "Virtual port " + to_string(port) +
         " has no child at " + to_string(bracketPos+1));
 
-  int virtualPortPair;
-  int realPort;
+  unsigned int virtualPortPair;
+  unsigned long long realPort;
 
   // (
   while(bracketPos<PORTS_START_AT && bs[bracketPos])  // (
   {
     virtualPortPair = readInt(bs, numPos);
     // +1 is mandatory because min(realPort) must be > max(normal port number)
-    realPort = virtualPortPair + (port+1) * (1<<PORT_SIZE);
+    realPort = virtualPortPair + (port+1ULL) * (1ULL<<PORT_SIZE);
+
+    if(realPort > UINT_MAX)
+      throw runtime_error(
+          "Virtual port " + to_string(port) + " out of range");
 
     numPos += PORT_SIZE;
     processNextRealSubtree(
-          realPort, bs, ++bracketPos, numPos, portToSend, subtreesToSend);
+          (unsigned int)realPort, bs, ++bracketPos, numPos, portToSend, subtreesToSend);
   }
 
   ++bracketPos;
 }
 
 /// Call real or virtual subtree processor based on the root port
-bool
+static bool
 processNextSubtree(
-    bitset<HEADER_SIZE> bs,
+    const bitset<HEADER_SIZE> &bs,
     int &bracketPos,
     int &numPos,
-    vector<unsigned int> virtualPorts,
+    const vector<unsigned int> &virtualPorts,
     vector<unsigned int> &portToSend,
     vector<bitset<HEADER_SIZE>> &subtreesToSend)
 {
@@ -283,10 +1733,10 @@ processNextSubtree(
 }
 
 /// Process the header, go through the subtrees
-void
+static void
 processHeader(
-  bitset<HEADER_SIZE> bs,
-  vector<unsigned int> virtualPorts,
+  const bitset<HEADER_SIZE> &bs,
+  const vector<unsigned int> &virtualPorts,
   vector<unsigned int> &portToSend,
   vector<bitset<HEADER_SIZE>> &subtreesToSend)
 {
@@ -309,7 +1759,7 @@ processHeader(
 
 /// Convert a header bitset to its textual form (brackets and port numbers)
 string
-headerToString(bitset<HEADER_SIZE> bs)
+headerToString(const bitset<HEADER_SIZE> &bs)
 {
   string s = "";
   int currOpenBrackets = 0;
@@ -365,8 +1815,371 @@ headerToString(bitset<HEADER_SIZE> bs)
   return s;
 }
 
+/// Convert a header bitset of the selected layout to its textual form
+string
+toString(const bitset<HEADER_SIZE> &bs)
+{
+  return pcontext.compact() ? compactHeaderToString(bs) : headerToString(bs);
+}
+
+/// Reads a field of width bits from a position in a bitset
+static unsigned int
+readField(const bitset<HEADER_SIZE> &bs, size_t pos, int width)
+{
+  unsigned int res = 0;
+
+  if(pos + width > HEADER_SIZE)
+    throw runtime_error("Field out of the header: " + to_string(pos+1));
+
+  for(int i=0; i<width; i++)
+    if(bs[pos+i])
+      res |= 1u << i;
+
+  return res;
+}
+
+/// Sets a field of width bits from a position in a bitset
+static void
+setField(bitset<HEADER_SIZE> &bs, size_t pos, int width, unsigned int num)
+{
+  if(pos + width > HEADER_SIZE)
+    throw runtime_error("Field out of the header: " + to_string(pos+1));
+
+  for(int i=0; i<width; i++)
+  {
+    bs[pos+i] = num%2;
+    num /= 2;
+  }
+}
+
+/// Gets the port number size of the nodes of a tree level
+static int
+levelWidth(const CompactLayout &layout, int level)
+{
+  if(!layout.perLevel)
+    return PORT_SIZE;
+
+  if(level >= (int)layout.widths.size())
+    throw runtime_error("No port number size for level " + to_string(level));
+
+  return layout.widths[level];
+}
+
+/// Reads the fields in front of the brackets of a compact header
+static CompactLayout
+readCompactLayout(const bitset<HEADER_SIZE> &bs)
+{
+  CompactLayout layout;
+  int pos = 0;
+
+  layout.count = readField(bs, pos, COUNT_BITS);
+  pos += COUNT_BITS;
+  layout.perLevel = bs[pos++];
+
+  if(layout.perLevel)
+  {
+    int levels = readField(bs, pos, COUNT_BITS);
+    pos += COUNT_BITS;
+
+    if(pos + levels * WIDTH_BITS > HEADER_SIZE)
+      throw runtime_error("Too many levels, header limit overflow");
+
+    for(int i=0; i<levels; i++, pos += WIDTH_BITS)
+    {
+      int width = readField(bs, pos, WIDTH_BITS);
+      if(width > PORT_SIZE)
+        throw runtime_error("Port number size of level " + to_string(i) +
+                            " is more than " + to_string(PORT_SIZE));
+      layout.widths.push_back(width);
+    }
+  }
+
+  layout.bracketsAt = pos;
+  layout.numbersAt = pos + 2 * layout.count;
+
+  if(layout.numbersAt > HEADER_SIZE)
+    throw runtime_error("Too many open brackets, header limit overflow");
+
+  return layout;
+}
+
+/// Writes the fields in front of the brackets of a compact header (the widths
+/// from firstLevel), returns the position of the brackets
+static int
+writeCompactLayout(
+    bitset<HEADER_SIZE> &bs,
+    int count,
+    bool perLevel,
+    const vector<int> &widths,
+    int firstLevel)
+{
+  int pos = 0;
+
+  setField(bs, pos, COUNT_BITS, count);
+  pos += COUNT_BITS;
+  bs[pos++] = perLevel;
+
+  if(perLevel)
+  {
+    int levels = max((int)widths.size() - firstLevel, 0);
+
+    setField(bs, pos, COUNT_BITS, levels);
+    pos += COUNT_BITS;
+
+    for(int i=0; i<levels; i++, pos += WIDTH_BITS)
+      setField(bs, pos, WIDTH_BITS, widths[firstLevel + i]);
+  }
+
+  return pos;
+}
+
+/// Gets the size of the compact header of a tree, sets the level widths
+int
+compactLayoutSize(const Tree &tree, vector<int> &widths, bool &perLevel)
+{
+  int n = tree.ports.size();
+  vector<int> depths(n);
+  int numberBits = 0;
+
+  widths.clear();
+
+  for(int i=0; i<n; i++)
+  {
+    if(tree.ports[i] > (1u<<PORT_SIZE)-1)
+      throw runtime_error(
+          "Number out of range: "
+          + to_string(tree.ports[i]) + " cannot fit in "
+          + to_string(PORT_SIZE) + " bits");
+
+    depths[i] = tree.parents[i] < 0 ? 0 : depths[tree.parents[i]] + 1;
+
+    if(depths[i] >= (int)widths.size())
+      widths.push_back(0);
+
+    widths[depths[i]] = max(widths[depths[i]], bitWidth(tree.ports[i]));
+  }
+
+  for(int i=0; i<n; i++)
+    numberBits += widths[depths[i]];
+
+  int fixedSize = COUNT_BITS + 1 + 2 * n + n * PORT_SIZE;
+  int levelSize = COUNT_BITS + 1 + COUNT_BITS + widths.size() * WIDTH_BITS
+                  + 2 * n + numberBits;
+
+  perLevel = levelSize < fixedSize;
+
+  return perLevel ? levelSize : fixedSize;
+}
+
+// Gets the compact bitset from the textual form of the header
+bitset<HEADER_SIZE>
+generateCompactHeader(string br, vector<unsigned int> nums)
+{
+  Tree tree = parseTree(br, nums);
+  int n = tree.ports.size();
+  vector<int> widths;
+  bool perLevel;
+  bitset<HEADER_SIZE> bs(0);
+
+  if(compactLayoutSize(tree, widths, perLevel) > HEADER_SIZE)
+    throw runtime_error("Too many open brackets, header limit overflow");
+
+  int pos = writeCompactLayout(bs, n, perLevel, widths, 0);
+  int numPos = pos + 2 * n;
+  int depth = 0;
+  int node = 0;
+
+  for(string::size_type i = 0; i < br.size(); i++, pos++)
+  {
+    if(br[i] == ')')
+    {
+      --depth;
+      continue;
+    }
+
+    int width = perLevel ? widths[depth] : PORT_SIZE;
+
+    bs[pos] = true;
+    setField(bs, numPos, width, tree.ports[node++]);
+    numPos += width;
+    ++depth;
+  }
+
+  return bs;
+}
+
+/// Emit the forest below a node of a compact header (at level) for a port
+static void
+emitCompactSubtree(
+    unsigned int port,
+    const bitset<HEADER_SIZE> &bs,
+    const CompactLayout &layout,
+    int level,
+    int &bracketPos,
+    int &numPos,
+    vector<unsigned int> &portToSend,
+    vector<bitset<HEADER_SIZE>> &subtreesToSend)
+{
+  int bracketsEnd = layout.numbersAt;
+  int firstBracket = bracketPos;
+  int firstNum = numPos;
+  int depth = 0;
+
+  for(;; bracketPos++)
+  {
+    if(bracketPos >= bracketsEnd)
+      throw runtime_error("Subtree has no closing bracket");
+
+    if(bs[bracketPos])
+      numPos += levelWidth(layout, level + depth++);   // (
+    else if(!depth--)                                  // )
+      break;
+  }
+
+  if(numPos > HEADER_SIZE)
+    throw runtime_error("Port number out of the header: " + to_string(numPos));
+
+  int count = (bracketPos - firstBracket) / 2;
+  bitset<HEADER_SIZE> newBitset(0);
+
+  if(count)
+  {
+    int newPos = writeCompactLayout(
+          newBitset, count, layout.perLevel, layout.widths, level);
+
+    if(newPos + (bracketPos - firstBracket) + (numPos - firstNum) > HEADER_SIZE)
+      throw runtime_error("Subtree does not fit in a header");
+
+    for(int i=firstBracket; i<bracketPos; i++, newPos++)
+      newBitset[newPos] = bs[i];
+
+    for(int i=firstNum; i<numPos; i++, newPos++)
+      newBitset[newPos] = bs[i];
+  }
+
+  portToSend.push_back(port);
+  subtreesToSend.push_back(newBitset);
+
+  ++bracketPos;
+}
+
+/// Process a compact header, go through the subtrees
+static void
+processCompactHeader(
+  const bitset<HEADER_SIZE> &bs,
+  const vector<unsigned int> &virtualPorts,
+  vector<unsigned int> &portToSend,
+  vector<bitset<HEADER_SIZE>> &subtreesToSend)
+{
+  CompactLayout layout = readCompactLayout(bs);
+
+  if(!layout.count)
+  {
+    // It is for me
+    portToSend.push_back(0);
+    subtreesToSend.push_back(bitset<HEADER_SIZE>(0));
+    return;
+  }
+
+  int bracketPos = layout.bracketsAt;
+  int numPos = layout.numbersAt;
+
+  while(bracketPos < layout.numbersAt)
+  {
+    if(!bs[bracketPos])
+      throw runtime_error("Closing bracket without open bracket: "
+                          + to_string(bracketPos+1));
+
+    // (
+    unsigned int currPort = readField(bs, numPos, levelWidth(layout, 0));
+    ++bracketPos;
+    numPos += levelWidth(layout, 0);
+
+    if(!any_of(virtualPorts.begin(), virtualPorts.end(), compare(currPort)))
+    {
+      emitCompactSubtree(currPort, bs, layout, 1, bracketPos, numPos,
+                         portToSend, subtreesToSend);
+      continue;
+    }
+
+    if(bracketPos >= layout.numbersAt || !bs[bracketPos])
+      throw runtime_error(
+          "Virtual port " + to_string(currPort) +
+          " has no child at " + to_string(bracketPos+1));
+
+    while(bracketPos < layout.numbersAt && bs[bracketPos])  // (
+    {
+      unsigned int virtualPortPair =
+          readField(bs, numPos, levelWidth(layout, 1));
+      // +1 is mandatory because min(realPort) must be > max(normal port number)
+      unsigned long long realPort =
+          virtualPortPair + (currPort+1ULL) * (1ULL<<PORT_SIZE);
+
+      if(realPort > UINT_MAX)
+        throw runtime_error(
+            "Virtual port " + to_string(currPort) + " out of range");
+
+      numPos += levelWidth(layout, 1);
+      emitCompactSubtree((unsigned int)realPort, bs, layout, 2, ++bracketPos,
+                         numPos, portToSend, subtreesToSend);
+    }
+
+    if(bracketPos >= layout.numbersAt)
+      throw runtime_error("Subtree has no closing bracket");
+
+    ++bracketPos;
+  }
+}
+
+/// Convert a compact header bitset to its textual form
+string
+compactHeaderToString(const bitset<HEADER_SIZE> &bs)
+{
+  CompactLayout layout = readCompactLayout(bs);
+  string s = "";
+  string nums = "";
+  int depth = 0;
+  int numPos = layout.numbersAt;
+
+  for(int pos=layout.bracketsAt; pos<layout.numbersAt; pos++)
+  {
+    if(bs[pos])
+    {
+      int width = levelWidth(layout, depth++);
+
+      if(numPos + width > HEADER_SIZE)
+        throw runtime_error("Too many port numbers, header limit overflow");
+
+      nums.append((nums.size() ? "," : " ") +
+                  to_string(readField(bs, numPos, width)));
+      numPos += width;
+      s.push_back('(');
+    }
+    else
+    {
+      if(!depth--)
+        throw runtime_error("Closing bracket without open bracket: "
+                            + to_string(pos+1));
+      s.push_back(')');
+    }
+  }
+
+  if(depth)
+    throw runtime_error("Not all brackets have been closed (after all)");
+
+  return s + nums;
+}
+
 };
 
+// Ptbm with a layout derived from the header and port size: every open
+// bracket takes two bracket bits and PORT_SIZE number bits
+template<int HEADER_SIZE, int PORT_SIZE>
+using PtbmSized = Ptbm<HEADER_SIZE,
+                       PORT_SIZE,
+                       HEADER_SIZE / (PORT_SIZE + 2),
+                       2 * (HEADER_SIZE / (PORT_SIZE + 2))>;
+
 }
 
 #endif // PTBM_H
@@ -1,5 +1,5 @@
 TEMPLATE = app
-CONFIG += console c++11
+CONFIG += console c++11 thread
 CONFIG -= app_bundle
 CONFIG -= qt
 
@@ -9,4 +9,20 @@ SOURCES += \
 
 HEADERS += \
   cxxopts.hpp \
-  ptbm.h
+  ptbm.h \
+  ptbm-compiler.h \
+  ptbm-config.h \
+  ptbm-forwarder.h \
+  ptbm-grouptable.h \
+  ptbm-optimizer.h \
+  ptbm-outqueue.h \
+  ptbm-packet.h \
+  ptbm-pipeline.h \
+  ptbm-rcu.h \
+  ptbm-server.h \
+  ptbm-shm.h \
+  ptbm-sim.h \
+  ptbm-spsc.h \
+  ptbm-topology.h \
+  ptbm-trace.h \
+  ptbm-uring.h